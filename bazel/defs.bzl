@@ -14,27 +14,14 @@ def picotool_binary_data_header(name, src, out, **kwargs):
     )
 
 def otp_header_parse(name, src, out, **kwargs):
-    json_path = out + ".json"
     run_binary(
-        name = name + "_json",
+        name = name,
         srcs = [src],
-        outs = [json_path],
+        outs = [out],
         args = [
             "$(location {})".format(src),
-            "$(location {})".format(json_path),
+            "$(location {})".format(out),
         ],
         tool = "@picotool//otp_header_parser:otp_header_parser",
         **kwargs
     )
-
-    run_binary(
-        name = name,
-        srcs = [json_path],
-        outs = [out],
-        args = [
-            "$(location {})".format(json_path),
-            "-o=$(location {})".format(out),
-        ],
-        tool = "@picotool//bazel:jsonh",
-        **kwargs
-    )
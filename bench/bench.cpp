@@ -0,0 +1,346 @@
+/*
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <regex>
+#include <sstream>
+
+#include "bench.h"
+#include "nlohmann/json.hpp"
+#include "boot/picobin.h"
+#include "boot/uf2.h"
+#include "elf.h"
+#include "elf2uf2.h"
+#include "bintool.h"
+#include "errors.h"
+#include "model.h"
+#include "otp.h"
+
+using json = nlohmann::json;
+
+namespace bench {
+    static config settings;
+
+    const config &get_config() {
+        return settings;
+    }
+
+    struct registration {
+        std::string name;
+        function fn;
+    };
+
+    static std::vector<registration> &registrations() {
+        static std::vector<registration> r;
+        return r;
+    }
+
+    registrar::registrar(const char *name, function fn) {
+        registrations().push_back({name, fn});
+    }
+
+    bool state::keep_running() {
+        if (!started) {
+            started = true;
+            real_start = std::chrono::steady_clock::now();
+            cpu_start = std::clock();
+            return true;
+        }
+        iterations++;
+        auto real = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - real_start).count();
+        if (real_ns + real < min_time * 1e9) return true;
+        real_ns += real;
+        cpu_ns += (std::clock() - cpu_start) * (1e9 / CLOCKS_PER_SEC);
+        return false;
+    }
+
+    void state::pause_timing() {
+        real_ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - real_start).count();
+        cpu_ns += (std::clock() - cpu_start) * (1e9 / CLOCKS_PER_SEC);
+    }
+
+    void state::resume_timing() {
+        real_start = std::chrono::steady_clock::now();
+        cpu_start = std::clock();
+    }
+
+    // deterministic, so every run works on the same firmware
+    static uint32_t next_random(uint32_t &x) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        return x;
+    }
+
+    std::vector<uint8_t> synthetic_bin() {
+        std::vector<uint32_t> words((settings.size + 3) / 4);
+        uint32_t seed = 0x2350u;
+        for (auto &w : words) {
+            w = next_random(seed);
+            // keep the block markers out of the code, so there is only the one block loop
+            if (w == PICOBIN_BLOCK_MARKER_START || w == PICOBIN_BLOCK_MARKER_END) w ^= 1;
+        }
+        // vector table, with all the handlers at the reset handler just after the block loop
+        const uint32_t block_offset = 0x100;
+        for (uint32_t i = 0; i < block_offset / 4 && i < words.size(); i++) {
+            words[i] = i ? FLASH_START + 0x201 : SRAM_END_RP2350;
+        }
+        uint16_t image_type = (PICOBIN_IMAGE_TYPE_IMAGE_TYPE_EXE << PICOBIN_IMAGE_TYPE_IMAGE_TYPE_LSB) |
+                              (PICOBIN_IMAGE_TYPE_EXE_SECURITY_S << PICOBIN_IMAGE_TYPE_EXE_SECURITY_LSB) |
+                              (PICOBIN_IMAGE_TYPE_EXE_CPU_ARM << PICOBIN_IMAGE_TYPE_EXE_CPU_LSB) |
+                              (PICOBIN_IMAGE_TYPE_EXE_CHIP_RP2350 << PICOBIN_IMAGE_TYPE_EXE_CHIP_LSB);
+        block image_def(FLASH_START + block_offset, 0, 0, {std::make_shared<image_type_item>(image_type)});
+        auto block_words = image_def.to_words();
+        if (words.size() < block_offset / 4 + block_words.size()) {
+            fail(ERROR_ARGS, "The firmware size is too small");
+        }
+        std::copy(block_words.begin(), block_words.end(), words.begin() + block_offset / 4);
+        auto bin = words_to_lsb_bytes(words.begin(), words.end());
+        bin.resize(settings.size);
+        return bin;
+    }
+
+    std::vector<uint8_t> synthetic_elf() {
+        auto bin = synthetic_bin();
+        unsigned int segments = settings.segments ? settings.segments : 1;
+        // word aligned segments, the first of which must hold the block loop
+        uint32_t segment_size = ((uint32_t)bin.size() / segments + 3) & ~3u;
+        if (segment_size < 0x200) {
+            fail(ERROR_ARGS, "Too many segments for the firmware size");
+        }
+        elf32_header eh = {};
+        eh.common.magic = ELF_MAGIC;
+        eh.common.arch_class = 1;
+        eh.common.endianness = 1;
+        eh.common.version = 1;
+        eh.common.type = 2; // executable
+        eh.common.machine = EM_ARM;
+        eh.common.version2 = 1;
+        eh.entry = FLASH_START + 0x201;
+        eh.ph_offset = sizeof(eh);
+        eh.eh_size = sizeof(eh);
+        eh.ph_entry_size = sizeof(elf32_ph_entry);
+        std::vector<elf32_ph_entry> entries;
+        uint32_t data_offset = sizeof(eh) + segments * sizeof(elf32_ph_entry);
+        uint32_t addr = FLASH_START;
+        for (uint32_t from = 0; from < bin.size(); from += segment_size) {
+            elf32_ph_entry ph = {};
+            ph.type = PT_LOAD;
+            ph.offset = data_offset + from;
+            ph.vaddr = ph.paddr = addr;
+            ph.filez = ph.memsz = std::min(segment_size, (uint32_t)bin.size() - from);
+            ph.flags = PF_R | PF_X;
+            ph.align = 4;
+            entries.push_back(ph);
+            addr += ph.filez + ((settings.gap + 3) & ~3u);
+        }
+        eh.ph_num = entries.size();
+        std::vector<uint8_t> elf(data_offset);
+        memcpy(elf.data(), &eh, sizeof(eh));
+        memcpy(elf.data() + sizeof(eh), entries.data(), entries.size() * sizeof(elf32_ph_entry));
+        elf.insert(elf.end(), bin.begin(), bin.end());
+        return elf;
+    }
+
+    std::vector<uint8_t> synthetic_uf2() {
+        auto bin = synthetic_bin();
+        auto in = std::make_shared<std::stringstream>(std::string(bin.begin(), bin.end()));
+        auto out = std::make_shared<std::stringstream>();
+        bin2uf2(in, out, FLASH_START, RP2350_ARM_S_FAMILY_ID, std::make_shared<model_rp2350>());
+        auto s = out->str();
+        return std::vector<uint8_t>(s.begin(), s.end());
+    }
+}
+
+using bench::state;
+
+static std::shared_ptr<std::stringstream> to_stream(const std::vector<uint8_t> &data) {
+    return std::make_shared<std::stringstream>(std::string(data.begin(), data.end()));
+}
+
+static void bench_elf2uf2(state &st) {
+    auto elf = bench::synthetic_elf();
+    model_t model = std::make_shared<model_rp2350>();
+    while (st.keep_running()) {
+        auto out = std::make_shared<std::stringstream>();
+        elf2uf2(to_stream(elf), out, RP2350_ARM_S_FAMILY_ID, model);
+    }
+    st.set_bytes_per_iteration(elf.size());
+}
+BENCHMARK(elf2uf2);
+
+static void bench_bin2uf2(state &st) {
+    auto bin = bench::synthetic_bin();
+    model_t model = std::make_shared<model_rp2350>();
+    while (st.keep_running()) {
+        auto out = std::make_shared<std::stringstream>();
+        bin2uf2(to_stream(bin), out, FLASH_START, RP2350_ARM_S_FAMILY_ID, model);
+    }
+    st.set_bytes_per_iteration(bin.size());
+}
+BENCHMARK(bin2uf2);
+
+static void bench_find_first_block_bin(state &st) {
+    auto bin = bench::synthetic_bin();
+    while (st.keep_running()) {
+        auto first_block = find_first_block(bin, FLASH_START);
+        if (!first_block) fail(ERROR_FORMAT, "No block found");
+    }
+}
+BENCHMARK(find_first_block_bin);
+
+static void bench_find_first_block_elf(state &st) {
+    auto data = bench::synthetic_elf();
+    elf_file elf;
+    elf.read_file(to_stream(data));
+    while (st.keep_running()) {
+        auto first_block = find_first_block(&elf);
+        if (!first_block) fail(ERROR_FORMAT, "No block found");
+    }
+}
+BENCHMARK(find_first_block_elf);
+
+static void bench_get_all_blocks(state &st) {
+    auto bin = bench::synthetic_bin();
+    auto first_block = find_first_block(bin, FLASH_START);
+    while (st.keep_running()) {
+        auto blocks = get_all_blocks(bin, FLASH_START, first_block);
+    }
+}
+BENCHMARK(get_all_blocks);
+
+#if HAS_MBEDTLS
+static void bench_hash_andor_sign(state &st) {
+    auto bin = bench::synthetic_bin();
+    public_t public_key = {};
+    private_t private_key = {};
+    while (st.keep_running()) {
+        st.pause_timing();
+        auto copy = bin;
+        auto first_block = find_first_block(copy, FLASH_START);
+        st.resume_timing();
+        block new_block = place_new_block(copy, FLASH_START, first_block);
+        hash_andor_sign(copy, FLASH_START, FLASH_START, &new_block, public_key, private_key, true, false);
+    }
+    st.set_bytes_per_iteration(bin.size());
+}
+BENCHMARK(hash_andor_sign);
+
+static void bench_encrypt(state &st) {
+    auto bin = bench::synthetic_bin();
+    aes_key_t aes_key = {};
+    public_t public_key = {};
+    private_t private_key = {};
+    std::vector<uint8_t> iv_salt(16, 0x5a);
+    while (st.keep_running()) {
+        st.pause_timing();
+        auto copy = bin;
+        auto first_block = find_first_block(copy, FLASH_START);
+        st.resume_timing();
+        block new_block = place_new_block(copy, FLASH_START, first_block);
+        encrypt(copy, FLASH_START, FLASH_START, &new_block, aes_key, public_key, private_key, iv_salt, true, false);
+    }
+    st.set_bytes_per_iteration(bin.size());
+}
+BENCHMARK(encrypt);
+#endif
+
+static void bench_init_otp(state &st) {
+    while (st.keep_running()) {
+        otp_reg_list regs;
+        init_otp(regs);
+    }
+}
+BENCHMARK(init_otp);
+
+static const char *usage =
+    "usage: picotool_bench [--filter <regex>] [--out <file>] [--min-time <s>] [--size <bytes>] [--segments <n>] [--gap <bytes>]\n";
+
+int main(int argc, char **argv) {
+    std::string filter;
+    std::string out;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << usage;
+            return ERROR_ARGS;
+        }
+        std::string value = argv[++i];
+        if (arg == "--filter") {
+            filter = value;
+        } else if (arg == "--out") {
+            out = value;
+        } else if (arg == "--min-time") {
+            bench::settings.min_time = std::stod(value);
+        } else if (arg == "--size") {
+            bench::settings.size = std::stoul(value, nullptr, 0);
+        } else if (arg == "--segments") {
+            bench::settings.segments = std::stoul(value, nullptr, 0);
+        } else if (arg == "--gap") {
+            bench::settings.gap = std::stoul(value, nullptr, 0);
+        } else {
+            std::cerr << usage;
+            return ERROR_ARGS;
+        }
+    }
+
+    std::regex filter_regex(filter.empty() ? ".*" : filter);
+    json results;
+    results["context"]["executable"] = argv[0];
+    results["context"]["picotool_version"] = PICOTOOL_VERSION;
+    results["context"]["compiler"] = COMPILER_INFO;
+    results["context"]["firmware_size"] = bench::settings.size;
+    results["context"]["segments"] = bench::settings.segments;
+    results["context"]["gap"] = bench::settings.gap;
+    results["benchmarks"] = json::array();
+    int rc = 0;
+    for (const auto &r : bench::registrations()) {
+        if (!std::regex_search(r.name, filter_regex)) continue;
+        state st(bench::settings.min_time);
+        json j;
+        j["name"] = r.name;
+        j["run_name"] = r.name;
+        j["run_type"] = "iteration";
+        j["time_unit"] = "ns";
+        try {
+            r.fn(st);
+        } catch (failure_error &e) {
+            j["error_occurred"] = true;
+            j["error_message"] = e.what();
+            std::cout << r.name << ": ERROR: " << e.what() << "\n";
+            results["benchmarks"].push_back(j);
+            rc = ERROR_UNKNOWN;
+            continue;
+        }
+        uint64_t iterations = st.iterations ? st.iterations : 1;
+        j["iterations"] = iterations;
+        j["real_time"] = st.real_ns / iterations;
+        j["cpu_time"] = st.cpu_ns / iterations;
+        printf("%-32s %14.0f ns %14.0f ns %10llu", r.name.c_str(), st.real_ns / iterations, st.cpu_ns / iterations,
+               (unsigned long long)iterations);
+        if (st.bytes_per_iteration && st.real_ns) {
+            double bytes_per_second = st.bytes_per_iteration * iterations * 1e9 / st.real_ns;
+            j["bytes_per_second"] = bytes_per_second;
+            printf(" %10.2f MB/s", bytes_per_second / 1e6);
+        }
+        printf("\n");
+        fflush(stdout);
+        results["benchmarks"].push_back(j);
+    }
+    if (!out.empty()) {
+        std::ofstream file(out);
+        file << results.dump(2) << "\n";
+        if (file.fail()) {
+            std::cerr << "ERROR: Could not write " << out << "\n";
+            return ERROR_WRITE_FAILED;
+        }
+    }
+    return rc;
+}
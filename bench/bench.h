@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <vector>
+
+// Minimal benchmark harness for picotool_bench. BENCHMARK(name) registers the function bench_<name>, which times its body
+// with "while (state.keep_running()) { ... }", which runs it until the minimum time has passed. The results are
+// written as JSON in the same layout as Google Benchmark, so existing tooling can track them
+namespace bench {
+    // Shape of the synthetic firmware the benchmarks work on, set from the command line
+    struct config {
+        uint32_t size = 256 * 1024;     // bytes of firmware
+        unsigned int segments = 4;      // number of ELF load segments it is split into
+        uint32_t gap = 0;               // unmapped bytes between the segments
+        double min_time = 0.5;          // seconds to run each benchmark for
+    };
+    const config &get_config();
+
+    struct state {
+        explicit state(double min_time) : min_time(min_time) {}
+
+        bool keep_running();
+        // exclude per iteration setup from the timing
+        void pause_timing();
+        void resume_timing();
+        // bytes handled by each iteration, for the throughput
+        void set_bytes_per_iteration(uint64_t bytes) { bytes_per_iteration = bytes; }
+
+        uint64_t iterations = 0;
+        uint64_t bytes_per_iteration = 0;
+        double real_ns = 0;
+        double cpu_ns = 0;
+
+    private:
+        double min_time;
+        bool started = false;
+        std::chrono::steady_clock::time_point real_start;
+        std::clock_t cpu_start = 0;
+    };
+
+    typedef void (*function)(state &);
+    struct registrar {
+        registrar(const char *name, function fn);
+    };
+
+    // Synthetic RP2350 Arm firmware of config size, in flash at FLASH_START, with a vector table, a single block
+    // loop containing an IMAGE_DEF, and pseudo-random code
+    std::vector<uint8_t> synthetic_bin();
+    // The same firmware as an ELF file, split into config segments load segments separated by config gap bytes
+    std::vector<uint8_t> synthetic_elf();
+    // The firmware converted to UF2
+    std::vector<uint8_t> synthetic_uf2();
+}
+
+#define BENCHMARK(name) static bench::registrar bench_registrar_##name(#name, bench_##name)
+
+#endif
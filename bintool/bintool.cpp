@@ -6,6 +6,9 @@
 #include <random>
 #include <cinttypes>
 #include <tuple>
+#include <functional>
+#include <deque>
+#include <thread>
 
 #include "boot/picobin.h"
 #include <map>
@@ -22,6 +25,7 @@
 #include "bintool.h"
 #include "metadata.h"
 #include "errors.h"
+#include "crc32.h"
 
 // todo test with a holey binary
 
@@ -129,11 +133,60 @@ void write_otp_key_yaml(const std::string &filename, message_digest_t pub_sha256
 #endif
 
 
+static uint32_t lsb_word(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Walks the item headers of the block at data in place, returning the size of the block in bytes (including both
+// markers), or 0 if it isn't a valid block. If the size bytes available aren't enough to tell, needed is set to the
+// number of bytes to look at
+static uint32_t block_extent(const uint8_t *data, uint32_t size, uint32_t &needed) {
+    needed = 0;
+    uint32_t pos = 4;
+    while (pos < PICOBIN_MAX_BLOCK_SIZE) {
+        if (pos + 4 > size) {
+            needed = pos + 4;
+            return 0;
+        }
+        uint32_t header = lsb_word(data + pos);
+        uint32_t item_words = item::decode_size(header);
+        if ((uint8_t)header == PICOBIN_BLOCK_ITEM_2BS_LAST) {
+            // the last item holds the size of the other items, and is followed by next_block_rel and the end marker
+            if (item_words * 4 != pos - 4) return 0;
+            if (pos + 12 > size) {
+                needed = pos + 12;
+                return 0;
+            }
+            return lsb_word(data + pos + 8) == PICOBIN_BLOCK_MARKER_END ? pos + 12 : 0;
+        }
+        if (!item_words) return 0;
+        pos += item_words * 4;
+    }
+    return 0;
+}
+
+// Parses a block from its words, which include both markers
+static std::unique_ptr<block> parse_block_words(uint32_t addr, const std::vector<uint32_t> &words) {
+    auto last_item = words.end() - 3;
+    return block::parse(addr, last_item + 1, words.begin() + 1, last_item);
+}
+
+// Parses the block of block_size bytes at data, converting only its words into the words buffer, which is
+// reused between calls
+static std::unique_ptr<block> parse_block_bytes(uint32_t addr, const uint8_t *data, uint32_t block_size, std::vector<uint32_t> &words) {
+    words.resize(block_size / 4);
+    for (uint32_t i = 0; i < words.size(); i++) {
+        words[i] = lsb_word(data + i * 4);
+    }
+    return parse_block_words(addr, words);
+}
+
+
 std::unique_ptr<block> find_first_block(elf_file *elf) {
     std::unique_ptr<block> first_block;
     for(auto x : sorted_segs(elf)) {
         if (!x->is_load()) continue;
-        auto data = elf->content(*x); // x->content(*elf);
+        auto data = elf->content_view(*x);
         // todo handle alignment (not sure if necessary)
         if ((x->physical_address() & 3) || (x->physical_size() & 3)) {
             fail(ERROR_INCOMPATIBLE, "ELF segments must be word aligned");
@@ -318,33 +371,26 @@ block place_new_block(elf_file *elf, std::unique_ptr<block> &first_block, bool s
         DEBUG_LOG("There is already a block loop\n");
         if (set_others_ignored) set_block_ignored(elf, first_block->physical_addr);
         uint32_t next_block_addr = first_block->physical_addr + first_block->next_block_rel;
+        std::vector<uint32_t> words;
         while (true) {
             auto segment = elf->segment_from_physical_address(next_block_addr);
             if (segment == nullptr) {
                 fail(ERROR_NOT_POSSIBLE, "The ELF file does not contain the next block address %x", next_block_addr);
             }
-            auto data = elf->content(*segment);
-            auto offset = next_block_addr - segment->physical_address();
-            std::vector<uint32_t> words = lsb_bytes_to_words(data.begin() + offset, data.end());
-            if (words.front() != PICOBIN_BLOCK_MARKER_START) {
+            auto data = elf->content_view(*segment);
+            uint32_t offset = next_block_addr - segment->physical_address();
+            uint32_t avail = data.size() - std::min((uint32_t)data.size(), offset);
+            if (avail < 4 || lsb_word(data.data() + offset) != PICOBIN_BLOCK_MARKER_START) {
                 fail(ERROR_UNKNOWN, "Block loop is not valid - no block found at %08x\n", (int)(next_block_addr));
             }
-            words.erase(words.begin());
             DEBUG_LOG("Checking block at %x\n", next_block_addr);
-            for(auto next_item = words.begin(); next_item < words.end(); ) {
-                unsigned int size = item::decode_size(*next_item);
-                if ((uint8_t)*next_item == PICOBIN_BLOCK_ITEM_2BS_LAST) {
-                    if (size == next_item - words.begin()) {
-                        if (next_item < words.end() && next_item[2] == PICOBIN_BLOCK_MARKER_END) {
-                            DEBUG_LOG("is a valid block\n");
-                            new_first_block = block::parse(next_block_addr, next_item + 1, words.begin(), words.begin() + size);
-                            break;
-                        }
-                    }
-                } else {
-                    next_item += size;
-                }
+            uint32_t needed;
+            uint32_t block_size = block_extent(data.data() + offset, avail, needed);
+            if (!block_size) {
+                fail(ERROR_UNKNOWN, "Block loop is not valid - incomplete block found at %08x\n", (int)(next_block_addr));
             }
+            DEBUG_LOG("is a valid block\n");
+            new_first_block = parse_block_bytes(next_block_addr, data.data() + offset, block_size, words);
             if (new_first_block->physical_addr + new_first_block->next_block_rel == first_block->physical_addr) {
                 DEBUG_LOG("Found last block in block loop\n");
                 break;
@@ -396,42 +442,50 @@ block place_new_block(elf_file *elf, std::unique_ptr<block> &first_block, bool s
 }
 
 
-std::vector<std::unique_ptr<block>> get_all_blocks(std::vector<uint8_t> &bin, uint32_t storage_addr, std::unique_ptr<block> &first_block, get_more_bin_cb more_cb) {
+std::vector<std::unique_ptr<block>> get_all_blocks(std::vector<uint8_t> &bin, uint32_t storage_addr, std::unique_ptr<block> &first_block, get_more_bin_cb more_cb, block_cache *cache) {
+    // blocks are usually much smaller than PICOBIN_MAX_BLOCK_SIZE, so only read ahead this much at first
+    const uint32_t block_read_ahead = 0x100;
     uint32_t next_block_addr = first_block->physical_addr + first_block->next_block_rel;
     std::vector<std::unique_ptr<block>> all_blocks;
-    uint32_t read_size = PICOBIN_MAX_BLOCK_SIZE;
+    std::vector<uint32_t> words;
     uint32_t current_bin_start = storage_addr;
     while (true) {
         std::unique_ptr<block> new_first_block;
-        if (next_block_addr + read_size > current_bin_start + bin.size() && more_cb != nullptr) {
-            DEBUG_LOG("Reading into bin %08x+%x\n", next_block_addr, read_size);
-            more_cb(bin, next_block_addr, read_size);
-            current_bin_start = next_block_addr;
-        }
-        auto offset = next_block_addr - current_bin_start;
-        std::vector<uint32_t> words = lsb_bytes_to_words(bin.begin() + offset, bin.end());
-        if (words.front() != PICOBIN_BLOCK_MARKER_START) {
-            fail(ERROR_UNKNOWN, "Block loop is not valid - no block found at %08x\n", (int)(next_block_addr));
-        }
-        words.erase(words.begin());
-        DEBUG_LOG("Checking block at %x\n", next_block_addr);
-        DEBUG_LOG("Starts with %x %x %x %x\n", words[0], words[1], words[2], words[3]);
-        for(auto next_item = words.begin(); next_item < words.end(); ) {
-            unsigned int size = item::decode_size(*next_item);
-            if ((uint8_t)*next_item == PICOBIN_BLOCK_ITEM_2BS_LAST) {
-                if (size == next_item - words.begin()) {
-                    if (next_item < words.end() && next_item[2] == PICOBIN_BLOCK_MARKER_END) {
-                        DEBUG_LOG("is a valid block\n");
-                        new_first_block = block::parse(next_block_addr, next_item + 1, words.begin(), words.begin() + size);
-                        break;
-                    }
+        auto cached = cache ? cache->find(next_block_addr) : block_cache::iterator();
+        if (cache && cached != cache->end()) {
+            DEBUG_LOG("Using cached block at %x\n", next_block_addr);
+            new_first_block = parse_block_words(next_block_addr, cached->second);
+        } else {
+            uint32_t read_size = block_read_ahead;
+            uint32_t block_size;
+            while (true) {
+                uint32_t offset = next_block_addr - current_bin_start;
+                uint32_t avail = next_block_addr >= current_bin_start ? bin.size() - std::min((uint32_t)bin.size(), offset) : 0;
+                if (avail < read_size && more_cb != nullptr) {
+                    DEBUG_LOG("Reading into bin %08x+%x\n", next_block_addr, read_size);
+                    more_cb(bin, next_block_addr, read_size);
+                    current_bin_start = next_block_addr;
+                    offset = 0;
+                    avail = bin.size();
                 }
-            } else {
-                next_item += size;
+                if (avail < 4 || lsb_word(bin.data() + offset) != PICOBIN_BLOCK_MARKER_START) {
+                    fail(ERROR_UNKNOWN, "Block loop is not valid - no block found at %08x\n", (int)(next_block_addr));
+                }
+                DEBUG_LOG("Checking block at %x\n", next_block_addr);
+                uint32_t needed;
+                block_size = block_extent(bin.data() + offset, avail, needed);
+                if (!block_size && needed > avail && more_cb != nullptr && read_size < PICOBIN_MAX_BLOCK_SIZE) {
+                    read_size = PICOBIN_MAX_BLOCK_SIZE;
+                    continue;
+                }
+                if (!block_size) {
+                    fail(ERROR_UNKNOWN, "Block loop is not valid - incomplete block found at %08x\n", (int)(next_block_addr));
+                }
+                DEBUG_LOG("is a valid block\n");
+                new_first_block = parse_block_bytes(next_block_addr, bin.data() + offset, block_size, words);
+                break;
             }
-        }
-        if (new_first_block == nullptr) {
-            fail(ERROR_UNKNOWN, "Block loop is not valid - incomplete block found at %08x\n", (int)(next_block_addr));
+            if (cache) (*cache)[next_block_addr] = words;
         }
         if (new_first_block->physical_addr + new_first_block->next_block_rel == first_block->physical_addr) {
             DEBUG_LOG("Found last block in block loop\n");
@@ -447,8 +501,8 @@ std::vector<std::unique_ptr<block>> get_all_blocks(std::vector<uint8_t> &bin, ui
 }
 
 
-std::unique_ptr<block> get_last_block(std::vector<uint8_t> &bin, uint32_t storage_addr, std::unique_ptr<block> &first_block, get_more_bin_cb more_cb) {
-    auto all_blocks = get_all_blocks(bin, storage_addr, first_block, more_cb);
+std::unique_ptr<block> get_last_block(std::vector<uint8_t> &bin, uint32_t storage_addr, std::unique_ptr<block> &first_block, get_more_bin_cb more_cb, block_cache *cache) {
+    auto all_blocks = get_all_blocks(bin, storage_addr, first_block, more_cb, cache);
     return std::move(all_blocks.back());
 }
 
@@ -535,126 +589,16 @@ block place_new_block(std::vector<uint8_t> &bin, uint32_t storage_addr, std::uni
 
 
 // Checksum stuff
-uint32_t poly8_lookup[256] =
-{
- 0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA,
- 0x076DC419, 0x706AF48F, 0xE963A535, 0x9E6495A3,
- 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988,
- 0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91,
- 0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE,
- 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
- 0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC,
- 0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5,
- 0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172,
- 0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B,
- 0x35B5A8FA, 0x42B2986C, 0xDBBBC9D6, 0xACBCF940,
- 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
- 0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116,
- 0x21B4F4B5, 0x56B3C423, 0xCFBA9599, 0xB8BDA50F,
- 0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924,
- 0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D,
- 0x76DC4190, 0x01DB7106, 0x98D220BC, 0xEFD5102A,
- 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
- 0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818,
- 0x7F6A0DBB, 0x086D3D2D, 0x91646C97, 0xE6635C01,
- 0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E,
- 0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457,
- 0x65B0D9C6, 0x12B7E950, 0x8BBEB8EA, 0xFCB9887C,
- 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
- 0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2,
- 0x4ADFA541, 0x3DD895D7, 0xA4D1C46D, 0xD3D6F4FB,
- 0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0,
- 0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9,
- 0x5005713C, 0x270241AA, 0xBE0B1010, 0xC90C2086,
- 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
- 0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4,
- 0x59B33D17, 0x2EB40D81, 0xB7BD5C3B, 0xC0BA6CAD,
- 0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A,
- 0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683,
- 0xE3630B12, 0x94643B84, 0x0D6D6A3E, 0x7A6A5AA8,
- 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
- 0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE,
- 0xF762575D, 0x806567CB, 0x196C3671, 0x6E6B06E7,
- 0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC,
- 0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5,
- 0xD6D6A3E8, 0xA1D1937E, 0x38D8C2C4, 0x4FDFF252,
- 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
- 0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60,
- 0xDF60EFC3, 0xA867DF55, 0x316E8EEF, 0x4669BE79,
- 0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236,
- 0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F,
- 0xC5BA3BBE, 0xB2BD0B28, 0x2BB45A92, 0x5CB36A04,
- 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
- 0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A,
- 0x9C0906A9, 0xEB0E363F, 0x72076785, 0x05005713,
- 0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38,
- 0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21,
- 0x86D3D2D4, 0xF1D4E242, 0x68DDB3F8, 0x1FDA836E,
- 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
- 0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C,
- 0x8F659EFF, 0xF862AE69, 0x616BFFD3, 0x166CCF45,
- 0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2,
- 0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB,
- 0xAED16A4A, 0xD9D65ADC, 0x40DF0B66, 0x37D83BF0,
- 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
- 0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6,
- 0xBAD03605, 0xCDD70693, 0x54DE5729, 0x23D967BF,
- 0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
- 0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
-};
-
-uint32_t crc32_byte(const uint8_t *p, uint32_t bytelength)
-{
-	uint32_t crc = 0xffffffff;
-	while (bytelength-- !=0) crc = poly8_lookup[((uint8_t) crc ^ *(p++))] ^ (crc >> 8);
-	return crc;
-}
-
-uint8_t rev_8(uint8_t b) {
-    b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
-    b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
-    b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
-    return b;
-}
-
-uint32_t rev_32(uint32_t b) {
-    uint8_t b0 = rev_8(b >> 24);
-    uint8_t b1 = rev_8(b >> 16);
-    uint8_t b2 = rev_8(b >> 8);
-    uint8_t b3 = rev_8(b);
-    return (b3 << 24) | (b2 << 16) | (b1 << 8) | b0;
-}
-
-void crc32(const uint8_t *data, size_t len, uint32_t* cs_out) {
-    uint8_t rev_data[252] = {};
-    for (size_t i=0; i < sizeof(rev_data); i++) {
-        rev_data[i] = rev_8(data[i]);
-    }
-
-    uint32_t crc = crc32_byte(rev_data, sizeof(rev_data));
-
-    crc = rev_32(crc);
-
-    *cs_out = crc;
-}
-
 uint32_t calc_checksum(std::vector<uint8_t> bin) {
     assert(bin.size() == 252);
 
-    uint32_t checksum = 0;
-    crc32(bin.data(), bin.size(), &checksum);
-
-    return checksum;
+    return crc32_msb(bin.data(), bin.size(), 0xffffffff);
 }
 
 
 #if HAS_MBEDTLS
-void hash_andor_sign_block(block *new_block, const public_t public_key, const private_t private_key, bool hash_value, bool sign, std::vector<uint8_t> to_hash) {
-    if (!(hash_value || sign)) {
-        // Don't need to add anything if not actually hashing or signing
-        return;
-    }
-
+// Finish hashing (lm_hash has already been fed the load map data), then add the hash and/or signature to the block
+static void hash_andor_sign_block(block *new_block, const public_t public_key, const private_t private_key, bool hash_value, bool sign, sha256_ctx_t *lm_hash) {
     std::shared_ptr<hash_def_item> hash_def = std::make_shared<hash_def_item>(PICOBIN_HASH_SHA256);
     new_block->items.push_back(hash_def);
 
@@ -670,10 +614,10 @@ void hash_andor_sign_block(block *new_block, const public_t public_key, const pr
         }
     }
     auto block_hashed_contents = words_to_lsb_bytes(tmp_words.begin(), tmp_words.end() - 3); // remove stuff at end
-    std::copy(block_hashed_contents.begin(), block_hashed_contents.end(), std::back_inserter(to_hash));
+    sha256_update(lm_hash, block_hashed_contents.data(), block_hashed_contents.size());
 
     message_digest_t sha256;
-    sha256_buffer(to_hash.data(), to_hash.size(), &sha256);
+    sha256_finish(lm_hash, &sha256);
     dumper("SHA256", sha256);
 
     if (sign) {
@@ -710,8 +654,24 @@ void hash_andor_sign_block(block *new_block, const public_t public_key, const pr
 }
 
 
-std::vector<uint8_t> get_lm_hash_data(elf_file *elf, block *new_block, bool clear_sram = false) {
-    std::vector<uint8_t> to_hash;
+void hash_andor_sign_block(block *new_block, const public_t public_key, const private_t private_key, bool hash_value, bool sign, const std::vector<uint8_t> &to_hash) {
+    if (!(hash_value || sign)) {
+        // Don't need to add anything if not actually hashing or signing
+        return;
+    }
+    sha256_ctx_t lm_hash;
+    sha256_start(&lm_hash);
+    sha256_update(&lm_hash, to_hash.data(), to_hash.size());
+    hash_andor_sign_block(new_block, public_key, private_key, hash_value, sign, &lm_hash);
+}
+
+
+// The data covered by the load map is passed to the sink in order, piece by piece, rather than being
+// copied into one buffer (it can be as big as the whole image). A piece is only valid during the call,
+// unless in_elf is set: then it is part of the ELF's contents, and stays valid as long as the elf_file
+typedef std::function<void(const uint8_t *data, size_t len, bool in_elf)> lm_data_sink;
+
+static void visit_lm_data(elf_file *elf, block *new_block, const lm_data_sink &sink, bool clear_sram) {
     std::shared_ptr<load_map_item> load_map = new_block->get_item<load_map_item>();
     if (load_map == nullptr) {
         std::vector<load_map_item::entry> entries;
@@ -724,18 +684,18 @@ std::vector<uint8_t> get_lm_hash_data(elf_file *elf, block *new_block, bool clea
                 sram_size_vec[0]
             });
             auto sram_size_data = words_to_lsb_bytes(sram_size_vec.begin(), sram_size_vec.end());
-            std::copy(sram_size_data.begin(), sram_size_data.end(), std::back_inserter(to_hash));
+            sink(sram_size_data.data(), sram_size_data.size(), false);
             DEBUG_LOG("CLEAR %08x + %08x\n", (int)SRAM_START, (int)sram_size_vec[0]);
         }
         for(const auto &seg : sorted_segs(elf)) {
             if (!seg->is_load()) continue;
-            const auto data = elf->content(*seg);
+            const auto data = elf->content_view(*seg);
             // std::cout << "virt = " << std::hex << seg->virtual_address() << " + " << std::hex << seg->virtual_size() << ", phys = " << std::hex << seg->physical_address() << " + " << std::hex << seg->physical_size() << std::endl;
             if (data.size() != seg->physical_size()) {
                 fail(ERROR_INCOMPATIBLE, "Elf segment physical size (%" PRIx32 ") does not match data size in file (%zx)", seg->physical_size(), data.size());
             }
             if (seg->physical_size()) {
-                std::copy(data.begin(), data.end(), std::back_inserter(to_hash));
+                sink(data.data(), data.size(), true);
                 DEBUG_LOG("HASH %08x + %08x\n", (int)seg->physical_address(), (int)seg->physical_size());
                 entries.push_back(
                     {
@@ -752,43 +712,38 @@ std::vector<uint8_t> get_lm_hash_data(elf_file *elf, block *new_block, bool clea
         DEBUG_LOG("Already has load map, so hashing that\n");
         // todo hash existing load map
         for(const auto &entry : load_map->entries) {
-            std::vector<uint8_t> data;
             uint32_t current_storage_address = entry.storage_address;
             if (current_storage_address == 0) {
-                std::copy(
-                    (uint8_t*)&entry.size,
-                    (uint8_t*)&entry.size + sizeof(entry.size),
-                    std::back_inserter(to_hash));
+                sink((const uint8_t*)&entry.size, sizeof(entry.size), false);
                 DEBUG_LOG("CLEAR %08x + %08x\n", (int)entry.runtime_address, (int)entry.size);
             } else {
-                while (data.size() < entry.size) {
+                uint32_t remaining = entry.size;
+                while (remaining) {
                     auto seg = elf->segment_from_physical_address(current_storage_address);
                     if (seg == nullptr) {
                         fail(ERROR_NOT_POSSIBLE, "The ELF file does not contain the storage address %x", current_storage_address);
                     }
-                    const auto new_data = elf->content(*seg);
+                    const auto new_data = elf->content_view(*seg);
 
                     uint32_t offset = current_storage_address - seg->physical_address();
-
-                    std::copy(new_data.begin()+offset, new_data.end(), std::back_inserter(data));
-                    current_storage_address += new_data.size();
+                    if (offset >= new_data.size()) {
+                        fail(ERROR_NOT_POSSIBLE, "The ELF file does not contain the storage address %x", current_storage_address);
+                    }
+                    uint32_t this_size = std::min(remaining, (uint32_t)(new_data.size() - offset));
+                    sink(new_data.data() + offset, this_size, true);
+                    current_storage_address += this_size;
+                    remaining -= this_size;
                 }
-                data.resize(entry.size);
-                std::copy(data.begin(), data.end(), std::back_inserter(to_hash));
-                DEBUG_LOG("HASH %08x + %08x\n", (int)entry.storage_address, (int)data.size());
+                DEBUG_LOG("HASH %08x + %08x\n", (int)entry.storage_address, (int)entry.size);
             }
         }
     }
-
-    return to_hash;
 }
 
 
-std::vector<uint8_t> get_lm_hash_data(std::vector<uint8_t> bin, uint32_t storage_addr, uint32_t runtime_addr, block *new_block, get_more_bin_cb more_cb, bool clear_sram = false) {
-    std::vector<uint8_t> to_hash;
+static void visit_lm_data(std::vector<uint8_t> bin, uint32_t storage_addr, uint32_t runtime_addr, block *new_block, get_more_bin_cb more_cb, const lm_data_sink &sink, bool clear_sram) {
     std::shared_ptr<load_map_item> load_map = new_block->get_item<load_map_item>();
     if (load_map == nullptr) {
-        to_hash.insert(to_hash.begin(), bin.begin(), bin.end());
         std::vector<load_map_item::entry> entries;
         if (clear_sram) {
             // todo gate this clearing of SRAM
@@ -800,8 +755,9 @@ std::vector<uint8_t> get_lm_hash_data(std::vector<uint8_t> bin, uint32_t storage
                 sram_size_vec[0]
             });
             auto sram_size_data = words_to_lsb_bytes(sram_size_vec.begin(), sram_size_vec.end());
-            to_hash.insert(to_hash.begin(), sram_size_data.begin(), sram_size_data.end());
+            sink(sram_size_data.data(), sram_size_data.size(), false);
         }
+        sink(bin.data(), bin.size(), false);
         DEBUG_LOG("HASH %08x + %08x\n", (int)storage_addr, (int)bin.size());
         entries.push_back(
             {
@@ -818,10 +774,7 @@ std::vector<uint8_t> get_lm_hash_data(std::vector<uint8_t> bin, uint32_t storage
         uint32_t current_bin_start = storage_addr;
         for(const auto &entry : load_map->entries) {
             if (entry.storage_address == 0) {
-                std::copy(
-                    (uint8_t*)&entry.size,
-                    (uint8_t*)&entry.size + sizeof(entry.size),
-                    std::back_inserter(to_hash));
+                sink((const uint8_t*)&entry.size, sizeof(entry.size), false);
                 DEBUG_LOG("CLEAR %08x + %08x\n", (int)entry.runtime_address, (int)entry.size);
             } else {
                 if (entry.storage_address + entry.size > current_bin_start + bin.size()) {
@@ -833,23 +786,27 @@ std::vector<uint8_t> get_lm_hash_data(std::vector<uint8_t> bin, uint32_t storage
                     current_bin_start = entry.storage_address;
                 }
                 uint32_t rel_addr = entry.storage_address - current_bin_start;
-                std::copy(
-                    bin.begin() + rel_addr,
-                    bin.begin() + rel_addr + entry.size,
-                    std::back_inserter(to_hash));
+                sink(bin.data() + rel_addr, entry.size, false);
                 DEBUG_LOG("HASH %08x + %08x\n", (int)entry.storage_address, (int)entry.size);
             }
         }
     }
-
-    return to_hash;
 }
 
 
 int hash_andor_sign(elf_file *elf, block *new_block, const public_t public_key, const private_t private_key, bool hash_value, bool sign, bool clear_sram) {
-    std::vector<uint8_t> to_hash = get_lm_hash_data(elf, new_block, clear_sram);
-
-    hash_andor_sign_block(new_block, public_key, private_key, hash_value, sign, to_hash);
+    sha256_ctx_t lm_hash;
+    sha256_start(&lm_hash);
+    visit_lm_data(elf, new_block, [&](const uint8_t *data, size_t len, bool) {
+        sha256_update(&lm_hash, data, len);
+    }, clear_sram);
+
+    if (hash_value || sign) {
+        hash_andor_sign_block(new_block, public_key, private_key, hash_value, sign, &lm_hash);
+    } else {
+        message_digest_t unused;
+        sha256_finish(&lm_hash, &unused);
+    }
     
     auto tmp = new_block->to_words();
     std::vector<uint8_t> data = words_to_lsb_bytes(tmp.begin(), tmp.end());
@@ -882,9 +839,18 @@ int hash_andor_sign(elf_file *elf, block *new_block, const public_t public_key,
 
 
 std::vector<uint8_t> hash_andor_sign(std::vector<uint8_t> bin, uint32_t storage_addr, uint32_t runtime_addr, block *new_block, const public_t public_key, const private_t private_key, bool hash_value, bool sign, bool clear_sram) {
-    std::vector<uint8_t> to_hash = get_lm_hash_data(bin, storage_addr, runtime_addr, new_block, nullptr, clear_sram);
-
-    hash_andor_sign_block(new_block, public_key, private_key, hash_value, sign, to_hash);
+    sha256_ctx_t lm_hash;
+    sha256_start(&lm_hash);
+    visit_lm_data(bin, storage_addr, runtime_addr, new_block, nullptr, [&](const uint8_t *data, size_t len, bool) {
+        sha256_update(&lm_hash, data, len);
+    }, clear_sram);
+
+    if (hash_value || sign) {
+        hash_andor_sign_block(new_block, public_key, private_key, hash_value, sign, &lm_hash);
+    } else {
+        message_digest_t unused;
+        sha256_finish(&lm_hash, &unused);
+    }
 
     auto tmp = new_block->to_words();
     std::vector<uint8_t> data = words_to_lsb_bytes(tmp.begin(), tmp.end());
@@ -903,7 +869,11 @@ void verify_block(std::vector<uint8_t> bin, uint32_t storage_addr, uint32_t runt
     if (load_map == nullptr || hash_def == nullptr) {
         return;
     }
-    std::vector<uint8_t> to_hash = get_lm_hash_data(bin, storage_addr, runtime_addr, block, more_cb, false);
+    sha256_ctx_t lm_hash;
+    sha256_start(&lm_hash);
+    visit_lm_data(bin, storage_addr, runtime_addr, block, more_cb, [&](const uint8_t *data, size_t len, bool) {
+        sha256_update(&lm_hash, data, len);
+    }, false);
 
     // auto it = std::find(block->items.begin(), block->items.end(), hash_def);
     // assert (it != block->items.end());
@@ -921,11 +891,11 @@ void verify_block(std::vector<uint8_t> bin, uint32_t storage_addr, uint32_t runt
         }
     }
     auto block_hashed_contents = words_to_lsb_bytes(tmp_words.begin(), tmp_words.end());
-    std::copy(block_hashed_contents.begin(), block_hashed_contents.end(), std::back_inserter(to_hash));
+    sha256_update(&lm_hash, block_hashed_contents.data(), block_hashed_contents.size());
 
     message_digest_t sha256;
     message_digest_t block_sha256;
-    sha256_buffer(to_hash.data(), to_hash.size(), &sha256);
+    sha256_finish(&lm_hash, &sha256);
     dumper("SHA256", sha256);
 
     std::shared_ptr<hash_value_item> hash_value = block->get_item<hash_value_item>();
@@ -964,16 +934,78 @@ void verify_block(std::vector<uint8_t> bin, uint32_t storage_addr, uint32_t runt
 }
 
 
+// A piece of the data to encrypt, which starts offset bytes into the CTR key stream
+struct ctr_piece {
+    const uint8_t *data;
+    size_t len;
+    uint8_t *out;
+    size_t offset;
+};
+
+// CTR blocks are independent, so large inputs are split into runs of whole blocks, one per hardware thread.
+// The key schedule is set up before any threads start, and they all share it
+static void aes256_ctr_pieces(const std::vector<ctr_piece> &pieces, const aes_key_t &aes_key, const iv_t &iv) {
+    aes256_ctx_t aes;
+    aes256_start(&aes, &aes_key);
+    const size_t min_per_thread = 256 * 1024;
+    size_t total = 0;
+    for (const auto &p : pieces) total += p.len;
+    size_t threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), total / min_per_thread);
+    if (threads <= 1) {
+        for (const auto &p : pieces) aes256_ctr(p.data, p.len, p.out, &aes, &iv, p.offset);
+        aes256_free(&aes);
+        return;
+    }
+    size_t per_thread = ((total + threads - 1) / threads + 15) & ~(size_t)15;
+    std::vector<std::vector<ctr_piece>> runs(threads);
+    for (auto p : pieces) {
+        while (p.len) {
+            auto &run = runs[p.offset / per_thread];
+            size_t this_len = std::min(p.len, per_thread - p.offset % per_thread);
+            run.push_back({p.data, this_len, p.out, p.offset});
+            p.data += this_len;
+            p.out += this_len;
+            p.offset += this_len;
+            p.len -= this_len;
+        }
+    }
+    std::vector<std::thread> workers;
+    for (const auto &run : runs) {
+        workers.emplace_back([&run, &aes, &iv]() {
+            for (const auto &p : run) aes256_ctr(p.data, p.len, p.out, &aes, &iv, p.offset);
+        });
+    }
+    for (auto &w : workers) w.join();
+    aes256_free(&aes);
+}
+
 void encrypt_guts(elf_file *elf, block *new_block, const aes_key_t aes_key, std::vector<uint8_t> &iv_data, std::vector<uint8_t> &enc_data) {
-    std::vector<uint8_t> to_enc = get_lm_hash_data(elf, new_block);
+    // The load map data is encrypted straight from the ELF segments into enc_data. Any other pieces may not
+    // outlive the sink call, so they are copied
+    std::vector<ctr_piece> pieces;
+    std::deque<std::vector<uint8_t>> copies;
+    size_t size = 0;
+    visit_lm_data(elf, new_block, [&](const uint8_t *data, size_t len, bool in_elf) {
+        if (!in_elf) {
+            copies.emplace_back(data, data + len);
+            data = copies.back().data();
+        }
+        pieces.push_back({data, len, nullptr, size});
+        size += len;
+    }, false);
 
     std::random_device rand{};
     assert(rand.max() - rand.min() >= 256);
 
-    while (to_enc.size() % 16 != 0){
-        to_enc.push_back(rand()); // todo maybe better padding? random should be fine though
+    std::vector<uint8_t> padding;
+    while ((size + padding.size()) % 16 != 0){
+        padding.push_back(rand()); // todo maybe better padding? random should be fine though
+    }
+    if (!padding.empty()) {
+        pieces.push_back({padding.data(), padding.size(), nullptr, size});
+        size += padding.size();
     }
-    DEBUG_LOG("size %08x\n", (int)to_enc.size());
+    DEBUG_LOG("size %08x\n", (int)size);
 
     iv_t iv;
     for(auto &e : iv.bytes) {
@@ -983,9 +1015,10 @@ void encrypt_guts(elf_file *elf, block *new_block, const aes_key_t aes_key, std:
     iv_data.resize(sizeof(iv.bytes));
     memcpy(iv_data.data(), iv.bytes, sizeof(iv.bytes));
 
-    enc_data.resize(to_enc.size());
+    enc_data.resize(size);
+    for (auto &p : pieces) p.out = enc_data.data() + p.offset;
 
-    aes256_buffer(to_enc.data(), to_enc.size(), enc_data.data(), &aes_key, &iv);
+    aes256_ctr_pieces(pieces, aes_key, iv);
 }
 
 
@@ -1108,7 +1141,7 @@ std::vector<uint8_t> encrypt(std::vector<uint8_t> bin, uint32_t storage_addr, ui
     std::vector<uint8_t> enc_data;
     enc_data.resize(bin.size());
 
-    aes256_buffer(bin.data(), bin.size(), enc_data.data(), &aes_key, &iv);
+    aes256_ctr_pieces({{bin.data(), bin.size(), enc_data.data(), 0}}, aes_key, iv);
     std::copy(enc_data.begin(), enc_data.end(), bin.begin());
 
     block link_block(0x20000000, enc_data.size());
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <functional>
+#include <map>
 
 #if HAS_MBEDTLS
     #include "mbedtls_wrapper.h"
@@ -17,7 +18,7 @@ typedef enum verified_t {
 // Common
 #if HAS_MBEDTLS
     int read_keys(const std::string &filename, public_t *public_key, private_t *private_key);
-    void hash_andor_sign_block(block *new_block, const public_t public_key, const private_t private_key, bool hash_value, bool sign, std::vector<uint8_t> to_hash = {});
+    void hash_andor_sign_block(block *new_block, const public_t public_key, const private_t private_key, bool hash_value, bool sign, const std::vector<uint8_t> &to_hash = {});
 #endif
 
 // Elfs
@@ -31,9 +32,12 @@ block place_new_block(elf_file *elf, std::unique_ptr<block> &first_block, bool s
 
 // Bins
 typedef std::function<void(std::vector<uint8_t> &bin, uint32_t offset, uint32_t size)> get_more_bin_cb;
+// The words of the blocks found by get_all_blocks, keyed by address, so that walking the same block loop again
+// doesn't need to fetch or scan it
+typedef std::map<uint32_t, std::vector<uint32_t>> block_cache;
 std::unique_ptr<block> find_first_block(std::vector<uint8_t> bin, uint32_t storage_addr);
-std::unique_ptr<block> get_last_block(std::vector<uint8_t> &bin, uint32_t storage_addr, std::unique_ptr<block> &first_block, get_more_bin_cb more_cb = nullptr);
-std::vector<std::unique_ptr<block>> get_all_blocks(std::vector<uint8_t> &bin, uint32_t storage_addr, std::unique_ptr<block> &first_block, get_more_bin_cb more_cb = nullptr);
+std::unique_ptr<block> get_last_block(std::vector<uint8_t> &bin, uint32_t storage_addr, std::unique_ptr<block> &first_block, get_more_bin_cb more_cb = nullptr, block_cache *cache = nullptr);
+std::vector<std::unique_ptr<block>> get_all_blocks(std::vector<uint8_t> &bin, uint32_t storage_addr, std::unique_ptr<block> &first_block, get_more_bin_cb more_cb = nullptr, block_cache *cache = nullptr);
 block place_new_block(std::vector<uint8_t> &bin, uint32_t storage_addr, std::unique_ptr<block> &first_block, bool set_others_ignored=false);
 uint32_t calc_checksum(std::vector<uint8_t> bin);
 #if HAS_MBEDTLS
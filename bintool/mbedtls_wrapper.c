@@ -40,62 +40,75 @@ void mb_sha256_buffer(const uint8_t *data, size_t len, message_digest_t *digest_
     mbedtls_sha256(data, len, digest_out->bytes, 0);
 }
 
-#if IV0_XOR
-// Taken from mbedtls_aes_crypt_ctr, but with XOR instead of adding to IV0
-int mb_aes_crypt_ctr_xor(mbedtls_aes_context *ctx,
-    size_t length,
-    unsigned char iv0[16],
-    unsigned char nonce_xor[16],
-    unsigned char stream_block[16],
-    const unsigned char *input,
-    unsigned char *output)
-{
-    int c;
-    int ret = 0;
-    size_t n = 0;
-    uint32_t counter = 0;
-
-    assert(length == (uint32_t)length);
-
-    while (length--) {
-        if (n == 0) {
-            for (int i = 16; i > 0; i--) {
-                nonce_xor[i-1] = iv0[i-1];
-                if (i > 16 - sizeof(counter)) {
-                    nonce_xor[i-1] ^= (unsigned char)(counter >> ((16-i)*8));
-                }
-            }
+void mb_sha256_start(sha256_ctx_t *ctx) {
+    mbedtls_sha256_init(ctx);
+#if MBEDTLS_VERSION_MAJOR >= 3
+    mbedtls_sha256_starts(ctx, 0);
+#else
+    mbedtls_sha256_starts_ret(ctx, 0);
+#endif
+}
 
-            ret = mbedtls_aes_crypt_ecb(ctx, MBEDTLS_AES_ENCRYPT, nonce_xor, stream_block);
-            if (ret != 0) {
-                break;
-            }
-            counter++;
-        }
-        c = *input++;
-        *output++ = (unsigned char) (c ^ stream_block[n]);
+void mb_sha256_update(sha256_ctx_t *ctx, const uint8_t *data, size_t len) {
+#if MBEDTLS_VERSION_MAJOR >= 3
+    mbedtls_sha256_update(ctx, data, len);
+#else
+    mbedtls_sha256_update_ret(ctx, data, len);
+#endif
+}
+
+void mb_sha256_finish(sha256_ctx_t *ctx, message_digest_t *digest_out) {
+#if MBEDTLS_VERSION_MAJOR >= 3
+    mbedtls_sha256_finish(ctx, digest_out->bytes);
+#else
+    mbedtls_sha256_finish_ret(ctx, digest_out->bytes);
+#endif
+    mbedtls_sha256_free(ctx);
+}
 
-        n = (n + 1) & 0x0F;
+// The counter block for block n of the key stream
+static void mb_aes_ctr_block(const uint8_t iv0[16], uint32_t n, uint8_t counter[16]) {
+    memcpy(counter, iv0, 16);
+#if IV0_XOR
+    for (int i = 0; i < 4; i++) {
+        counter[15 - i] ^= (uint8_t)(n >> (i * 8));
     }
+#else
+    // 128-bit big endian addition, as mbedtls_aes_crypt_ctr
+    uint64_t carry = n;
+    for (int i = 15; i >= 0 && carry; i--) {
+        carry += counter[i];
+        counter[i] = (uint8_t)carry;
+        carry >>= 8;
+    }
+#endif
+}
 
-    return ret;
+void mb_aes256_start(aes256_ctx_t *ctx, const aes_key_t *key) {
+    mbedtls_aes_init(ctx);
+    // this also builds mbedtls's AES tables the first time, which is not thread safe
+    mbedtls_aes_setkey_enc(ctx, key->bytes, 256);
 }
-#endif
 
-void mb_aes256_buffer(const uint8_t *data, size_t len, uint8_t *data_out, const aes_key_t *key, iv_t *iv) {
-    mbedtls_aes_context aes;
+void mb_aes256_free(aes256_ctx_t *ctx) {
+    mbedtls_aes_free(ctx);
+}
 
-    assert(len % 16 == 0);
+void mb_aes256_ctr(const uint8_t *data, size_t len, uint8_t *data_out, const aes256_ctx_t *ctx, const iv_t *iv, size_t offset) {
+    uint8_t counter[16];
+    uint8_t stream_block[16];
 
-    mbedtls_aes_setkey_enc(&aes, key->bytes, 256);
-    uint8_t stream_block[16] = {0};
-    size_t nc_off = 0;
-#if IV0_XOR
-    uint8_t xor_working_block[16] = {0};
-    mb_aes_crypt_ctr_xor(&aes, len, iv->bytes, xor_working_block, stream_block, data, data_out);
-#else
-    mbedtls_aes_crypt_ctr(&aes, len, &nc_off, iv->bytes, stream_block, data, data_out);
-#endif
+    assert((offset + len) / 16 == (uint32_t)((offset + len) / 16));
+
+    while (len) {
+        size_t n = offset % 16;
+        mb_aes_ctr_block(iv->bytes, (uint32_t)(offset / 16), counter);
+        // mbedtls uses AES-NI or the Armv8 crypto extensions here when the CPU has them; it only reads the context
+        mbedtls_aes_crypt_ecb((aes256_ctx_t *)ctx, MBEDTLS_AES_ENCRYPT, counter, stream_block);
+        for (; n < 16 && len; n++, len--, offset++) {
+            *data_out++ = *data++ ^ stream_block[n];
+        }
+    }
 }
 
 void raw_to_der(signature_t *sig) {
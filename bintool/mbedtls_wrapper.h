@@ -69,8 +69,20 @@ typedef struct aes_key_share {
 typedef signature_t public_t;
 typedef message_digest_t private_t;
 
+typedef mbedtls_sha256_context sha256_ctx_t;
+typedef mbedtls_aes_context aes256_ctx_t;
+
 void mb_sha256_buffer(const uint8_t *data, size_t len, message_digest_t *digest_out);
-void mb_aes256_buffer(const uint8_t *data, size_t len, uint8_t *data_out, const aes_key_t *key, iv_t *iv);
+// Incremental SHA-256, for hashing data which is not contiguous in memory
+void mb_sha256_start(sha256_ctx_t *ctx);
+void mb_sha256_update(sha256_ctx_t *ctx, const uint8_t *data, size_t len);
+void mb_sha256_finish(sha256_ctx_t *ctx, message_digest_t *digest_out);
+// AES-256 key schedule, set up once and then only read, so it can be shared by threads
+void mb_aes256_start(aes256_ctx_t *ctx, const aes_key_t *key);
+void mb_aes256_free(aes256_ctx_t *ctx);
+// AES-256 CTR of len bytes, starting offset bytes into the key stream, so a buffer can be split up and its
+// pieces encrypted independently (and in parallel)
+void mb_aes256_ctr(const uint8_t *data, size_t len, uint8_t *data_out, const aes256_ctx_t *ctx, const iv_t *iv, size_t offset);
 void mb_sign_sha256(const uint8_t *entropy, size_t entropy_size, const message_digest_t *m, const public_t *p, const private_t *d, signature_t *out);
 
 uint32_t mb_verify_signature_secp256k1(
@@ -79,7 +91,12 @@ uint32_t mb_verify_signature_secp256k1(
         const message_digest_t digest[1]);
 
 #define sha256_buffer mb_sha256_buffer
-#define aes256_buffer mb_aes256_buffer
+#define sha256_start mb_sha256_start
+#define sha256_update mb_sha256_update
+#define sha256_finish mb_sha256_finish
+#define aes256_start mb_aes256_start
+#define aes256_free mb_aes256_free
+#define aes256_ctr mb_aes256_ctr
 #define sign_sha256 mb_sign_sha256
 #define verify_signature_secp256k1 mb_verify_signature_secp256k1
 
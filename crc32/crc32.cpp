@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "crc32.h"
+
+// Slicing-by-8: table k gives the CRC contribution of a byte followed by k zero bytes, so eight bytes are folded in
+// with eight independent lookups rather than eight dependent ones
+namespace {
+    struct crc32_tables {
+        uint32_t t[8][256];
+    };
+
+    const crc32_tables &msb_tables() {
+        static const crc32_tables tables = [] {
+            crc32_tables tables;
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t remainder = i << 24;
+                for (int bit = 0; bit < 8; bit++) {
+                    remainder = remainder & 0x80000000u ? (remainder << 1) ^ 0x04c11db7u : remainder << 1;
+                }
+                tables.t[0][i] = remainder;
+            }
+            for (int k = 1; k < 8; k++) {
+                for (uint32_t i = 0; i < 256; i++) {
+                    uint32_t prev = tables.t[k - 1][i];
+                    tables.t[k][i] = (prev << 8) ^ tables.t[0][prev >> 24];
+                }
+            }
+            return tables;
+        }();
+        return tables;
+    }
+
+    const crc32_tables &lsb_tables() {
+        static const crc32_tables tables = [] {
+            crc32_tables tables;
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t remainder = i;
+                for (int bit = 0; bit < 8; bit++) {
+                    remainder = remainder & 1 ? (remainder >> 1) ^ 0xedb88320u : remainder >> 1;
+                }
+                tables.t[0][i] = remainder;
+            }
+            for (int k = 1; k < 8; k++) {
+                for (uint32_t i = 0; i < 256; i++) {
+                    uint32_t prev = tables.t[k - 1][i];
+                    tables.t[k][i] = (prev >> 8) ^ tables.t[0][prev & 0xff];
+                }
+            }
+            return tables;
+        }();
+        return tables;
+    }
+
+    // byte order is spelled out, so this is independent of host endianness and alignment
+    inline uint32_t load_be32(const uint8_t *p) {
+        return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    }
+
+    inline uint32_t load_le32(const uint8_t *p) {
+        return (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0];
+    }
+}
+
+uint32_t crc32_msb(const uint8_t *buf, size_t count, uint32_t crc) {
+    const auto &t = msb_tables().t;
+    for (; count >= 8; count -= 8, buf += 8) {
+        uint32_t a = crc ^ load_be32(buf);
+        uint32_t b = load_be32(buf + 4);
+        crc = t[7][a >> 24] ^ t[6][(a >> 16) & 0xff] ^ t[5][(a >> 8) & 0xff] ^ t[4][a & 0xff] ^
+              t[3][b >> 24] ^ t[2][(b >> 16) & 0xff] ^ t[1][(b >> 8) & 0xff] ^ t[0][b & 0xff];
+    }
+    while (count--) {
+        crc = (crc << 8) ^ t[0][(crc >> 24) ^ *buf++];
+    }
+    return crc;
+}
+
+uint32_t crc32_lsb(const uint8_t *buf, size_t count, uint32_t crc) {
+    const auto &t = lsb_tables().t;
+    for (; count >= 8; count -= 8, buf += 8) {
+        uint32_t a = crc ^ load_le32(buf);
+        uint32_t b = load_le32(buf + 4);
+        crc = t[7][a & 0xff] ^ t[6][(a >> 8) & 0xff] ^ t[5][(a >> 16) & 0xff] ^ t[4][a >> 24] ^
+              t[3][b & 0xff] ^ t[2][(b >> 8) & 0xff] ^ t[1][(b >> 16) & 0xff] ^ t[0][b >> 24];
+    }
+    while (count--) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *buf++) & 0xff];
+    }
+    return crc;
+}
@@ -0,0 +1,29 @@
+/*
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _CRC32_H
+#define _CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// CRC-32 with polynomial 0x04c11db7, and no final XOR. These are streaming: crc is the initial value (normally
+// 0xffffffff) or the result of the previous call, so a buffer can be processed in pieces.
+
+// MSB first, as used by the RP2040 bootrom and the boot2 checksum (CRC-32/MPEG-2 with an initial value of 0xffffffff)
+uint32_t crc32_msb(const uint8_t *buf, size_t count, uint32_t crc);
+// LSB first (reflected, polynomial 0xedb88320), as in zlib but without its inversion of the initial value and result
+uint32_t crc32_lsb(const uint8_t *buf, size_t count, uint32_t crc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
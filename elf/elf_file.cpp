@@ -23,6 +23,13 @@
 
 #include "portable_endian.h"
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 // tsk namespace is polluted on windows
 #ifdef _WIN32
 #undef min
@@ -31,6 +38,18 @@
 #define _CRT_SECURE_NO_WARNINGS
 #endif
 
+// Read only mapping of an input file
+struct elf_file::mapped_file {
+    mapped_file(const uint8_t *data, size_t size) : data(data), size(size) {}
+    ~mapped_file() {
+#ifndef _WIN32
+        munmap((void *)data, size);
+#endif
+    }
+    const uint8_t *data;
+    size_t size;
+};
+
 void eh_he(elf32_header &eh) {
     // Swap to host endianness
     eh.common.magic    = le32toh(eh.common.magic);
@@ -188,11 +207,54 @@ int rp_determine_binary_type(const elf32_header &eh, const std::vector<elf32_ph_
     return ERROR_INCOMPATIBLE;
 }
 
+const uint8_t *elf_file::file_bytes(void) const {
+    return mapping ? mapping->data : elf_bytes.data();
+}
+
+size_t elf_file::file_size(void) const {
+    return mapping ? mapping->size : elf_bytes.size();
+}
+
+// Copy the mapped input file into elf_bytes, before it is modified
+void elf_file::materialize(void) {
+    if (mapping) {
+        elf_bytes.assign(mapping->data, mapping->data + mapping->size);
+        mapping.reset();
+    }
+}
+
+elf_content_view elf_file::bytes_view(unsigned offset, unsigned length) const {
+    if ((uint64_t)offset + length > file_size()) {
+        fail(ERROR_FORMAT, "ELF File Read from 0x%x with size 0x%x exceeds the file size 0x%zx", offset, length, file_size());
+    }
+    return {file_bytes() + offset, length};
+}
+
 void elf_file::read_bytes(unsigned offset, unsigned length, void *dest) {
-    if (offset + length > elf_bytes.size()) {
-        fail(ERROR_FORMAT, "ELF File Read from 0x%x with size 0x%x exceeds the file size 0x%zx", offset, length, elf_bytes.size());
+    auto view = bytes_view(offset, length);
+    memcpy(dest, view.data(), length);
+}
+
+elf_content_view elf_file::section_data(unsigned idx) const {
+    auto it = sh_data.find(idx);
+    if (it != sh_data.end()) {
+        return {it->second.data(), it->second.size()};
+    }
+    const auto &sh = sh_entries[idx];
+    if (!sh.size || sh.type == SHT_NOBITS) {
+        return {nullptr, 0};
     }
-    memcpy(dest, &elf_bytes[offset], length);
+    return bytes_view(sh_data_offsets[idx], sh.size);
+}
+
+// Copy a section out of the file contents so that it can be edited
+std::vector<uint8_t> &elf_file::edit_section_data(unsigned idx) {
+    auto it = sh_data.find(idx);
+    if (it == sh_data.end()) {
+        auto view = section_data(idx);
+        it = sh_data.emplace(idx, std::vector<uint8_t>(view.begin(), view.end())).first;
+    }
+    return it->second;
 }
 
 int elf_file::read_header(void) {
@@ -201,35 +263,40 @@ int elf_file::read_header(void) {
     return rp_check_elf_header(eh);
 }
 
-// Flattens the data in the section array the elf_bytes blob
+// Flattens the section data into a new elf_bytes blob
 void elf_file::flatten(void) {
-    elf_bytes.resize(sizeof(eh));
+    // the section data is copied from the current contents, so build the new blob separately
+    std::vector<uint8_t> out(sizeof(eh));
     auto eh_out = eh;
     eh_le(eh_out);    // swap to LE for writing
-    memcpy(&elf_bytes[0], &eh_out, sizeof(eh_out));
+    memcpy(&out[0], &eh_out, sizeof(eh_out));
 
-    elf_bytes.resize(std::max(eh.ph_offset + sizeof(elf32_ph_entry) * eh.ph_num, elf_bytes.size()));
+    out.resize(std::max(eh.ph_offset + sizeof(elf32_ph_entry) * eh.ph_num, out.size()));
     auto ph_entries_out = ph_entries;
     for (auto ph : ph_entries_out) {
         ph_le(ph);  // swap to LE for writing
     }
-    memcpy(&elf_bytes[eh.ph_offset], &ph_entries_out[0], sizeof(elf32_ph_entry) * eh.ph_num);
+    memcpy(&out[eh.ph_offset], &ph_entries_out[0], sizeof(elf32_ph_entry) * eh.ph_num);
 
-    elf_bytes.resize(std::max(eh.sh_offset + sizeof(elf32_sh_entry) * eh.sh_num, elf_bytes.size()));
+    out.resize(std::max(eh.sh_offset + sizeof(elf32_sh_entry) * eh.sh_num, out.size()));
     auto sh_entries_out = sh_entries;
     for (auto sh : sh_entries_out) {
         sh_le(sh);  // swap to LE for writing
     }
-    memcpy(&elf_bytes[eh.sh_offset], &sh_entries_out[0], sizeof(elf32_sh_entry) * eh.sh_num);
+    memcpy(&out[eh.sh_offset], &sh_entries_out[0], sizeof(elf32_sh_entry) * eh.sh_num);
 
     int idx = 0;
     for (const auto &sh : sh_entries) {
         if (sh.size && sh.type != SHT_NOBITS) {
-            elf_bytes.resize(std::max(sh.offset + sh.size, (uint32_t)elf_bytes.size()));
-            memcpy(&elf_bytes[sh.offset], &sh_data[idx][0], sh.size);
+            auto data = section_data(idx);
+            out.resize(std::max(sh.offset + sh.size, (uint32_t)out.size()));
+            memcpy(&out[sh.offset], data.data(), std::min(data.size(), (size_t)sh.size));
         }
         idx++;
     }
+    elf_bytes.swap(out);
+    mapping.reset();
+    read_sh_data();
     if (verbose) printf("Elf file size %zu\n", elf_bytes.size());
 }
 
@@ -324,29 +391,31 @@ void elf_file::remove_empty_ph_entries(void) {
     }
 }
 
-// Read the section data from the internal byte array into discrete sections.
+// Point the section data at the sections in the internal byte array, discarding any edited copies.
 // This is used after modifying segments but before inserting new segments
 void elf_file::read_sh_data(void) {
+    sh_data.clear();
+    sh_data_offsets.resize(sh_entries.size());
     int sh_idx = 0;
-    sh_data.resize(eh.sh_num);
     for (const auto &sh: sh_entries) {
+        sh_data_offsets[sh_idx] = sh.offset;
         if (sh.size && sh.type != SHT_NOBITS) {
-            sh_data[sh_idx].resize(sh.size);
-            read_bytes(sh.offset, sh.size, &sh_data[sh_idx][0]);
+            bytes_view(sh.offset, sh.size); // check the section is within the file
         }
         sh_idx++;
     }
 }
 
 const std::string elf_file::section_name(uint32_t sh_name) const {
-    if (!eh.sh_str_index || eh.sh_str_index > eh.sh_num || eh.sh_str_index >= sh_data.size())
+    if (!eh.sh_str_index || eh.sh_str_index > eh.sh_num || eh.sh_str_index >= sh_entries.size())
         return "";
 
-    if (sh_name > sh_data[eh.sh_str_index].size())
+    auto shstrtab_data = section_data(eh.sh_str_index);
+    if (sh_name >= shstrtab_data.size())
         return "";
 
-    const char * str =(const char *) &sh_data[eh.sh_str_index][0];
-    return &str[sh_name];
+    const char * str =(const char *) shstrtab_data.data();
+    return std::string(&str[sh_name], strnlen(&str[sh_name], shstrtab_data.size() - sh_name));
 }
 
 const elf32_sh_entry* elf_file::get_section(const std::string &sh_name) {
@@ -364,8 +433,8 @@ uint32_t elf_file::get_symbol(const std::string &sym_name) {
     if (!sym_tab || !str_tab) {
         return 0;
     }
-    auto data = content(*sym_tab);
-    auto strings = content(*str_tab);
+    auto data = content_view(*sym_tab);
+    auto strings = content_view(*str_tab);
     const char * str =(const char *) strings.data();
     for (unsigned int i=0; i < sym_tab->size / sizeof(elf32_sym_entry); i++) {
         elf32_sym_entry sym;
@@ -386,7 +455,7 @@ uint32_t elf_file::append_section_name(const std::string &sh_name_str) {
     // Append the byte array to section header table remembering the offset
     // of the start of the string for the new section
     elf32_sh_entry &shstrtab = sh_entries[eh.sh_str_index];
-    std::vector<uint8_t> &shstrtab_data = sh_data[eh.sh_str_index];
+    std::vector<uint8_t> &shstrtab_data = edit_section_data(eh.sh_str_index);
     sh_entries[eh.sh_str_index].size += name_bytes.size();
     uint32_t sh_name = shstrtab_data.size();
     shstrtab_data.insert(shstrtab_data.end(), name_bytes.begin(), name_bytes.end());
@@ -437,15 +506,46 @@ void elf_file::read_ph(void) {
     }
 }
 
+int elf_file::read_elf(void) {
+    int rc = read_header();
+    if (!rc) {
+        read_ph();
+        read_sh();
+    }
+    read_sh_data();
+    return 0;
+}
+
 int elf_file::read_file(std::shared_ptr<std::iostream> file) {
     int rc = 0;
     try {
+        mapping.reset();
         elf_bytes = read_binfile(file);
-        int rc = read_header();
+        rc = read_elf();
+    }
+    catch (const std::ios_base::failure &e) {
+        std::cerr << "Failed to read elf file" << std::endl;
+        rc = -1;
+    }
+    return rc;
+}
+
+int elf_file::read_headers(std::shared_ptr<std::iostream> file) {
+    int rc = 0;
+    try {
+        mapping.reset();
+        file->exceptions(std::iostream::failbit | std::iostream::badbit);
+        file->seekg(0, file->beg);
+        elf_bytes.resize(sizeof(eh));
+        file->read(reinterpret_cast<char *>(elf_bytes.data()), elf_bytes.size());
+        rc = read_header();
         if (!rc) {
+            // the program headers normally follow straight after the ELF header
+            elf_bytes.resize(std::max((size_t)eh.ph_offset + sizeof(elf32_ph_entry) * eh.ph_num, elf_bytes.size()));
+            file->read(reinterpret_cast<char *>(elf_bytes.data() + sizeof(eh)), elf_bytes.size() - sizeof(eh));
             read_ph();
-            read_sh();
         }
+        sh_entries.clear();
         read_sh_data();
     }
     catch (const std::ios_base::failure &e) {
@@ -455,6 +555,29 @@ int elf_file::read_file(std::shared_ptr<std::iostream> file) {
     return rc;
 }
 
+int elf_file::read_file(const std::string &filename) {
+#ifndef _WIN32
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        struct stat st;
+        void *addr = MAP_FAILED;
+        if (!fstat(fd, &st) && st.st_size > 0) {
+            addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (addr != MAP_FAILED) {
+            if (verbose) printf("Mapped %s (%zu bytes)\n", filename.c_str(), (size_t)st.st_size);
+            elf_bytes.clear();
+            mapping = std::make_shared<mapped_file>((const uint8_t *)addr, st.st_size);
+            return read_elf();
+        }
+    }
+#endif
+    auto file = std::make_shared<std::fstream>(filename, std::ios::in|std::ios::binary);
+    if (file->fail()) fail(ERROR_READ_FAILED, "Could not open '%s'", filename.c_str());
+    return read_file(file);
+}
+
 uint32_t elf_file::lowest_section_offset(void) const {
     uint32_t offset = eh.sh_offset; // Section header offset is after the data
     for (const auto &sh: sh_entries) {
@@ -476,31 +599,42 @@ uint32_t elf_file::highest_section_offset(void) const {
 }
 
 std::vector<uint8_t> elf_file::content(const elf32_ph_entry &ph) const {
-    std::vector<uint8_t> content;
-    std::copy(elf_bytes.begin() + ph.offset, elf_bytes.begin() + ph.offset + ph.filez, std::back_inserter(content));
-    return content;
+    auto view = content_view(ph);
+    return std::vector<uint8_t>(view.begin(), view.end());
 }
 
 std::vector<uint8_t> elf_file::content(const elf32_sh_entry &sh) const {
-    std::vector<uint8_t> content;
-    std::copy(elf_bytes.begin() + sh.offset, elf_bytes.begin() + sh.offset + sh.size, std::back_inserter(content));
-    return content;
+    auto view = content_view(sh);
+    return std::vector<uint8_t>(view.begin(), view.end());
+}
+
+elf_content_view elf_file::content_view(const elf32_ph_entry &ph) const {
+    return bytes_view(ph.offset, ph.filez);
+}
+
+elf_content_view elf_file::content_view(const elf32_sh_entry &sh) const {
+    return bytes_view(sh.offset, sh.size);
 }
 
+// The section data refers directly to the file contents, so is updated in place along with them
 void elf_file::content(const elf32_ph_entry &ph, const std::vector<uint8_t> &content) {
     if (!editable) return;
     assert(content.size() <= ph.filez);
+    assert(sh_data.empty());
     if (verbose) printf("Update segment content offset %x content size %zx physical size %x\n", ph.offset, content.size(), ph.filez);
+    bytes_view(ph.offset, ph.filez);
+    materialize();
     memcpy(&elf_bytes[ph.offset], &content[0], std::min(content.size(), (size_t) ph.filez));
-    read_sh_data(); // Extract the sections after modifying the content
 }
 
 void elf_file::content(const elf32_sh_entry &sh, const std::vector<uint8_t> &content) {
     if (!editable) return;
     assert(content.size() <= sh.size);
+    assert(sh_data.empty());
     if (verbose) printf("Update section content offset %x content size %zx section size %x\n", sh.offset, content.size(), sh.size);
+    bytes_view(sh.offset, sh.size);
+    materialize();
     memcpy(&elf_bytes[sh.offset], &content[0], std::min(content.size(), (size_t) sh.size));
-    read_sh_data();  // Extract the sections after modifying the content
 }
 
 const elf32_ph_entry* elf_file::segment_from_physical_address(uint32_t paddr) {
@@ -586,7 +720,8 @@ const elf32_ph_entry& elf_file::append_segment(uint32_t vaddr, uint32_t paddr, u
 
     // Add the new segment for the signature and point to offset in file for data
     sh_entries.push_back(sh);
-    sh_data.push_back(std::vector<uint8_t>(size));
+    sh_data_offsets.push_back(0);
+    sh_data[sh_entries.size() - 1] = std::vector<uint8_t>(size);
     ph_entries.back().offset = sh.offset;
 
     eh.sh_offset = sh.offset + sh.size;
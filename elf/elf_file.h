@@ -13,16 +13,33 @@
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <string>
 #include <vector>
 #include "elf.h"
 
 #include "addresses.h"
 
+// Read only view of part of the contents of an elf_file, which is only valid until the elf_file is next modified
+struct elf_content_view {
+    const uint8_t *data() const { return ptr; }
+    size_t size() const { return len; }
+    const uint8_t *begin() const { return ptr; }
+    const uint8_t *end() const { return ptr + len; }
+
+    const uint8_t *ptr;
+    size_t len;
+};
+
 class elf_file {
 public:
     elf_file(bool verbose = false) : verbose(verbose) {};
     int read_file(std::shared_ptr<std::iostream> file);
+    // Memory maps the file where possible, so the contents are only copied once they are modified
+    int read_file(const std::string &filename);
+    // Reads just the ELF header and program headers, for callers which read the segment data from the file themselves
+    int read_headers(std::shared_ptr<std::iostream> file);
     void write(std::shared_ptr<std::iostream> file);
 
     const elf32_ph_entry& append_segment(uint32_t vaddr, uint32_t paddr, uint32_t size, const std::string &section_name);
@@ -33,6 +50,8 @@ public:
 
     std::vector<uint8_t> content(const elf32_ph_entry &ph) const;
     std::vector<uint8_t> content(const elf32_sh_entry &sh) const;
+    elf_content_view content_view(const elf32_ph_entry &ph) const;
+    elf_content_view content_view(const elf32_sh_entry &sh) const;
     void content(const elf32_ph_entry &ph, const std::vector<uint8_t> &content);
     void content(const elf32_sh_entry &sh, const std::vector<uint8_t> &content);
 
@@ -55,20 +74,35 @@ public:
 
     bool editable = true;
 private:
+    struct mapped_file;
+
+    int read_elf(void);
     int read_header(void);
     void read_ph(void);
     void read_sh(void);
     void read_sh_data(void);
     void read_bytes(unsigned offset, unsigned length, void *dest);
+    elf_content_view bytes_view(unsigned offset, unsigned length) const;
+    const uint8_t *file_bytes(void) const;
+    size_t file_size(void) const;
+    void materialize(void);
+    elf_content_view section_data(unsigned idx) const;
+    std::vector<uint8_t> &edit_section_data(unsigned idx);
     uint32_t append_section_name(const std::string &sh_name_str);
     void flatten(void);
 
 private:
     elf32_header eh;
+    // the file contents are either the read only mapping of the input file, or elf_bytes once modified
+    std::shared_ptr<mapped_file> mapping;
     std::vector<uint8_t> elf_bytes;
     std::vector<elf32_ph_entry> ph_entries;
     std::vector<elf32_sh_entry> sh_entries;
-    std::vector<std::vector<uint8_t>> sh_data;
+    // offset of each section's data within the file contents, which only differs from the section
+    // offset while sections are being moved, until the next flatten
+    std::vector<uint32_t> sh_data_offsets;
+    // copies of sections that have been edited or added since the last flatten
+    std::map<unsigned, std::vector<uint8_t>> sh_data;
     bool verbose;
 };
 int rp_check_elf_header(const elf32_header &eh);
@@ -5,8 +5,6 @@
  */
 
 #include <cstdio>
-#include <map>
-#include <set>
 #include <vector>
 #include <cstring>
 #include <cstdarg>
@@ -31,13 +29,24 @@ static void fail_write_error() {
     fail(ERROR_WRITE_FAILED, "Failed to write output file");
 }
 
-struct page_fragment {
-    page_fragment(uint32_t file_offset, uint32_t page_offset, uint32_t bytes) : file_offset(file_offset), page_offset(page_offset), bytes(bytes) {}
+// A contiguous run of file data to be loaded at addr
+struct load_span {
+    load_span(uint32_t addr, uint32_t file_offset, uint32_t len) : addr(addr), file_offset(file_offset), len(len) {}
+    uint32_t addr;
     uint32_t file_offset;
-    uint32_t page_offset;
-    uint32_t bytes;
+    uint32_t len;
 };
 
+// A contiguous run of UF2 pages from -> to (both page aligned)
+struct page_range {
+    page_range(uint32_t from, uint32_t to) : from(from), to(to) {}
+    uint32_t from;
+    uint32_t to;
+};
+
+// Number of UF2 blocks written to the output at a time
+#define UF2_WRITE_BATCH 64u
+
 int check_address_range(const address_ranges& valid_ranges, uint32_t addr, uint32_t vaddr, uint32_t size, bool uninitialized, address_range &ar) {
     for(const auto& range : valid_ranges) {
         if (range.from <= addr && range.to >= addr + size) {
@@ -56,7 +65,7 @@ int check_address_range(const address_ranges& valid_ranges, uint32_t addr, uint3
     return ERROR_INCOMPATIBLE;
 }
 
-int check_elf32_ph_entries(const std::vector<elf32_ph_entry>& entries, const address_ranges& valid_ranges, std::map<uint32_t, std::vector<page_fragment>>& pages) {
+int check_elf32_ph_entries(const std::vector<elf32_ph_entry>& entries, const address_ranges& valid_ranges, std::vector<load_span>& spans) {
     for(const auto & entry : entries) {
         if (entry.type == PT_LOAD && entry.memsz) {
             address_range ar;
@@ -70,28 +79,7 @@ int check_elf32_ph_entries(const std::vector<elf32_ph_entry>& entries, const add
                     if (g_verbose) printf("  ignored\n");
                     continue;
                 }
-                unsigned int addr = entry.paddr;
-                unsigned int remaining = mapped_size;
-                unsigned int file_offset = entry.offset;
-                while (remaining) {
-                    unsigned int off = addr & (UF2_PAGE_SIZE - 1);
-                    unsigned int len = std::min(remaining, UF2_PAGE_SIZE - off);
-                    auto &fragments = pages[addr - off]; // list of fragments
-                    // note if filesz is zero, we want zero init which is handled because the
-                    // statement above creates an empty page fragment list
-                    // check overlap with any existing fragments
-                    for (const auto &fragment : fragments) {
-                        if ((off < fragment.page_offset + fragment.bytes) !=
-                            ((off + len) <= fragment.page_offset)) {
-                            fail(ERROR_FORMAT, "In memory segments overlap");
-                        }
-                    }
-                    fragments.push_back(
-                            page_fragment{file_offset,off,len});
-                    addr += len;
-                    file_offset += len;
-                    remaining -= len;
-                }
+                spans.emplace_back(entry.paddr, entry.offset, mapped_size);
             }
             if (entry.memsz > entry.filez) {
                 // we have some uninitialized data too
@@ -104,27 +92,98 @@ int check_elf32_ph_entries(const std::vector<elf32_ph_entry>& entries, const add
     return 0;
 }
 
-int realize_page(std::shared_ptr<std::iostream> in, const std::vector<page_fragment> &fragments, uint8_t *buf, unsigned int buf_len) {
-    assert(buf_len >= UF2_PAGE_SIZE);
-    for(auto& frag : fragments) {
-        assert(frag.page_offset < UF2_PAGE_SIZE && frag.page_offset + frag.bytes <= UF2_PAGE_SIZE);
-        in->seekg(frag.file_offset, in->beg);
-        if (in->fail()) {
-            fail_read_error();
+// Add a page range, which must not start before the last one added
+static void add_page_range(std::vector<page_range> &pages, uint32_t from, uint32_t to) {
+    if (!pages.empty() && from <= pages.back().to) {
+        assert(from >= pages.back().from);
+        pages.back().to = std::max(pages.back().to, to);
+    } else {
+        pages.emplace_back(from, to);
+    }
+}
+
+// Sort the spans into address order, and return the pages they touch
+static std::vector<page_range> spans_to_pages(std::vector<load_span> &spans) {
+    std::sort(spans.begin(), spans.end(), [](const load_span &a, const load_span &b) { return a.addr < b.addr; });
+    std::vector<page_range> pages;
+    for (size_t i = 0; i < spans.size(); i++) {
+        const auto &span = spans[i];
+        if (i && span.addr < spans[i - 1].addr + spans[i - 1].len) {
+            fail(ERROR_FORMAT, "In memory segments overlap");
+        }
+        add_page_range(pages, span.addr & ~(UF2_PAGE_SIZE - 1),
+                       (span.addr + span.len + UF2_PAGE_SIZE - 1) & ~(UF2_PAGE_SIZE - 1));
+    }
+    return pages;
+}
+
+static uint32_t count_pages(const std::vector<page_range> &pages) {
+    uint32_t count = 0;
+    for (const auto &range : pages) {
+        count += (range.to - range.from) / UF2_PAGE_SIZE;
+    }
+    return count;
+}
+
+// Reads span data from the input, only seeking when the reads are not contiguous
+struct span_reader {
+    explicit span_reader(std::shared_ptr<std::iostream> in) : in(in) {}
+
+    void read(uint32_t file_offset, uint8_t *buf, uint32_t len) {
+        if (!positioned || file_offset != pos) {
+            in->seekg(file_offset, in->beg);
+            if (in->fail()) {
+                fail_read_error();
+            }
         }
-        in->read((char*)buf + frag.page_offset, frag.bytes);
+        in->read((char*)buf, len);
         if (in->fail()) {
             fail_read_error();
         }
+        positioned = true;
+        pos = file_offset + len;
     }
-    return 0;
+
+private:
+    std::shared_ptr<std::iostream> in;
+    uint32_t pos = 0;
+    bool positioned = false;
+};
+
+// Fill a page with the span data which lies within it; spans before next_span are known to end before this
+// page, and next_span is advanced as pages are realized in address order. Returns false if the page is padding
+bool realize_page(span_reader &reader, const std::vector<load_span> &spans, size_t &next_span, uint32_t page, uint8_t *buf, unsigned int buf_len) {
+    assert(buf_len >= UF2_PAGE_SIZE);
+    while (next_span < spans.size() && spans[next_span].addr + spans[next_span].len <= page) {
+        next_span++;
+    }
+    bool has_data = false;
+    for (size_t i = next_span; i < spans.size() && spans[i].addr < page + UF2_PAGE_SIZE; i++) {
+        const auto &span = spans[i];
+        uint32_t from = std::max(span.addr, page);
+        uint32_t to = std::min(span.addr + span.len, page + UF2_PAGE_SIZE);
+        reader.read(span.file_offset + (from - span.addr), buf + (from - page), to - from);
+        has_data = true;
+    }
+    return has_data;
 }
 
-static bool is_address_mapped(const std::map<uint32_t, std::vector<page_fragment>>& pages, uint32_t addr) {
+static bool is_address_mapped(const std::vector<page_range>& pages, uint32_t addr) {
     uint32_t page = addr & ~(UF2_PAGE_SIZE - 1);
-    if (!pages.count(page)) return false;
+    for (const auto &range : pages) {
+        if (page >= range.from && page < range.to) return true;
+    }
     // todo check actual address within page
-    return true;
+    return false;
+}
+
+// Returns the lowest page in from -> to, or UINT32_MAX if there isn't one
+static uint32_t lowest_page_in(const std::vector<page_range>& pages, uint32_t from, uint32_t to) {
+    for (const auto &range : pages) {
+        uint32_t lowest = std::max(range.from, from);
+        if (lowest < std::min(range.to, to)) return lowest;
+    }
+    return UINT32_MAX;
 }
 
 uf2_block gen_abs_block(uint32_t abs_block_loc) {
@@ -157,10 +216,11 @@ bool check_abs_block(uf2_block block) {
         !(block.flags & UF2_FLAG_EXTENSION_FLAGS_PRESENT && *(uint32_t*)&(block.data[UF2_PAGE_SIZE]) != UF2_EXTENSION_RP2_IGNORE_BLOCK);
 }
 
-int pages2uf2(std::map<uint32_t, std::vector<page_fragment>>& pages, std::shared_ptr<std::iostream> in, std::shared_ptr<std::iostream> out, uint32_t family_id, model_t model, uint32_t abs_block_loc=0) {
+// Streams out the UF2 blocks for the pages, which are moved by package_delta in the output
+int pages2uf2(const std::vector<page_range>& pages, const std::vector<load_span>& spans, std::shared_ptr<std::iostream> in, std::shared_ptr<std::iostream> out, uint32_t family_id, model_t model, uint32_t abs_block_loc=0, uint32_t package_delta=0) {
     // RP2350-E10: add absolute block to start of flash UF2s, targeting end of flash by default
     if (family_id != ABSOLUTE_FAMILY_ID && model->chip() == rp2350 && abs_block_loc) {
-        uint32_t base_addr = pages.begin()->first;
+        uint32_t base_addr = pages.front().from + package_delta;
         address_ranges flash_range = address_ranges_flash(model);
         if (is_address_initialized(flash_range, base_addr)) {
             uf2_block block = gen_abs_block(abs_block_loc);
@@ -170,36 +230,52 @@ int pages2uf2(std::map<uint32_t, std::vector<page_fragment>>& pages, std::shared
             }
         }
     }
-    uf2_block block;
-    unsigned int page_num = 0;
-    block.magic_start0 = UF2_MAGIC_START0;
-    block.magic_start1 = UF2_MAGIC_START1;
-    block.flags = UF2_FLAG_FAMILY_ID_PRESENT;
-    block.payload_size = UF2_PAGE_SIZE;
-    block.num_blocks = (uint32_t)pages.size();
-    block.file_size = family_id;
-    block.magic_end = UF2_MAGIC_END;
-    for(auto& page_entry : pages) {
-        block.target_addr = page_entry.first;
-        block.block_no = page_num++;
-        if (g_verbose) {
-            printf("Page %d / %d %08x%s\n", block.block_no, block.num_blocks, block.target_addr,
-                   page_entry.second.empty() ? " (padding)": "");
-        }
-        memset(block.data, 0, sizeof(block.data));
-        int rc = realize_page(in, page_entry.second, block.data, sizeof(block.data));
-        if (rc) return rc;
-        out->write((char*)&block, sizeof(uf2_block));
+    // the block count is known from the page ranges, so blocks can be written as soon as they are filled
+    uint32_t num_blocks = count_pages(pages);
+    std::vector<uf2_block> blocks(UF2_WRITE_BATCH);
+    for (auto &block : blocks) {
+        block.magic_start0 = UF2_MAGIC_START0;
+        block.magic_start1 = UF2_MAGIC_START1;
+        block.flags = UF2_FLAG_FAMILY_ID_PRESENT;
+        block.payload_size = UF2_PAGE_SIZE;
+        block.num_blocks = num_blocks;
+        block.file_size = family_id;
+        block.magic_end = UF2_MAGIC_END;
+    }
+    auto flush = [&](unsigned int count) {
+        out->write((char*)blocks.data(), count * sizeof(uf2_block));
         if (out->fail()) {
             fail_write_error();
         }
+    };
+    span_reader reader(in);
+    size_t next_span = 0;
+    unsigned int page_num = 0;
+    unsigned int batched = 0;
+    for (const auto &range : pages) {
+        for (uint32_t page = range.from; page < range.to; page += UF2_PAGE_SIZE) {
+            uf2_block &block = blocks[batched];
+            block.target_addr = page + package_delta;
+            block.block_no = page_num++;
+            memset(block.data, 0, sizeof(block.data));
+            bool has_data = realize_page(reader, spans, next_span, page, block.data, sizeof(block.data));
+            if (g_verbose) {
+                printf("Page %d / %d %08x%s\n", block.block_no, block.num_blocks, block.target_addr,
+                       has_data ? "" : " (padding)");
+            }
+            if (++batched == blocks.size()) {
+                flush(batched);
+                batched = 0;
+            }
+        }
     }
+    if (batched) flush(batched);
     return 0;
 }
 
 int bin2uf2(std::shared_ptr<std::iostream> in, std::shared_ptr<std::iostream> out, uint32_t address, uint32_t family_id, model_t model, uint32_t abs_block_loc, bool verbose) {
     g_verbose = verbose;
-    std::map<uint32_t, std::vector<page_fragment>> pages;
+    std::vector<load_span> spans;
 
     in->seekg(0, in->end);
     if (in->fail()) {
@@ -210,39 +286,20 @@ int bin2uf2(std::shared_ptr<std::iostream> in, std::shared_ptr<std::iostream> ou
         fail_read_error();
     }
 
-    unsigned int addr = address;
-    unsigned int remaining = size;
-    unsigned int file_offset = 0;
-    while (remaining) {
-        unsigned int off = addr & (UF2_PAGE_SIZE - 1);
-        unsigned int len = std::min(remaining, UF2_PAGE_SIZE - off);
-        auto &fragments = pages[addr - off]; // list of fragments
-        // note if filesz is zero, we want zero init which is handled because the
-        // statement above creates an empty page fragment list
-        // check overlap with any existing fragments
-        for (const auto &fragment : fragments) {
-            if ((off < fragment.page_offset + fragment.bytes) !=
-                ((off + len) <= fragment.page_offset)) {
-                fail(ERROR_FORMAT, "In memory segments overlap");
-            }
-        }
-        fragments.push_back(
-                page_fragment{file_offset,off,len});
-        addr += len;
-        file_offset += len;
-        remaining -= len;
-    }
+    spans.emplace_back(address, 0, size);
+    auto pages = spans_to_pages(spans);
 
-    return pages2uf2(pages, in, out, family_id, model, abs_block_loc);
+    return pages2uf2(pages, spans, in, out, family_id, model, abs_block_loc);
 }
 
 int elf2uf2(std::shared_ptr<std::iostream> in, std::shared_ptr<std::iostream> out, uint32_t family_id, model_t model, uint32_t package_addr, uint32_t abs_block_loc, bool verbose) {
     elf_file source_file(verbose);
     g_verbose = verbose;
     elf_file *elf = &source_file;
-    std::map<uint32_t, std::vector<page_fragment>> pages;
+    std::vector<load_span> spans;
 
-    int rc = elf->read_file(in);
+    // only the headers are needed, as the segment data is streamed from the file
+    int rc = elf->read_headers(in);
     bool ram_style = false;
     address_ranges valid_ranges = {};
     address_ranges flash_range = address_ranges_flash(model);
@@ -258,10 +315,11 @@ int elf2uf2(std::shared_ptr<std::iostream> in, std::shared_ptr<std::iostream> ou
                 }
             }
             valid_ranges = ram_style ? ram_range : flash_range;
-            rc = check_elf32_ph_entries(elf->segments(), valid_ranges, pages);
+            rc = check_elf32_ph_entries(elf->segments(), valid_ranges, spans);
         }
     }
     if (rc) return rc;
+    auto pages = spans_to_pages(spans);
     if (pages.empty()) {
         fail(ERROR_INCOMPATIBLE, "The input file has no memory pages");
     }
@@ -269,15 +327,10 @@ int elf2uf2(std::shared_ptr<std::iostream> in, std::shared_ptr<std::iostream> ou
     elf32_header eh = elf->header();
     uint32_t thumb_bit = eh.common.machine == EM_ARM ? 0x1u : 0x0u;
     if (ram_style) {
-        uint32_t expected_ep_main_ram = UINT32_MAX;
-        uint32_t expected_ep_xip_sram = UINT32_MAX;
-        for(auto& page_entry : pages) {
-            if ( ((page_entry.first >= SRAM_START) && (page_entry.first < ram_range[0].to)) && (page_entry.first < expected_ep_main_ram) ) {
-                expected_ep_main_ram = page_entry.first | thumb_bit;
-            } else if ( ((page_entry.first >= ram_range[1].from) && (page_entry.first < ram_range[1].to)) && (page_entry.first < expected_ep_xip_sram) ) { 
-                expected_ep_xip_sram = page_entry.first | thumb_bit;
-            }
-        }
+        uint32_t expected_ep_main_ram = lowest_page_in(pages, SRAM_START, ram_range[0].to);
+        uint32_t expected_ep_xip_sram = lowest_page_in(pages, ram_range[1].from, ram_range[1].to);
+        if (expected_ep_main_ram != UINT32_MAX) expected_ep_main_ram |= thumb_bit;
+        if (expected_ep_xip_sram != UINT32_MAX) expected_ep_xip_sram |= thumb_bit;
         uint32_t expected_ep = (UINT32_MAX != expected_ep_main_ram) ? expected_ep_main_ram : expected_ep_xip_sram;
         if (eh.entry == expected_ep_xip_sram && model->chip() == rp2040) {
             fail(ERROR_INCOMPATIBLE, "RP2040 B0/B1/B2 Boot ROM does not support direct entry into XIP_SRAM\n");
@@ -288,9 +341,10 @@ int elf2uf2(std::shared_ptr<std::iostream> in, std::shared_ptr<std::iostream> ou
         // currently don't require this as entry point is now at the start, we don't know where reset vector is
         // todo can be re-enabled for RP2350
 #if 0
-        uint8_t buf[UF2_PAGE_SIZE];
-        rc = realize_page(in, pages[SRAM_START], buf, sizeof(buf));
-        if (rc) return rc;
+        uint8_t buf[UF2_PAGE_SIZE] = {};
+        span_reader reader(in);
+        size_t next_span = 0;
+        realize_page(reader, spans, next_span, SRAM_START, buf, sizeof(buf));
         uint32_t sp = ((uint32_t *)buf)[0];
         uint32_t ip = ((uint32_t *)buf)[1];
         if (!is_address_mapped(pages, ip)) {
@@ -308,36 +362,24 @@ int elf2uf2(std::shared_ptr<std::iostream> in, std::shared_ptr<std::iostream> ou
         // That workaround is required because the bootrom uses the block number for erase sector calculations:
         // https://github.com/raspberrypi/pico-bootrom/blob/c09c7f08550e8a36fc38dc74f8873b9576de99eb/bootrom/virtual_disk.c#L205
 
-        std::set<uint32_t> touched_sectors;
-        for (auto& page_entry : pages) {
-            uint32_t sector = page_entry.first / FLASH_SECTOR_ERASE_SIZE;
-            touched_sectors.insert(sector);
-        }
-
-        uint32_t last_page = pages.rbegin()->first;
-        for (uint32_t sector : touched_sectors) {
-            for (uint32_t page = sector * FLASH_SECTOR_ERASE_SIZE; page < (sector + 1) * FLASH_SECTOR_ERASE_SIZE; page += UF2_PAGE_SIZE) {
-                if (page < last_page) {
-                    // Create a dummy page, if it does not exist yet. note that all present pages are first
-                    // zeroed before they are filled with any contents, so a dummy page will be all zeros.
-                    auto &dummy = pages[page];
-                }
-            }
+        // Each page range is widened to whole sectors, up to the last page. Any page without contents is a
+        // dummy page, which will be all zeros as all pages are first zeroed before they are filled.
+        uint32_t pages_end = pages.back().to;
+        std::vector<page_range> padded_pages;
+        for (const auto &range : pages) {
+            add_page_range(padded_pages, range.from & ~(FLASH_SECTOR_ERASE_SIZE - 1),
+                           std::min((range.to + FLASH_SECTOR_ERASE_SIZE - 1) & ~(FLASH_SECTOR_ERASE_SIZE - 1), pages_end));
         }
+        pages.swap(padded_pages);
     }
 
+    uint32_t package_delta = 0;
     if (package_addr) {
         // Package binary at address
-        uint32_t base_addr = pages.begin()->first;
-        int32_t package_delta = package_addr - base_addr;
+        uint32_t base_addr = pages.front().from;
+        package_delta = package_addr - base_addr;
         if (g_verbose) printf("Base %x\n", base_addr);
-
-        auto copy_pages = pages;
-        pages.clear();
-        for (auto page : copy_pages) {
-            pages[page.first + package_delta] = page.second;
-        }
     }
 
-    return pages2uf2(pages, in, out, family_id, model, abs_block_loc);
+    return pages2uf2(pages, spans, in, out, family_id, model, abs_block_loc, package_delta);
 }
@@ -3488,6 +3488,17 @@
  */
 #define MBEDTLS_SHA256_C
 
+/**
+ * \def MBEDTLS_SHA256_USE_A64_CRYPTO_IF_PRESENT
+ *
+ * Use the Armv8-A SHA-256 instructions on 64-bit Arm hosts where the CPU
+ * supports them (detected at runtime), falling back to the C implementation
+ * otherwise. This is ignored by versions of Mbed TLS which don't support it.
+ */
+#if defined(__aarch64__) && (defined(__linux__) || defined(__APPLE__))
+#define MBEDTLS_SHA256_USE_A64_CRYPTO_IF_PRESENT
+#endif
+
 /**
  * \def MBEDTLS_SHA512_C
  *
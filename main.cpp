@@ -31,17 +31,29 @@
 #include <numeric>
 #include <memory>
 #include <functional>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <tuple>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "boot/uf2.h"
 #include "boot/picobin.h"
 #include "get_enc_bootloader.h"
 #if HAS_LIBUSB
     #include "picoboot_connection_cxx.h"
+    #include "picoboot_sim.h"
     #include "get_xip_ram_perms.h"
 #else
     #include "picoboot_connection.h"
 #endif
 #include "bintool.h"
+#include "crc32.h"
 #include "elf2uf2.h"
 #include "boot/bootrom_constants.h"
 #include "pico/binary_info.h"
@@ -53,9 +65,15 @@
 #include "hardware/regs/otp_data.h"
 
 #include "nlohmann/json.hpp"
+#if PICOTOOL_BENCH
+#include "bench.h"
+#endif
 
 #if defined(__unix__) || defined(__APPLE__)
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
 #endif
 
 // missing __builtins on windows
@@ -77,7 +95,8 @@ static __forceinline int __builtin_ctz(unsigned x) {
 #define _CRT_SECURE_NO_WARNINGS
 #endif
 
-#define MAX_REBOOT_TRIES 5
+// how long to wait for a device to come back after rebooting it into BOOTSEL mode
+#define REBOOT_TIMEOUT_MS 6000
 
 #define OTP_PAGE_COUNT 64
 #define OTP_PAGE_ROWS  64
@@ -168,11 +187,12 @@ std::array<std::array<string, 48>, 12> pin_functions_rp2350{{
     {"",        "",         "UART0 TX", "UART0 RX", "",         "",         "UART1 TX", "UART1 RX", "",         "",         "UART1 TX", "UART1 RX", "",         "",         "UART0 TX", "UART0 RX", "",         "",         "UART0 TX", "UART0 RX", "",         "",         "UART1 TX", "UART1 RX", "",         "",         "UART1 TX", "UART1 RX", "",         "",         "UART0 TX", "UART0 RX", "",         "",         "UART0 TX", "UART0 RX", "",         "",         "UART1 TX", "UART1 RX", "",         "",         "UART1 TX", "UART1 RX", "",         "",         "UART0 TX", "UART0 RX"}
 }};
 
-std::map<uint32_t, otp_reg> otp_regs;
+otp_reg_list otp_regs;
 
 #if HAS_LIBUSB
 auto bus_device_string = [](struct libusb_device *device, chip_t chip) {
     string bus_device;
+    if (!device) return chip_name(chip) + string(" simulated device");
     bus_device = chip_name(chip) + string(" device at bus ");
     return bus_device + std::to_string(libusb_get_bus_number(device)) + ", address " + std::to_string(libusb_get_device_address(device));
 };
@@ -235,6 +255,8 @@ struct range {
 };
 
 // ranges should not overlap
+// The entries are kept in a vector sorted by address, and the entry found by the last lookup is remembered,
+// so that the sequential lookups made when reading through a file don't each need a binary search
 template <typename T> struct range_map {
     range_map() = default;
     struct mapping {
@@ -243,111 +265,196 @@ template <typename T> struct range_map {
         const uint32_t max_offset;
     };
 
+    // result of find(); for an unmapped address, the mapping covers the gap up to the start of the next range
+    struct lookup {
+        bool mapped;
+        mapping map;
+        T t;
+    };
+
     void insert(const range& r, T t) {
         if (r.to != r.from) {
             assert(r.to > r.from);
             // check we don't overlap any existing map entries
+            auto f = first_ending_after(r.from);
+            if (f != m.end() && f->from < r.to) {
+                fail(ERROR_FORMAT, "Found overlapping memory ranges 0x%08x->0x%08x and 0x%08x->%08x\n",
+                     r.from, r.to, f->from, f->to);
+            }
+            m.insert(f, entry{r.from, r.to, t});
+        }
+    }
 
-            auto f = m.upper_bound(r.from); // first element that starts after r.from
-            if (f != m.begin()) f--; // back up, to catch element that starts on or before r.from
-            for(; f != m.end() && f->first < r.to; f++) { // loop till we can't possibly overlap
-                range r2(f->first, f->second.first);
-                if (r2.intersects(r)) {
-                    fail(ERROR_FORMAT, "Found overlapping memory ranges 0x%08x->0x%08x and 0x%08x->%08x\n",
-                         r.from, r.to, r2.from, r2.to);
-                }
+    // insert a range which is expected to start at or after the end of every existing entry, as is
+    // the case when building the map from ranges in address order
+    void append(const range& r, T t) {
+        if (r.to != r.from) {
+            assert(r.to > r.from);
+            if (!m.empty() && m.back().to > r.from) {
+                // out of order (or overlapping), so take the slow path
+                insert(r, t);
+                return;
             }
-            m.insert(std::make_pair(r.from, std::make_pair(r.to, t)));
+            m.push_back(entry{r.from, r.to, t});
         }
     }
 
+    void reserve(size_t n) {
+        m.reserve(n);
+    }
+
     void insert_overwrite(const range& r, T t) {
         if (r.to != r.from) {
             assert(r.to > r.from);
             // insert overlapping entry, and overwrite any it overlaps
-
-            // avoid modifying m while iterating through it
-            vector<uint32_t> to_erase;
-            vector<pair<uint32_t, pair<uint32_t, T>>> to_add;
-
-            auto f = m.upper_bound(r.from); // first element that starts after r.from
-            if (f != m.begin()) f--; // back up, to catch element that starts on or before r.from
-            for(; f != m.end() && f->first < r.to; f++) { // loop till we can't possibly overlap
-                range r2(f->first, f->second.first);
-                T r2off = f->second.second;
-                if (r2.intersects(r)) {
-                    // remove existing r2
-                    to_erase.push_back(r2.from);
-                    if (r2.from < r.from) {
-                        // add r2 which ends at start of r
-                        to_add.push_back(std::make_pair(r2.from, std::make_pair(r.from, r2off)));
-                    }
-                    if (r2.to > r.to) {
-                        // add r2 which starts at end of r
-                        to_add.push_back(std::make_pair(r.to, std::make_pair(r2.to, r2off + (r.to - r2.from))));
-                    }
-                }
+            auto f = first_ending_after(r.from);
+            auto l = f;
+            while (l != m.end() && l->from < r.to) l++;
+            // [f, l) are the entries which overlap r; only the first can start before r, and only the last can end after it
+            vector<entry> replacement;
+            if (f != l && f->from < r.from) {
+                // keep the part of the existing entry which ends at start of r
+                replacement.push_back(entry{f->from, r.from, f->t});
+            }
+            replacement.push_back(entry{r.from, r.to, t});
+            if (f != l && std::prev(l)->to > r.to) {
+                // keep the part of the existing entry which starts at end of r
+                auto last = std::prev(l);
+                replacement.push_back(entry{r.to, last->to, last->t + (r.to - last->from)});
+            }
+            auto pos = m.erase(f, l);
+            m.insert(pos, replacement.begin(), replacement.end());
+        }
+    }
+
+    // find the mapping containing p, without throwing if there isn't one
+    lookup find(uint32_t p) const {
+        size_t i = cursor;
+        if (i < m.size() && p >= m[i].from) {
+            // likely the same or the next entry as last time
+            if (p >= m[i].to) {
+                i++;
+                if (i < m.size() && p >= m[i].to) i = first_ending_after(p) - m.begin();
             }
-            for (auto k : to_erase) m.erase(k);
-            for (auto v : to_add) m.insert(v);
-
-            // finally, add the new entry
-            m.insert(std::make_pair(r.from, std::make_pair(r.to, t)));
+        } else {
+            i = first_ending_after(p) - m.begin();
+        }
+        if (i < m.size()) {
+            cursor = i;
+            if (p >= m[i].from) {
+                return lookup{true, mapping(p - m[i].from, m[i].to - m[i].from), m[i].t};
+            }
+            return lookup{false, mapping(0, m[i].from - p), T()};
         }
+        return lookup{false, mapping(0, std::numeric_limits<uint32_t>::max() - p), T()};
     }
 
-    pair<mapping, T> get(uint32_t p) {
-        auto f = m.upper_bound(p);
-        if (f == m.end()) {
-            if (m.empty())
-                throw not_mapped_exception(p);
-        } else if (f == m.begin()) {
-            throw not_mapped_exception(p);
-        }
-        f--;
-        assert(p >= f->first);
-        if (p >= f->second.first) {
+    pair<mapping, T> get(uint32_t p) const {
+        auto l = find(p);
+        if (!l.mapped) {
             throw not_mapped_exception(p);
         }
-        return std::make_pair(mapping(p - f->first, f->second.first - f->first), f->second.second);
+        return std::make_pair(l.map, l.t);
     }
 
-    uint32_t next(uint32_t p) {
-        auto f = m.upper_bound(p);
+    uint32_t next(uint32_t p) const {
+        auto f = std::upper_bound(m.begin(), m.end(), p, [](uint32_t p, const entry &e) {
+            return p < e.from;
+        });
         if (f == m.end()) {
             return std::numeric_limits<uint32_t>::max();
         }
-        return f->first;
+        return f->from;
     }
 
-    vector<range> ranges() {
+    vector<range> ranges() const {
         vector<range> r;
         r.reserve(m.size());
         for(const auto &e : m) {
-            r.emplace_back(range(e.first, e.second.first));
+            r.emplace_back(range(e.from, e.to));
         }
         return r;
     }
 
     size_t size() const { return m.size(); }
 
-    range_map<T> offset_by(uint32_t offset) {
+    range_map<T> offset_by(uint32_t offset) const {
         range_map<T> rmap_offset;
+        rmap_offset.reserve(m.size());
         for(const auto &e : m) {
-            rmap_offset.insert(range(e.first + offset, e.second.first + offset), e.second.second);
+            rmap_offset.append(range(e.from + offset, e.to + offset), e.t);
         }
         return rmap_offset;
     }
 private:
-    map<uint32_t, pair<uint32_t, T>> m;
+    struct entry {
+        uint32_t from;
+        uint32_t to;
+        T t;
+    };
+
+    // first entry which ends after p (and so either contains p, or is the next entry after p)
+    typename vector<entry>::const_iterator first_ending_after(uint32_t p) const {
+        return std::upper_bound(m.begin(), m.end(), p, [](uint32_t p, const entry &e) {
+            return p < e.to;
+        });
+    }
+
+    vector<entry> m;
+    mutable size_t cursor = 0;
 };
 
 
-// Calculate chunk size for load/save/verify
-// Returns size/100 rounded up to FLASH_SECTOR_ERASE_SIZE
-uint32_t calculate_chunk_size(uint32_t size) {
-    return (((size + (100 - 1))/100 + FLASH_SECTOR_ERASE_SIZE - 1) & ~(FLASH_SECTOR_ERASE_SIZE - 1));
-}
+// Sizes the batches of load/save/verify from the time the batches so far have taken. Each batch costs a roughly
+// fixed latency (the USB commands, erase setup etc.) plus its size over the throughput; both are fitted to the
+// timings by least squares, and batches are sized to take about target_time, or ten times the latency if that is
+// longer, so that small transfers are done in one go and large ones still keep progress and ^C responsive. Until
+// there is a fit, batches double from initial_size. Batches end on FLASH_SECTOR_ERASE_SIZE boundaries.
+//
+// Batch sizes are independent of progress reporting, which goes by the bytes done. next_batch and completed may be
+// called from different threads (load stages batches ahead on a separate thread)
+struct transfer_scheduler {
+    static constexpr uint32_t initial_size = 16 * 1024;
+    static constexpr uint32_t max_size = 4 * 1024 * 1024;
+    static constexpr double target_time = 0.25;
+
+    // the number of bytes to handle next from pos, up to end
+    uint32_t next_batch(uint32_t pos, uint32_t end) {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint32_t batch_end = (pos + size + FLASH_SECTOR_ERASE_SIZE - 1) & ~(FLASH_SECTOR_ERASE_SIZE - 1);
+        return std::min(batch_end, end) - pos;
+    }
+
+    // a batch of bytes took the given time
+    void completed(uint32_t bytes, std::chrono::steady_clock::duration time) {
+        std::lock_guard<std::mutex> lock(mutex);
+        double x = bytes;
+        double y = std::chrono::duration<double>(time).count();
+        n++;
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+        double next = size * 2.0;
+        double var = n * sxx - sx * sx;
+        if (n >= 2 && var > 0) {
+            double per_byte = (n * sxy - sx * sy) / var;
+            if (per_byte > 0) {
+                double latency = std::max(0.0, (sy - per_byte * sx) / n);
+                next = std::max(target_time - latency, 9 * latency) / per_byte;
+            }
+        }
+        next = std::min(std::max(next, (double)FLASH_SECTOR_ERASE_SIZE), (double)max_size);
+        size = (uint32_t)next & ~(FLASH_SECTOR_ERASE_SIZE - 1);
+        DEBUG_LOG("Batch of %x took %fs, next batch %x\n", bytes, y, size);
+    }
+
+private:
+    std::mutex mutex;
+    uint32_t size = initial_size;
+    // sums for the least squares fit of time against bytes
+    double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+};
 
 
 using cli::group;
@@ -450,6 +557,8 @@ struct cmd {
     virtual string get_doc() const = 0;
     virtual device_support get_device_support() { return one; }
     virtual bool force_requires_pre_reboot() { return true; }
+    // return true if the command can be run on several devices at once (--all-devices / --serial-list)
+    virtual bool supports_multiple_devices() const { return false; }
     // return true if the command caused a reboot
     virtual bool execute(device_map& devices) = 0;
     virtual bool is_multi() const { return false; }
@@ -492,6 +601,9 @@ struct _settings {
     int reboot_diagnostic_partition = BOOT_PARTITION_NONE;
     bool force = false;
     bool force_no_reboot = false;
+    bool all_devices = false;
+    string serial_list;
+    string trace;
     string switch_cpu;
     uint32_t family_id = 0;
     model_t model = nullptr;
@@ -542,9 +654,15 @@ struct _settings {
         bool no_overwrite_force = false;
         bool update = false;
         bool ignore_pt = false;
+        bool compress = false;
+        bool sparse = false;
         int partition = -1;
     } load;
 
+    struct {
+        bool sparse = false;
+    } verify;
+
     struct {
         bool hash = false;
         bool sign = false;
@@ -554,6 +672,7 @@ struct _settings {
         uint16_t minor_version = 0;
         uint16_t rollback_version = 0;
         std::vector<uint16_t> rollback_rows;
+        string batch;
     } seal;
 
     struct {
@@ -571,8 +690,13 @@ struct _settings {
     struct {
         bool all = false;
         bool verify = false;
+        bool sparse = false;
     } save;
 
+    struct {
+        bool sparse = false;
+    } erase;
+
     struct {
         bool semantic = false;
         string version;
@@ -596,10 +720,15 @@ struct _settings {
         uint32_t abs_block_loc = 0;
         #endif
     } uf2;
+
+    struct {
+        string socket;
+    } serve;
 };
-_settings settings;
+// thread local, so that when a command is run on several devices at once each device's thread has its own copy
+thread_local _settings settings;
 std::shared_ptr<cmd> selected_cmd;
-chip_t selected_chip = unknown;
+thread_local chip_t selected_chip = unknown;
 
 auto device_selection =
     (
@@ -609,7 +738,10 @@ auto device_selection =
             .if_missing([] { return "missing address"; })) % "Filter devices by USB device address" +
         (option("--vid") & integer("vid").set(settings.vid).if_missing([] { return "missing vid"; })) % "Filter by vendor id" +
         (option("--pid") & integer("pid").set(settings.pid)) % "Filter by product id" +
-        (option("--ser") & value("ser").set(settings.ser)) % "Filter by serial number"
+        (option("--ser") & value("ser").set(settings.ser)) % "Filter by serial number" +
+        option("--all-devices").set(settings.all_devices) % "Run the command on all matching RP-series devices in BOOTSEL mode at once (load, verify, erase, reboot and otp load only)" +
+        (option("--serial-list") & value("serials").set(settings.serial_list)) % "Run the command at once on each device in a comma separated list of serial numbers (load, verify, erase, reboot and otp load only)" +
+        (option("--trace") & value("file").set(settings.trace)) % "Write the timing of each USB command to a file in Chrome trace format, and print a summary of the command latencies"
         + option('f', "--force").set(settings.force) % "Force a device not in BOOTSEL mode but running compatible code to reset so the command can be executed. After executing the command (unless the command itself is a 'reboot') the device will be rebooted back to application mode" +
                 option('F', "--force-no-reboot").set(settings.force_no_reboot) % "Force a device not in BOOTSEL mode but running compatible code to reset so the command can be executed. After executing the command (unless the command itself is a 'reboot') the device will be left connected and accessible to picotool, but without the USB drive mounted"
     ).min(0).doc_non_optional(true).collapse_synopsys("device-selection");
@@ -789,6 +921,7 @@ struct config_command : public cmd {
 struct verify_command : public cmd {
     verify_command() : cmd("verify") {}
     bool execute(device_map &devices) override;
+    bool supports_multiple_devices() const override { return true; }
 
     group get_cli() override {
         return (
@@ -798,7 +931,8 @@ struct verify_command : public cmd {
                     hex("from").set(settings.from) % "The lower address bound in hex" &
                     hex("to").set(settings.to) % "The upper address bound in hex").force_expand_help(true) +
                 (option('o', "--offset").set(settings.offset_set) % "Specify the load address when comparing with a BIN file" &
-                    hex("offset").set(settings.offset) % "Load offset (memory address; default 0x10000000)").force_expand_help(true)
+                    hex("offset").set(settings.offset) % "Load offset (memory address; default 0x10000000)").force_expand_help(true) +
+                option("--sparse").set(settings.verify.sparse) % "Compare holes in the file's flash data as erased rather than as zeros, as for a UF2 saved with save --sparse"
             ).min(0).doc_non_optional(true) % "Address options" +
             device_selection % "Target device selection"
         );
@@ -825,6 +959,7 @@ struct save_command : public cmd {
                 ).min(0).doc_non_optional(true)
             ).min(0).doc_non_optional(true).no_match_beats_error(false) % "Selection of data to save" +
             option('v', "--verify").set(settings.save.verify) % "Verify the data was saved correctly" +
+            option('s', "--sparse").set(settings.save.sparse) % "Leave erased flash pages out of a UF2 file, and don't read erased sectors from the device where it can detect them (RP2040)" +
             (option("--family") % "Specify the family ID to save the file as" &
                 family_id("family_id").set(settings.family_id) % "family ID to save file as").force_expand_help(true) +
             ( // note this parenthesis seems to help with error messages for say save --foo
@@ -841,6 +976,7 @@ struct save_command : public cmd {
 struct load_command : public cmd {
     load_command() : cmd("load") {}
     bool execute(device_map &devices) override;
+    bool supports_multiple_devices() const override { return true; }
 
     group get_cli() override {
         return (
@@ -853,6 +989,8 @@ struct load_command : public cmd {
                 option('n', "--no-overwrite").set(settings.load.no_overwrite) % "When writing flash data, do not overwrite an existing program in flash. If picotool cannot determine the size/presence of the program in flash, the command fails" +
                 option('N', "--no-overwrite-unsafe").set(settings.load.no_overwrite_force) % "When writing flash data, do not overwrite an existing program in flash. If picotool cannot determine the size/presence of the program in flash, the load continues anyway" +
                 option('u', "--update").set(settings.load.update) % "Skip writing flash sectors that already contain identical data" +
+                option("--compress").set(settings.load.compress) % "Send flash data compressed, to be decompressed on the device (RP2040 only)" +
+                option("--sparse").set(settings.load.sparse) % "Leave holes in the file's flash data erased rather than writing zeros, as for a UF2 saved with save --sparse" +
                 option('v', "--verify").set(settings.load.verify) % "Verify the data was written correctly" +
                 option('x', "--execute").set(settings.load.execute) % "Attempt to execute the downloaded file as a program after the load"
             ).min(0).doc_non_optional(true) % "Post load actions" +
@@ -873,6 +1011,7 @@ struct load_command : public cmd {
 struct erase_command : public cmd {
     erase_command() : cmd("erase") {}
     bool execute(device_map &devices) override;
+    bool supports_multiple_devices() const override { return true; }
 
     group get_cli() override {
         return (
@@ -888,6 +1027,7 @@ struct erase_command : public cmd {
                         hex("to").set(settings.to) % "The upper address bound in hex"
                 ).min(0).doc_non_optional(true)
             ).min(0).doc_non_optional(true).no_match_beats_error(false) % "Selection of data to erase" +
+            option('s', "--sparse").set(settings.erase.sparse) % "Skip sectors which are already erased" +
             ( // note this parenthesis seems to help with error messages for say erase --foo
                 device_selection % "Source device selection"
             )
@@ -972,7 +1112,11 @@ struct seal_command : public cmd {
                 option("--rollback") &
                     integer("rollback").set(settings.seal.rollback_version) +
                     hex("rows").add_to(settings.seal.rollback_rows).min(0).repeatable()
-            ).min(0) % "Add Rollback Version"
+            ).min(0) % "Add Rollback Version" +
+            (
+                option("--batch") &
+                    value("list").set(settings.seal.batch)
+            ).min(0) % "Also seal each infile/outfile pair in this list file (one pair per line), sealing several files at once"
         );
     }
 
@@ -1187,6 +1331,7 @@ struct otp_dump_command : public cmd {
 struct otp_load_command : public cmd {
     otp_load_command() : cmd("load") {}
     bool execute(device_map &devices) override;
+    bool supports_multiple_devices() const override { return true; }
     virtual bool requires_rp2350() const override { return true; }
 
     group get_cli() override {
@@ -1468,9 +1613,10 @@ struct version_command : public cmd {
 
 #if HAS_LIBUSB
 struct reboot_command : public cmd {
-    bool quiet;
+    bool quiet = false;
     reboot_command() : cmd("reboot") {}
     bool execute(device_map &devices) override;
+    bool supports_multiple_devices() const override { return true; }
 
     group get_cli() override {
         return
@@ -1493,6 +1639,27 @@ struct reboot_command : public cmd {
     }
 };
 auto reboot_cmd = std::shared_ptr<reboot_command>(new reboot_command());
+
+struct serve_command : public cmd {
+    serve_command() : cmd("serve") {}
+    bool execute(device_map &devices) override;
+
+    device_support get_device_support() override {
+        // the devices are found afresh for each request
+        return device_support::none;
+    }
+
+    group get_cli() override {
+        return group(
+            (option("--socket") & value("path").set(settings.serve.socket)) % "Unix domain socket to listen on (default $XDG_RUNTIME_DIR/picotool.sock; required if XDG_RUNTIME_DIR is not set)"
+        );
+    }
+
+    string get_doc() const override {
+        return "Keep running, and execute the commands of other picotool invocations which have PICOTOOL_SERVER set to the socket path. "
+               "The USB devices stay open between commands, so each command doesn't pay to find them again";
+    }
+};
 #endif
 auto help_cmd = std::shared_ptr<help_command>(new help_command());
 
@@ -1518,6 +1685,9 @@ vector<std::shared_ptr<cmd>> commands {
         std::shared_ptr<cmd>(new uf2_command()),
         std::shared_ptr<cmd>(new version_command()),
         std::shared_ptr<cmd>(new coprodis_command()),
+    #if HAS_LIBUSB
+        std::shared_ptr<cmd>(new serve_command()),
+    #endif
         help_cmd
 };
 
@@ -1544,10 +1714,24 @@ clipp::formatting_ostream<std::ostream> fos_null(null_buffer);
 
 auto fos_base_ptr = std::make_shared<clipp::formatting_ostream<std::ostream>>(fos_base);
 auto fos_null_ptr = std::make_shared<clipp::formatting_ostream<std::ostream>>(fos_null);
-auto fos_ptr = fos_base_ptr;
+thread_local auto fos_ptr = fos_base_ptr;
 #define fos (*fos_ptr)
 #define fos_verbose if(settings.verbose) fos
 
+// Command output which isn't formatted by fos (status lines, progress bars). When a command is run on several
+// devices at once, each device's thread points this at the device's log, along with fos
+thread_local std::ostream *tcout_ptr = &std::cout;
+#define tcout (*tcout_ptr)
+
+static void tprintf(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    char buffer[512];
+    int len = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    if (len > 0) tcout << string(buffer, std::min((size_t)len, sizeof(buffer) - 1));
+}
+
 using cli::option;
 using cli::integer;
 int parse(const int argc, char **argv) {
@@ -1847,6 +2031,9 @@ struct memory_access {
 
     virtual uint32_t get_binary_start() = 0;
 
+    // somewhere to keep the blocks of the block loop once they have been read, if reading them again is expensive
+    virtual block_cache *get_block_cache() { return nullptr; }
+
     uint32_t read_int(uint32_t addr, bool zero_fill = false) {
         assert(!(addr & 3u));
         uint32_t rc;
@@ -2069,11 +2256,75 @@ static chip_revision_t determine_chip_revision(memory_access &raw_access) {
     return chip_revision;
 }
 #if HAS_LIBUSB
+// the start of the ROM, which is all determine_model and determine_chip_revision look at
+typedef std::array<uint8_t, 8> rom_header_t;
+
+struct rom_header_memory_access : public memory_access {
+    explicit rom_header_memory_access(const rom_header_t &header) : header(header) {}
+
+    void read(uint32_t address, uint8_t *buffer, unsigned int size, __unused bool zero_fill) override {
+        if (address < BOOTROM_MAGIC_ADDR || address + size > BOOTROM_MAGIC_ADDR + header.size()) {
+            fail(ERROR_UNKNOWN, "Address %08x is outside the ROM header", address);
+        }
+        memcpy(buffer, header.data() + (address - BOOTROM_MAGIC_ADDR), size);
+    }
+
+    void write(uint32_t, uint8_t *, unsigned int) override {
+        fail(ERROR_NOT_POSSIBLE, "Cannot write to the ROM header");
+    }
+
+    uint32_t get_binary_start() override {
+        return 0;
+    }
+
+    void set_model(model_t m) {
+        model = m;
+    }
+
+private:
+    const rom_header_t &header;
+};
+
+// ROM headers of the devices held open by picotool serve, so each device's model is only read once
+struct rom_header_cache {
+    bool lookup(libusb_device_handle *handle, rom_header_t &header) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = headers.find(handle);
+        if (it == headers.end()) return false;
+        header = it->second;
+        return true;
+    }
+
+    void store(libusb_device_handle *handle, const rom_header_t &header) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (enabled) headers[handle] = header;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        headers.clear();
+    }
+
+    bool enabled = false;
+private:
+    std::mutex mutex;
+    std::map<libusb_device_handle *, rom_header_t> headers;
+};
+static rom_header_cache served_rom_headers;
+
 struct picoboot_memory_access : public memory_access {
     explicit picoboot_memory_access(picoboot::connection &connection) : connection(connection) {
-        model = determine_model(*this);
-        if (model->chip() != unknown)
-            model->set_chip_revision(determine_chip_revision(*this));
+        rom_header_t header;
+        if (!served_rom_headers.lookup(connection.handle(), header)) {
+            read_raw(BOOTROM_MAGIC_ADDR, header.data(), header.size());
+            served_rom_headers.store(connection.handle(), header);
+        }
+        rom_header_memory_access header_access(header);
+        model = determine_model(header_access);
+        if (model->chip() != unknown) {
+            header_access.set_model(model);
+            model->set_chip_revision(determine_chip_revision(header_access));
+        }
     }
 
     bool is_device() override {
@@ -2092,59 +2343,58 @@ struct picoboot_memory_access : public memory_access {
         }
     }
 
+    // the blocks are in flash, so are kept for as long as the flash cache is valid
+    block_cache *get_block_cache() override {
+        return settings.use_flash_cache ? &blocks : nullptr;
+    }
+
     void clear_cache() {
         flash_cache.clear();
+        blocks.clear();
+    }
+
+    // drop any cached flash pages overlapping address -> address + size
+    void invalidate_cache(uint32_t address, uint32_t size) {
+        if (!size) return;
+        auto from = flash_cache.lower_bound(address & ~(FLASH_CACHE_PAGE_SIZE - 1));
+        auto to = flash_cache.lower_bound(address + size);
+        flash_cache.erase(from, to);
+        // a block may start before address, so drop them all
+        blocks.clear();
     }
 
     void read_cached(uint32_t address, uint8_t *buffer, unsigned int size) {
-        for (auto range: flash_cache) {
-            uint32_t cached_start = std::get<0>(range);
-            uint32_t cached_size = std::get<1>(range);
-            auto cached_data = std::get<2>(range);
-            if (address >= cached_start) {
-                if (address >= cached_start + cached_size) {
-                    // No data already cached
-                    continue;
-                } else if (address + size <= cached_start + cached_size) {
-                    // All data already cached
-                    DEBUG_LOG("Flash Cache Hit %08x+%08x\n", address, size);
-                    std::copy(cached_data.cbegin() + (address - cached_start), cached_data.cbegin() + (address + size - cached_start), buffer);
-                    return;
-                } else {
-                    // Start of data already cached, but end needs reading
-                    uint32_t cached_used_size = cached_size - (address - cached_start);
-                    DEBUG_LOG("Flash Cache Hit Start %08x+%08x\n", address, cached_used_size);
-                    std::copy(cached_data.cbegin() + (address - cached_start), cached_data.cbegin() + cached_size, buffer);
-                    size -= cached_used_size;
-                    address += cached_used_size;
-                    buffer += cached_used_size;
-                }
-            } else {
-                if (address + size <= cached_start) {
-                    // No data already cached
-                    continue;
-                } else if (address + size <= cached_start + cached_size) {
-                    DEBUG_LOG("Flash Cache Hit End %08x+%08x\n", cached_start, (address + size - cached_start));
-                    // End of data already cached, but start needs reading
-                    std::copy(cached_data.cbegin(), cached_data.cbegin() + (address + size - cached_start), buffer + (cached_start - address));
-                    size = cached_start - address;
-                } else {
-                    // Middle of data already cached, start and end needs reading
-                    uint32_t split_size = cached_start - address; // split into address->cached_start and cached_start->(address + size)
-                    DEBUG_LOG("Flash Cache Hit Middle %08x+%08x\n", cached_start, cached_size);
-                    // Read data before
-                    read_cached(address, buffer, split_size);
-                    // Read rest
-                    read_cached(address + split_size, buffer + split_size, size - split_size);
-                    return;
-                }
+        if (!size) return;
+        uint32_t first_page = address & ~(FLASH_CACHE_PAGE_SIZE - 1);
+        uint32_t end_page = (address + size + FLASH_CACHE_PAGE_SIZE - 1) & ~(FLASH_CACHE_PAGE_SIZE - 1);
+        // fetch each run of missing pages with a single read
+        auto it = flash_cache.lower_bound(first_page);
+        for (uint32_t page = first_page; page < end_page;) {
+            if (it != flash_cache.end() && it->first == page) {
+                page += FLASH_CACHE_PAGE_SIZE;
+                ++it;
+                continue;
+            }
+            uint32_t run_end = end_page;
+            if (it != flash_cache.end() && it->first < run_end) run_end = it->first;
+            DEBUG_LOG("Flash Caching %08x+%08x\n", page, run_end - page);
+            vector<uint8_t> run_data(run_end - page);
+            read_raw(page, run_data.data(), run_data.size());
+            for (uint32_t offset = 0; offset < run_data.size(); offset += FLASH_CACHE_PAGE_SIZE) {
+                flash_cache.emplace_hint(it, page + offset, vector<uint8_t>(run_data.cbegin() + offset, run_data.cbegin() + offset + FLASH_CACHE_PAGE_SIZE));
             }
+            page = run_end;
         }
-
-        DEBUG_LOG("Flash Caching %08x+%08x\n", address, size);
-        read_raw(address, buffer, size);
-        std::vector<uint8_t> cached_data(buffer, buffer + size);
-        flash_cache.push_back(std::make_tuple(address, size, cached_data));
+        // all pages are now present and contiguous in the cache
+        it = flash_cache.find(first_page);
+        for (uint32_t pos = address; pos < address + size; ++it) {
+            assert(it != flash_cache.end() && it->first == (pos & ~(FLASH_CACHE_PAGE_SIZE - 1)));
+            uint32_t page_offset = pos - it->first;
+            uint32_t this_size = std::min(FLASH_CACHE_PAGE_SIZE - page_offset, address + size - pos);
+            std::copy(it->second.cbegin() + page_offset, it->second.cbegin() + page_offset + this_size, buffer + (pos - address));
+            pos += this_size;
+        }
+        DEBUG_LOG("Flash Cache Hit %08x+%08x\n", address, size);
     }
 
     void read_raw(uint32_t address, uint8_t *buffer, unsigned int size) {
@@ -2237,7 +2487,9 @@ struct picoboot_memory_access : public memory_access {
         }
         if (is_transfer_aligned(address, model) && is_transfer_aligned(address + size, model)) {
             connection.write(address, (uint8_t *) buffer, size);
-            clear_cache(); // clear entire flash cache after any write, to be safe
+            if (flash == get_memory_type(address, model)) {
+                invalidate_cache(address, size);
+            }
         } else {
             // for write, we must be correctly sized/aligned in 256 byte chunks
             std::stringstream sstream;
@@ -2254,7 +2506,10 @@ struct picoboot_memory_access : public memory_access {
     bool erase = false;
 private:
     picoboot::connection& connection;
-    vector<std::tuple<uint32_t,uint32_t,vector<uint8_t>>> flash_cache;
+    // flash contents read so far, keyed by FLASH_CACHE_PAGE_SIZE aligned address
+    static const uint32_t FLASH_CACHE_PAGE_SIZE = FLASH_SECTOR_ERASE_SIZE;
+    std::map<uint32_t, vector<uint8_t>> flash_cache;
+    block_cache blocks;
 };
 #endif
 
@@ -2272,6 +2527,11 @@ struct iostream_memory_access : public memory_access {
         model = m;
     }
 
+    // treat holes in flash as erased, as the file was saved sparse (needs the model, to know where flash is)
+    void set_erased_holes(bool erased) {
+        erased_holes = erased;
+    }
+
     void read(uint32_t address, uint8_t *buffer, uint32_t size, bool zero_fill) override {
         if (address == BOOTROM_MAGIC_ADDR && size == 4) {
             // return the memory model
@@ -2287,22 +2547,19 @@ struct iostream_memory_access : public memory_access {
             }
         }
         while (size) {
-            unsigned int this_size;
-            try {
-                auto result = rmap.get(address);
-                this_size = std::min(size, result.first.max_offset - result.first.offset);
-                assert(this_size);
-                file->seekg(result.second + result.first.offset, ios::beg);
+            auto result = rmap.find(address);
+            unsigned int this_size = std::min(size, result.map.max_offset - result.map.offset);
+            assert(this_size);
+            if (result.mapped) {
+                file->seekg(result.t + result.map.offset, ios::beg);
                 file->read((char*)buffer, this_size);
-            } catch (not_mapped_exception &) {
-                if (zero_fill) {
-                    // address is not in a range, so fill up to next range with zeros
-                    this_size = rmap.next(address) - address;
-                    this_size = std::min(this_size, size);
-                    memset(buffer, 0, this_size);
-                } else {
-                    throw;
-                }
+            } else if (zero_fill) {
+                // address is not in a range, so fill up to next range with zeros - or with 0xff
+                // in flash of a sparse file, where a hole stands for erased flash
+                bool erased = erased_holes && model && get_memory_type(address, model) == flash;
+                memset(buffer, erased ? 0xff : 0, this_size);
+            } else {
+                throw not_mapped_exception(address);
             }
             buffer += this_size;
             address += this_size;
@@ -2334,6 +2591,7 @@ private:
     std::shared_ptr<std::iostream>file;
     range_map<size_t> rmap;
     uint32_t binary_start;
+    bool erased_holes = false;
 };
 
 
@@ -2385,11 +2643,12 @@ struct remapped_memory_access : public memory_access {
     }
 
     pair<range_map<uint32_t>::mapping, uint32_t> get_remapped(uint32_t address) {
-        try {
-            return rmap.get(address);
-        } catch (not_mapped_exception&) {
-            return std::make_pair(range_map<uint32_t>::mapping(0, rmap.next(address) - address), address);
+        auto result = rmap.find(address);
+        if (result.mapped) {
+            return std::make_pair(result.map, result.t);
         }
+        // unmapped addresses pass straight through, up to the next range
+        return std::make_pair(result.map, address);
     }
 
 private:
@@ -2478,14 +2737,15 @@ bool find_binary_info(memory_access& access, binary_info_header &hdr) {
                         is_size_aligned(to, 4)) {
                     access.read_into_vector(from, (to - from) / 4, hdr.bi_addr);
                     uint32_t cpy_table = buffer[i+3];
-                    vector<uint32_t> mapping;
-                    do {
-                        mapping = access.read_vector<uint32_t>(cpy_table, 3);
+                    // read the whole table at once, up to the arbitrary max of 10 entries
+                    const unsigned int max_mappings = 10;
+                    vector<uint32_t> mappings = access.read_vector<uint32_t>(cpy_table, max_mappings * 3, true);
+                    for (unsigned int m = 0; m < max_mappings; m++) {
+                        const uint32_t *mapping = mappings.data() + m * 3;
                         if (!mapping[0]) break;
                         // from, to_start, to_end
                         hdr.reverse_copy_mapping.insert(range(mapping[1], mapping[2]), mapping[0]);
-                        cpy_table += 12;
-                    } while (hdr.reverse_copy_mapping.size() < 10); // arbitrary max
+                    }
                     return true;
                 }
             }
@@ -2710,6 +2970,111 @@ struct bi_visitor_base {
     chip_t chip = chip_t::unknown;
 };
 
+// Reads the binary_info entries, and everything they point to, up front in as few reads as possible, so that
+// visiting them (possibly several times) is served from host memory, rather than costing a read (a USB round trip
+// on a device) for every entry and string. What to read is found by visiting the entries with any reads that
+// aren't covered yet recorded rather than made; the recorded ranges are then coalesced and read, and this is
+// repeated until nothing new is referenced. Anything not prefetched is still read through to wrap, and writes go
+// straight through
+struct binary_info_memory_access : public memory_access {
+    binary_info_memory_access(memory_access &wrap, const binary_info_header &hdr) : wrap(wrap) {
+        model = wrap.get_model();
+        // start with the largest entry at each address, rather than just the core
+        const uint32_t max_entry_size = std::max({sizeof(binary_info_id_and_int_t), sizeof(binary_info_id_and_string_t),
+                                                  sizeof(binary_info_ptr_int32_with_name_t), sizeof(binary_info_ptr_string_with_name_t),
+                                                  sizeof(binary_info_block_device_t), sizeof(binary_info_pins64_with_func_t),
+                                                  sizeof(binary_info_pins64_with_name_t), sizeof(binary_info_named_group_t)});
+        for (const auto &a : hdr.bi_addr) {
+            misses.emplace_back(a, a + max_entry_size);
+        }
+        // strings and lists can only add a few levels
+        for (int i = 0; i < 4 && !misses.empty(); i++) {
+            fetch();
+            recording = true;
+            prefetch_visitor().visit(*this, hdr);
+            recording = false;
+        }
+    }
+
+    void read(uint32_t address, uint8_t *buffer, unsigned int size, bool zero_fill) override {
+        auto it = fetched.upper_bound(address);
+        if (it != fetched.begin()) {
+            --it;
+            if (address + size <= it->first + it->second.size()) {
+                memcpy(buffer, it->second.data() + (address - it->first), size);
+                return;
+            }
+        }
+        if (recording) {
+            misses.emplace_back(address, address + size);
+            memset(buffer, 0, size);
+        } else {
+            wrap.read(address, buffer, size, zero_fill);
+        }
+    }
+
+    void write(uint32_t address, uint8_t *buffer, unsigned int size) override {
+        wrap.write(address, buffer, size);
+        // drop anything fetched which overlaps, so it's read again
+        auto it = fetched.upper_bound(address);
+        if (it != fetched.begin() && std::prev(it)->first + std::prev(it)->second.size() > address) --it;
+        while (it != fetched.end() && it->first < address + size) {
+            it = fetched.erase(it);
+        }
+    }
+
+    bool is_device() override {
+        return wrap.is_device();
+    }
+
+    uint32_t get_binary_start() override {
+        return wrap.get_binary_start();
+    }
+
+private:
+    // also reads what the callbacks of bi_visitor read
+    struct prefetch_visitor : public bi_visitor_base {
+        void block_device(memory_access &access, binary_info_block_device_t &bi_bdev) override {
+            read_string(access, bi_bdev.name);
+        }
+    };
+
+    // a read costs about as much as transferring this many more bytes, so smaller gaps are read through
+    static const uint32_t max_gap = 1024;
+
+    void fetch() {
+        std::sort(misses.begin(), misses.end(), [](const range &a, const range &b) { return a.from < b.from; });
+        vector<range> reads;
+        for (const auto &r : misses) {
+            if (!reads.empty() && r.from <= reads.back().to + max_gap) {
+                reads.back().to = std::max(reads.back().to, r.to);
+            } else {
+                reads.push_back(r);
+            }
+        }
+        misses.clear();
+        for (auto r : reads) {
+            // absorb anything already fetched which overlaps, so the fetched ranges stay disjoint
+            auto it = fetched.upper_bound(r.from);
+            if (it != fetched.begin() && std::prev(it)->first + std::prev(it)->second.size() >= r.from) --it;
+            while (it != fetched.end() && it->first <= r.to) {
+                r.from = std::min(r.from, it->first);
+                r.to = std::max(r.to, (uint32_t)(it->first + it->second.size()));
+                it = fetched.erase(it);
+            }
+            DEBUG_LOG("Prefetching binary info %08x+%x\n", r.from, r.len());
+            vector<uint8_t> data(r.len());
+            wrap.read(r.from, data.data(), r.len(), true);
+            fetched.emplace(r.from, std::move(data));
+        }
+    }
+
+    memory_access &wrap;
+    std::map<uint32_t, vector<uint8_t>> fetched;
+    vector<range> misses;
+    bool recording = false;
+};
+
 struct bi_visitor : public bi_visitor_base {
     typedef std::function<void(int tag, uint32_t id, uint32_t value)> id_and_int_fn;
     typedef std::function<void(int tag, uint32_t id, const string &value)> id_and_string_fn;
@@ -2891,6 +3256,73 @@ std::shared_ptr<std::fstream> get_file(ios::openmode mode) {
     return get_file_idx(mode, 0);
 }
 
+// Identifies a file however it is named (relative paths, symlinks, hardlinks), along with the state of its contents
+struct file_identity {
+    string path;
+    uint64_t dev = 0;
+    uint64_t ino = 0;
+    int64_t mtime = 0;
+    int64_t mtime_nsec = 0;
+    int64_t size = 0;
+
+    // whether this is the same file, whatever its contents
+    bool same_file(const file_identity &other) const {
+        // there are no inode numbers on Windows
+        return ino ? dev == other.dev && ino == other.ino : path == other.path;
+    }
+
+    bool operator<(const file_identity &other) const {
+        return std::tie(path, dev, ino, mtime, mtime_nsec, size) <
+               std::tie(other.path, other.dev, other.ino, other.mtime, other.mtime_nsec, other.size);
+    }
+};
+
+// Returns false if the file doesn't exist
+static bool get_file_identity(const string &filename, file_identity &id) {
+    struct stat st;
+    if (stat(filename.c_str(), &st)) return false;
+    id.dev = st.st_dev;
+    id.ino = st.st_ino;
+    id.mtime = st.st_mtime;
+#if defined(__APPLE__)
+    id.mtime_nsec = st.st_mtimespec.tv_nsec;
+#elif defined(__linux__)
+    id.mtime_nsec = st.st_mtim.tv_nsec;
+#endif
+    id.size = st.st_size;
+#ifdef _WIN32
+    char full_path[_MAX_PATH];
+    id.path = _fullpath(full_path, filename.c_str(), sizeof(full_path)) ? full_path : filename;
+#else
+    char *real_path = realpath(filename.c_str(), nullptr);
+    id.path = real_path ? real_path : filename;
+    free(real_path);
+#endif
+    return true;
+}
+
+// the ELF is memory mapped, unless it is also an output file (under whatever name), as that would be truncated
+// while still mapped
+void read_elf_file_idx(elf_file *elf, uint8_t idx) {
+    auto filename = settings.filenames[idx];
+    file_identity id;
+    bool is_output = false;
+    if (get_file_identity(filename, id)) {
+        for (size_t i = 0; i < settings.filenames.size(); i++) {
+            file_identity other;
+            // an output file which doesn't exist yet can't be this one
+            if (i != idx && !settings.filenames[i].empty() && get_file_identity(settings.filenames[i], other) && other.same_file(id)) {
+                is_output = true;
+            }
+        }
+    }
+    if (!is_output) {
+        elf->read_file(filename);
+    } else {
+        elf->read_file(get_file_idx(ios::in|ios::binary, idx));
+    }
+}
+
 enum filetype get_file_type_idx(uint8_t idx) {
     auto filename = settings.filenames[idx];
     auto file_type = settings.file_types[idx];
@@ -2965,51 +3397,96 @@ void build_rmap_elf(std::shared_ptr<std::iostream>file, range_map<size_t>& rmap)
     }
 }
 
-uint32_t build_rmap_uf2(std::shared_ptr<std::iostream>file, range_map<size_t>& rmap, uint32_t family_id=0) {
+// Index of the main flash pages in a UF2 file for each family ID, built in a single pass over the file
+struct uf2_index {
+    struct page {
+        uint32_t target_addr;
+        uint32_t data_offset;
+    };
+    // family IDs in the order they first appear in the file
+    vector<uint32_t> families;
+    // pages of each family, sorted by target address
+    std::map<uint32_t, vector<page>> pages;
+    bool has_abs_block = false;
+    uint32_t abs_block_loc = 0;
+    uint32_t abs_block_family_id = 0;
+};
+
+std::shared_ptr<uf2_index> build_uf2_index(std::shared_ptr<std::iostream> file) {
+    // read many blocks at a time, rather than going through the stream for each block
+    const size_t blocks_per_read = 256;
+    auto index = std::make_shared<uf2_index>();
+    vector<uf2_block> blocks(blocks_per_read);
+    uint32_t pos = 0;
     file->seekg(0, ios::beg);
-    uf2_block block;
-    unsigned int pos = 0;
-    uint32_t next_family_id = 0;
     do {
-        file->read((char*)&block, sizeof(uf2_block));
-        if (file->fail()) {
-            if (file->eof()) { file->clear(); break; }
+        file->read((char*)blocks.data(), blocks.size() * sizeof(uf2_block));
+        if (file->fail() && !file->eof()) {
             fail(ERROR_READ_FAILED, "unexpected end of input file");
         }
-        if (block.magic_start0 == UF2_MAGIC_START0 && block.magic_start1 == UF2_MAGIC_START1 &&
-            block.magic_end == UF2_MAGIC_END) {
-            if (block.flags & UF2_FLAG_FAMILY_ID_PRESENT &&
-                !(block.flags & UF2_FLAG_NOT_MAIN_FLASH) && block.payload_size == PAGE_SIZE &&
-                (!family_id || block.file_size == family_id)) {
-                #if SUPPORT_RP2350_A2
-                // ignore the absolute block, but save the address
-                if (check_abs_block(block)) {
-                    DEBUG_LOG("Ignoring RP2350-E10 absolute block\n");
-                    settings.uf2.abs_block_loc = block.target_addr;
-                } else {
-                    rmap.insert(range(block.target_addr, block.target_addr + PAGE_SIZE), pos + offsetof(uf2_block, data[0]));
-                    family_id = block.file_size;
-                    next_family_id = 0;
-                }
-                #else
-                rmap.insert(range(block.target_addr, block.target_addr + PAGE_SIZE), pos + offsetof(uf2_block, data[0]));
-                family_id = block.file_size;
-                next_family_id = 0;
-                #endif
-            } else if (block.file_size != family_id && family_id && !next_family_id) {
-                #if SUPPORT_RP2350_A2
-                if (!check_abs_block(block)) {
-                #endif
-                    next_family_id = block.file_size;
-                #if SUPPORT_RP2350_A2
-                }
-                #endif
+        // a partial block at the end of the file is ignored
+        size_t count = file->gcount() / sizeof(uf2_block);
+        for (size_t i = 0; i < count; i++, pos += sizeof(uf2_block)) {
+            const uf2_block &block = blocks[i];
+            if (block.magic_start0 != UF2_MAGIC_START0 || block.magic_start1 != UF2_MAGIC_START1 ||
+                block.magic_end != UF2_MAGIC_END) {
+                continue;
+            }
+            if (!(block.flags & UF2_FLAG_FAMILY_ID_PRESENT) || (block.flags & UF2_FLAG_NOT_MAIN_FLASH) ||
+                block.payload_size != PAGE_SIZE) {
+                continue;
             }
+            #if SUPPORT_RP2350_A2
+            if (check_abs_block(block)) {
+                index->has_abs_block = true;
+                index->abs_block_loc = block.target_addr;
+                index->abs_block_family_id = block.file_size;
+                continue;
+            }
+            #endif
+            auto &pages = index->pages[block.file_size];
+            if (pages.empty()) {
+                index->families.push_back(block.file_size);
+            }
+            pages.push_back({block.target_addr, (uint32_t)(pos + offsetof(uf2_block, data[0]))});
+        }
+    } while (!file->fail());
+    file->clear();
+    for (auto &f : index->pages) {
+        auto &pages = f.second;
+        auto by_address = [](const uf2_index::page &a, const uf2_index::page &b) {
+            return a.target_addr < b.target_addr;
+        };
+        // pages are almost always in order already
+        if (!std::is_sorted(pages.begin(), pages.end(), by_address)) {
+            std::stable_sort(pages.begin(), pages.end(), by_address);
         }
-        pos += sizeof(uf2_block);
-    } while (true);
+    }
+    return index;
+}
 
-    return next_family_id;
+// Add the pages of the given family (or the first family in the file if 0) to the rmap, returning the
+// family that follows it in the file, or 0 if there is none
+uint32_t build_rmap_uf2(const uf2_index &index, range_map<size_t>& rmap, uint32_t family_id=0) {
+    #if SUPPORT_RP2350_A2
+    // ignore the absolute block, but save the address
+    if (index.has_abs_block && (!family_id || family_id == index.abs_block_family_id)) {
+        DEBUG_LOG("Ignoring RP2350-E10 absolute block\n");
+        settings.uf2.abs_block_loc = index.abs_block_loc;
+    }
+    #endif
+    if (!family_id) {
+        if (index.families.empty()) return 0;
+        family_id = index.families[0];
+    }
+    auto f = index.pages.find(family_id);
+    if (f == index.pages.end()) return 0;
+    rmap.reserve(rmap.size() + f->second.size());
+    for (const auto &page : f->second) {
+        rmap.append(range(page.target_addr, page.target_addr + PAGE_SIZE), page.data_offset);
+    }
+    auto next = std::find(index.families.begin(), index.families.end(), family_id);
+    return ++next == index.families.end() ? 0 : *next;
 }
 
 void build_rmap_load_map(std::shared_ptr<load_map_item>load_map, range_map<uint32_t>& rmap) {
@@ -3047,7 +3524,7 @@ uint32_t find_binary_start(range_map<size_t>& rmap) {
     return binary_start;
 }
 
-template <typename ACCESS, typename STREAM> ACCESS get_iostream_memory_access(std::shared_ptr<STREAM> file, filetype type, bool writeable = false, uint32_t *next_family_id=nullptr) {
+template <typename ACCESS, typename STREAM> ACCESS get_iostream_memory_access(std::shared_ptr<STREAM> file, filetype type, bool writeable = false, uint32_t *next_family_id=nullptr, std::shared_ptr<uf2_index> index=nullptr) {
     range_map<size_t> rmap;
     uint32_t binary_start = 0;
     uint32_t tmp = 0;
@@ -3063,7 +3540,8 @@ template <typename ACCESS, typename STREAM> ACCESS get_iostream_memory_access(st
             binary_start = find_binary_start(rmap);
             break;
         case filetype::uf2:
-            tmp = build_rmap_uf2(file, rmap, tmp);
+            if (!index) index = build_uf2_index(file);
+            tmp = build_rmap_uf2(*index, rmap, tmp);
             if (next_family_id != nullptr) {
                 *next_family_id = tmp;
             } else if (tmp) {
@@ -3083,11 +3561,39 @@ template <typename ACCESS, typename STREAM> ACCESS get_iostream_memory_access(st
     return ACCESS(file, rmap, binary_start);
 }
 
+// UF2 indexes of files that are only being read, so that each family of a multi-family UF2 (or the same
+// file loaded onto several devices) doesn't require the file to be scanned again. They are keyed by the
+// file's identity, so a file which has been rewritten since (e.g. between the commands of picotool serve)
+// is scanned again
+std::shared_ptr<uf2_index> get_uf2_index(std::shared_ptr<std::iostream> file, uint8_t idx, bool writeable) {
+    static std::mutex mutex;
+    static std::map<file_identity, std::shared_ptr<uf2_index>> indexes;
+    std::lock_guard<std::mutex> lock(mutex);
+    file_identity id;
+    if (!get_file_identity(settings.filenames[idx], id)) {
+        return build_uf2_index(file);
+    }
+    auto it = indexes.find(id);
+    if (it != indexes.end() && !writeable) {
+        return it->second;
+    }
+    // drop the indexes of any earlier contents
+    for (auto i = indexes.begin(); i != indexes.end(); ) {
+        i = i->first.same_file(id) ? indexes.erase(i) : std::next(i);
+    }
+    auto index = build_uf2_index(file);
+    if (!writeable) indexes.emplace(id, index);
+    return index;
+}
+
 file_memory_access get_file_memory_access(uint8_t idx, bool writeable = false, uint32_t *next_family_id=nullptr) {
     ios::openmode mode = (writeable ? ios::out|ios::in : ios::in)|ios::binary;
     auto file = get_file_idx(mode, idx);
     try {
-        return get_iostream_memory_access<file_memory_access>(file, get_file_type_idx(idx), writeable, next_family_id);
+        auto type = get_file_type_idx(idx);
+        std::shared_ptr<uf2_index> index;
+        if (type == filetype::uf2) index = get_uf2_index(file, idx, writeable);
+        return get_iostream_memory_access<file_memory_access>(file, type, writeable, next_family_id, index);
     } catch (std::exception&) {
         file->close();
         throw;
@@ -3146,7 +3652,7 @@ std::unique_ptr<block> find_best_block(memory_access &raw_access, vector<uint8_t
             DEBUG_LOG("Now reading from %x size %x\n", offset, size);
             bin = raw_access.read_vector<uint8_t>(offset, size, true);
         };
-        auto all_blocks = get_all_blocks(bin, raw_access.get_binary_start(), best_block, more_cb);
+        auto all_blocks = get_all_blocks(bin, raw_access.get_binary_start(), best_block, more_cb, raw_access.get_block_cache());
 
         bool has_arch = false;
         // for (int i=0; i < all_blocks.size(); i++) {
@@ -3210,7 +3716,7 @@ std::unique_ptr<block> find_last_block(memory_access &raw_access, vector<uint8_t
             DEBUG_LOG("Now reading from %x size %x\n", offset, size);
             bin = raw_access.read_vector<uint8_t>(offset, size, true);
         };
-        auto last_block = get_last_block(bin, raw_access.get_binary_start(), first_block, more_cb);
+        auto last_block = get_last_block(bin, raw_access.get_binary_start(), first_block, more_cb, raw_access.get_block_cache());
         return last_block;
     }
 
@@ -3545,7 +4051,8 @@ void info_guts(memory_access &raw_access, void *con) {
             auto bi_access = get_bi_access(raw_access);
             bool has_binary_info = find_binary_info(*bi_access, hdr);
             if (has_binary_info) {
-                auto access = remapped_memory_access(*bi_access, hdr.reverse_copy_mapping);
+                auto remapped_access = remapped_memory_access(*bi_access, hdr.reverse_copy_mapping);
+                auto access = binary_info_memory_access(remapped_access, hdr);
                 auto visitor = bi_visitor{};
                 map<string, string> output;
                 map<unsigned int, vector<string>> pins;
@@ -3698,7 +4205,7 @@ void info_guts(memory_access &raw_access, void *con) {
                 std::unique_ptr<block> first_block = find_first_block(bin, raw_access.get_binary_start());
                 if (first_block) {
                     // verify stuff
-                    auto all_blocks = get_all_blocks(bin, raw_access.get_binary_start(), first_block, more_cb);
+                    auto all_blocks = get_all_blocks(bin, raw_access.get_binary_start(), first_block, more_cb, raw_access.get_block_cache());
 
                     int block_i = 0;
                     select_group(metadata_info[block_i++], true);
@@ -3932,7 +4439,8 @@ void config_guts(memory_access &raw_access) {
 
     auto bi_access = get_bi_access(raw_access);
     if (find_binary_info(*bi_access, hdr)) {
-        auto access = remapped_memory_access(*bi_access, hdr.reverse_copy_mapping);
+        auto remapped_access = remapped_memory_access(*bi_access, hdr.reverse_copy_mapping);
+        auto access = binary_info_memory_access(remapped_access, hdr);
         auto visitor = bi_visitor{};
 
         map<pair<int, uint32_t>, pair<string, unsigned int>> named_feature_groups;
@@ -4226,7 +4734,7 @@ std::shared_ptr<vector<tuple<uint32_t, uint32_t>>> get_partitions(picoboot::conn
             ));
             if ((location_and_permissions ^ flags_and_permissions) &
                 PICOBIN_PARTITION_PERMISSIONS_BITS) {
-                printf("PARTITION TABLE PERMISSION MISMATCH!\n");
+                tprintf("PARTITION TABLE PERMISSION MISMATCH!\n");
                 return nullptr;
             }
         }
@@ -4429,6 +4937,9 @@ static picoboot::connection get_single_picoboot_cmd_compatible_device_connection
 }
 #endif
 
+// when set, progress bars on this thread are reported here rather than drawn (used when running on several devices at once)
+thread_local std::function<void(int)> progress_sink;
+
 struct progress_bar {
     explicit progress_bar(string new_prefix, int width = 30) : width(width) {
         // Align all bars with the longest possible prefix string
@@ -4446,8 +4957,12 @@ struct progress_bar {
     void progress(int _percent) {
         if (_percent != percent) {
             percent = _percent;
+            if (progress_sink) {
+                progress_sink(percent);
+                return;
+            }
             unsigned int len = (width * percent) / 100;
-            std::cout << prefix << "[" << string(len, '=') << string(width-len, ' ') << "]  " << std::to_string(percent) << "%\r" << std::flush;
+            tcout << prefix << "[" << string(len, '=') << string(width-len, ' ') << "]  " << std::to_string(percent) << "%\r" << std::flush;
         }
     }
 
@@ -4456,7 +4971,7 @@ struct progress_bar {
     }
 
     ~progress_bar() {
-        std::cout << "\n";
+        if (!progress_sink) tcout << "\n";
     }
 
     std::string prefix;
@@ -4464,6 +4979,79 @@ struct progress_bar {
     int width;
 };
 
+// bounded producer/consumer queue, used to overlap host side staging with USB transfers
+template <typename T> struct bounded_queue {
+    explicit bounded_queue(size_t capacity) : capacity(capacity) {}
+
+    // returns false if the queue was closed (by the consumer) before the item could be added
+    bool push(T t) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [&] { return closed || items.size() < capacity; });
+        if (closed) return false;
+        items.push_back(std::move(t));
+        not_empty.notify_one();
+        return true;
+    }
+
+    // returns false once the queue is closed and empty
+    bool pop(T &t) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [&] { return closed || !items.empty(); });
+        if (items.empty()) return false;
+        t = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<T> items;
+    size_t capacity;
+    bool closed = false;
+};
+
+// runs a producer on a worker thread feeding a bounded_queue; any exception thrown by the producer
+// is rethrown on the consuming thread by pop()
+template <typename T> struct staging_thread {
+    staging_thread(size_t capacity, std::function<void(bounded_queue<T>&)> producer) : queue(capacity) {
+        worker = std::thread([this, producer] {
+            try {
+                producer(queue);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            queue.close();
+        });
+    }
+
+    ~staging_thread() {
+        queue.close();
+        if (worker.joinable()) worker.join();
+    }
+
+    bool pop(T &t) {
+        if (queue.pop(t)) return true;
+        if (worker.joinable()) worker.join();
+        if (error) std::rethrow_exception(error);
+        return false;
+    }
+
+private:
+    bounded_queue<T> queue;
+    std::exception_ptr error;
+    std::thread worker;
+};
+
 #if HAS_LIBUSB
 vector<range> get_coalesced_ranges(iostream_memory_access &file_access, model_t model) {
     auto rmap = file_access.get_rmap();
@@ -4492,32 +5080,127 @@ vector<range> get_coalesced_ranges(iostream_memory_access &file_access, model_t
     return ranges;
 }
 
-bool save_command::execute(device_map &devices) {
-    auto con = get_single_bootsel_device_connection(devices);
-    picoboot_memory_access raw_access(con);
+static bool is_erased(const uint8_t *data, size_t len) {
+    return std::all_of(data, data + len, [](uint8_t b) { return b == 0xff; });
+}
 
-    uint32_t end = 0;
-    uint32_t binary_end = 0;
-    binary_info_header hdr;
-    uint32_t start = FLASH_START;
-    if (!settings.save.all) {
-        if (settings.range_set) {
-            if (get_file_type() == filetype::uf2) {
-                start = settings.from & ~(PAGE_SIZE - 1);
-                end = (settings.to + (PAGE_SIZE - 1)) & ~(PAGE_SIZE - 1);
-            } else {
-                start = settings.from;
-                end = settings.to;
-                // Set offset for verifying
-                settings.offset = start;
-                settings.offset_set = true;
-            }
-            if (end <= start) {
+// Whether digests of the flash from -> to can be computed on the device by flash_crc32 (only RP2040 can run the code)
+static bool can_digest_flash(model_t model, uint32_t from, uint32_t to) {
+    return model->chip() == rp2040 && from >= FLASH_START && to <= FLASH_END_RP2040;
+}
+
+// The first sector of the sector aligned flash at addr whose CRC, computed on the device, doesn't match that of
+// data, or addr + len if they all match. Only 4 bytes per sector come back over USB
+static uint32_t first_mismatched_sector(picoboot::connection &con, uint32_t addr, const uint8_t *data, uint32_t len) {
+    assert(!(addr & (FLASH_SECTOR_ERASE_SIZE - 1)) && !(len & (FLASH_SECTOR_ERASE_SIZE - 1)));
+    auto crcs = con.flash_crc32(addr, FLASH_SECTOR_ERASE_SIZE, len / FLASH_SECTOR_ERASE_SIZE);
+    for (uint32_t i = 0; i < crcs.size(); i++) {
+        if (crcs[i] != crc32_msb(data + i * FLASH_SECTOR_ERASE_SIZE, FLASH_SECTOR_ERASE_SIZE, 0xffffffff)) {
+            return addr + i * FLASH_SECTOR_ERASE_SIZE;
+        }
+    }
+    return addr + len;
+}
+
+// Verifies the flash in mem_range against file_access using digests computed on the device, rather than reading it
+// all back; only the partial sectors at the ends, and the first sector which differs (to find the byte), are read.
+// Returns false if the digests can't be computed, leaving the caller to read the flash back. Otherwise ok is set,
+// and pos is the first address which differs
+static bool verify_flash_with_digests(picoboot::connection &con, memory_access &raw_access, memory_access &file_access,
+                                      range mem_range, progress_bar &bar, bool &ok, uint32_t &pos) {
+    range sectors((mem_range.from + FLASH_SECTOR_ERASE_SIZE - 1) & ~(FLASH_SECTOR_ERASE_SIZE - 1),
+                  mem_range.to & ~(FLASH_SECTOR_ERASE_SIZE - 1));
+    if (sectors.empty() || !can_digest_flash(raw_access.get_model(), sectors.from, sectors.to)) return false;
+    vector<uint8_t> file_buf;
+    vector<uint8_t> device_buf;
+    // compare from -> to by reading it back, setting pos to the first difference
+    auto compare = [&](uint32_t from, uint32_t to) {
+        if (from >= to) return true;
+        // fill in case the file has holes (with 0xff if it is sparse), as when reading back
+        file_access.read_into_vector(from, to - from, file_buf, true);
+        raw_access.read_into_vector(from, to - from, device_buf);
+        auto diff = std::mismatch(file_buf.begin(), file_buf.end(), device_buf.begin());
+        pos = from + (diff.first - file_buf.begin());
+        return diff.first == file_buf.end();
+    };
+    // the digests for up to this many bytes are computed by each run of the code on the device
+    const uint32_t digest_batch = 1024 * 1024;
+    ok = compare(mem_range.from, sectors.from);
+    for (uint32_t base = sectors.from; ok && base < sectors.to; ) {
+        uint32_t this_len = std::min(sectors.to - base, digest_batch);
+        file_access.read_into_vector(base, this_len, file_buf, true);
+        uint32_t sector;
+        try {
+            sector = first_mismatched_sector(con, base, file_buf.data(), this_len);
+        } catch (picoboot::command_failure &) {
+            // the code couldn't be run (e.g. on a simulated device)
+            if (base == sectors.from) return false;
+            throw;
+        }
+        if (sector < base + this_len) {
+            // read the sector back to find the byte
+            if (compare(sector, sector + FLASH_SECTOR_ERASE_SIZE)) pos = sector;
+            ok = false;
+            break;
+        }
+        base += this_len;
+        pos = base;
+        bar.progress(pos - mem_range.from, mem_range.len());
+    }
+    if (ok) ok = compare(sectors.to, mem_range.to);
+    if (ok) pos = mem_range.to;
+    return true;
+}
+
+// Which of the flash sectors in the sector aligned range from -> to are erased, from digests computed on the device
+// so the flash isn't read back; empty if the device can't compute them (only RP2040 can)
+static vector<bool> find_erased_sectors(picoboot::connection &con, model_t model, uint32_t from, uint32_t to) {
+    vector<bool> erased;
+    if (!can_digest_flash(model, from, to)) return erased;
+    static const uint32_t erased_crc = [] {
+        vector<uint8_t> sector(FLASH_SECTOR_ERASE_SIZE, 0xff);
+        return crc32_msb(sector.data(), sector.size(), 0xffffffff);
+    }();
+    vector<uint32_t> crcs;
+    try {
+        crcs = con.flash_crc32(from, FLASH_SECTOR_ERASE_SIZE, (to - from) / FLASH_SECTOR_ERASE_SIZE);
+    } catch (picoboot::command_failure &) {
+        // the code couldn't be run (e.g. on a simulated device), so the caller falls back to reading the flash
+        return erased;
+    }
+    for (auto crc : crcs) {
+        erased.push_back(crc == erased_crc);
+    }
+    return erased;
+}
+
+bool save_command::execute(device_map &devices) {
+    auto con = get_single_bootsel_device_connection(devices);
+    picoboot_memory_access raw_access(con);
+
+    uint32_t end = 0;
+    uint32_t binary_end = 0;
+    binary_info_header hdr;
+    uint32_t start = FLASH_START;
+    if (!settings.save.all) {
+        if (settings.range_set) {
+            if (get_file_type() == filetype::uf2) {
+                start = settings.from & ~(PAGE_SIZE - 1);
+                end = (settings.to + (PAGE_SIZE - 1)) & ~(PAGE_SIZE - 1);
+            } else {
+                start = settings.from;
+                end = settings.to;
+                // Set offset for verifying
+                settings.offset = start;
+                settings.offset_set = true;
+            }
+            if (end <= start) {
                 fail(ERROR_ARGS, "Save range is invalid/empty");
             }
         } else {
             if (find_binary_info(raw_access, hdr)) {
-                auto access = remapped_memory_access(raw_access, hdr.reverse_copy_mapping);
+                auto remapped_access = remapped_memory_access(raw_access, hdr.reverse_copy_mapping);
+                auto access = binary_info_memory_access(remapped_access, hdr);
                 auto visitor = bi_visitor{};
                 visitor.id_and_int([&](int tag, uint32_t id, uint32_t value) {
                     if (tag != BINARY_INFO_TAG_RASPBERRY_PI)
@@ -4553,7 +5236,20 @@ bool save_command::execute(device_map &devices) {
         fail(ERROR_NOT_POSSIBLE, "Save range crosses unmapped memory");
     }
     uint32_t size = end - start;
-    uint32_t chunk_size = calculate_chunk_size(size);
+    transfer_scheduler scheduler;
+
+    // With --sparse, erased flash pages are left out of a UF2 file, and sectors the device reports as erased are
+    // not read back at all (a BIN file has no holes, so they are written as 0xff)
+    bool sparse = settings.save.sparse && t1 == flash;
+    range sector_range(start & ~(FLASH_SECTOR_ERASE_SIZE - 1), (end + FLASH_SECTOR_ERASE_SIZE - 1) & ~(FLASH_SECTOR_ERASE_SIZE - 1));
+    vector<bool> erased_sectors;
+    if (sparse) {
+        erased_sectors = find_erased_sectors(con, model, sector_range.from, sector_range.to);
+    }
+    auto sector_erased = [&](uint32_t addr) {
+        return !erased_sectors.empty() && erased_sectors[(addr - sector_range.from) / FLASH_SECTOR_ERASE_SIZE];
+    };
+    uint32_t blocks_written = 0;
 
     std::function<void(FILE *out, const uint8_t *buffer, unsigned int size, unsigned int offset)> writer256 = [](FILE *out, const uint8_t *buffer, unsigned int size, unsigned int offset) { assert(false); };
     uf2_block block;
@@ -4583,8 +5279,9 @@ bool save_command::execute(device_map &devices) {
             block.magic_end = UF2_MAGIC_END;
             writer256 = [&](FILE *out, const uint8_t *buffer, unsigned int size, unsigned int offset) {
                 static_assert(512 == sizeof(block), "");
+                if (sparse && is_erased(buffer, size)) return;
                 block.target_addr = start + offset;
-                block.block_no = offset / PAGE_SIZE;
+                block.block_no = blocks_written++;
                 assert(size <= PAGE_SIZE);
                 memcpy(block.data, buffer, size);
                 if (size < PAGE_SIZE) memset(block.data + size, 0, PAGE_SIZE - size);
@@ -4602,19 +5299,49 @@ bool save_command::execute(device_map &devices) {
             vector<uint8_t> buf;
             {
                 progress_bar bar("Saving file: ");
-                for (uint32_t addr = start; addr < end; addr += chunk_size) {
+                vector<uint8_t> run_buf;
+                for (uint32_t addr = start; addr < end; ) {
                     bar.progress(addr-start, end-start);
-                    uint32_t this_chunk_size = std::min(chunk_size, end - addr);
-                    raw_access.read_into_vector(addr, this_chunk_size, buf);
+                    uint32_t this_chunk_size = scheduler.next_batch(addr, end);
+                    auto batch_start = std::chrono::steady_clock::now();
+                    if (erased_sectors.empty()) {
+                        raw_access.read_into_vector(addr, this_chunk_size, buf);
+                    } else {
+                        // only read the runs of sectors which aren't erased
+                        buf.assign(this_chunk_size, 0xff);
+                        uint32_t chunk_end = addr + this_chunk_size;
+                        for (uint32_t pos = addr; pos < chunk_end;) {
+                            uint32_t run_from = pos;
+                            bool erased = sector_erased(pos);
+                            while (pos < chunk_end && sector_erased(pos) == erased) {
+                                pos = std::min((pos & ~(FLASH_SECTOR_ERASE_SIZE - 1)) + FLASH_SECTOR_ERASE_SIZE, chunk_end);
+                            }
+                            if (!erased) {
+                                raw_access.read_into_vector(run_from, pos - run_from, run_buf);
+                                std::copy(run_buf.begin(), run_buf.end(), buf.begin() + (run_from - addr));
+                            }
+                        }
+                    }
                     uint32_t remaining_size = this_chunk_size;
                     while (remaining_size) {
                         uint32_t this_size = std::min(PAGE_SIZE, remaining_size);
                         writer256(out, buf.data() + (this_chunk_size - remaining_size), this_size, addr - start + (this_chunk_size - remaining_size));
                         remaining_size -= this_size;
                     }
+                    scheduler.completed(this_chunk_size, std::chrono::steady_clock::now() - batch_start);
+                    addr += this_chunk_size;
                 }
                 bar.progress(100);
             }
+            if (get_file_type() == filetype::uf2 && blocks_written != block.num_blocks) {
+                // blocks were left out, so the total in each block header is too big
+                for (uint32_t i = 0; i < blocks_written; i++) {
+                    fseek(out, i * sizeof(block) + offsetof(uf2_block, num_blocks), SEEK_SET);
+                    if (1 != fwrite(&blocks_written, sizeof(blocks_written), 1, out)) {
+                        fail_write_error();
+                    }
+                }
+            }
             fseek(out, 0, SEEK_END);
             std::cout << "Wrote " << ftell(out) << " bytes to " << settings.filenames[0].c_str() << "\n";
             fclose(out);
@@ -4628,6 +5355,9 @@ bool save_command::execute(device_map &devices) {
         raw_access.clear_cache();
         auto file_access = get_file_memory_access(0);
         model_t model = raw_access.get_model();
+        // so holes in flash (pages left out by --sparse) read back as erased
+        file_access.set_model(model);
+        file_access.set_erased_holes(settings.save.sparse);
         auto ranges = get_coalesced_ranges(file_access, model);
         for (auto mem_range : ranges) {
             enum memory_type type = get_memory_type(mem_range.from, model);
@@ -4637,11 +5367,25 @@ bool save_command::execute(device_map &devices) {
                 vector<uint8_t> file_buf;
                 vector<uint8_t> device_buf;
                 uint32_t pos = mem_range.from;
-                for (uint32_t base = mem_range.from; base < mem_range.to && ok; base += chunk_size) {
-                    uint32_t this_batch = std::min(std::min(mem_range.to, end) - base, chunk_size);
-                    // note we pass zero_fill = true in case the file has holes, but this does
-                    // mean that the verification will fail if those holes are not filled with zeros
-                    // on the device
+                uint32_t verify_end = std::min(mem_range.to, end);
+                // flash on RP2040 is checked against digests computed on the device
+                if (verify_flash_with_digests(con, raw_access, file_access, range(mem_range.from, verify_end), bar, ok, pos)) {
+                    if (!ok) {
+                        uint8_t file_byte, device_byte;
+                        file_access.read(pos, &file_byte, 1, true);
+                        raw_access.read(pos, &device_byte, 1, false);
+                        printf("Unmatch file %x, device %x, pos %x\n", file_byte, device_byte, pos);
+                    }
+                    bar.progress(pos - mem_range.from, mem_range.to - mem_range.from);
+                    verify_end = mem_range.from;
+                }
+                transfer_scheduler verify_scheduler;
+                for (uint32_t base = mem_range.from; base < verify_end && ok; ) {
+                    uint32_t this_batch = verify_scheduler.next_batch(base, verify_end);
+                    auto batch_start = std::chrono::steady_clock::now();
+                    // note we pass zero_fill = true in case the file has holes; with --sparse, holes in
+                    // flash read as erased (0xff), but otherwise verification will fail if those holes
+                    // are not filled with zeros on the device
                     file_access.read_into_vector(base, this_batch, file_buf, true);
                     raw_access.read_into_vector(base, this_batch, device_buf);
                     assert(file_buf.size() == device_buf.size());
@@ -4656,6 +5400,8 @@ bool save_command::execute(device_map &devices) {
                     if (ok) {
                         pos = base + this_batch;
                     }
+                    verify_scheduler.completed(this_batch, std::chrono::steady_clock::now() - batch_start);
+                    base += this_batch;
                     bar.progress(pos - mem_range.from, mem_range.to - mem_range.from);
                 }
             }
@@ -4698,8 +5444,8 @@ bool erase_command::execute(device_map &devices) {
         }
         end = tmp;
 
-        printf("Erasing partition %d:\n", settings.load.partition);
-        printf("  %08x->%08x\n", start, end);
+        tprintf("Erasing partition %d:\n", settings.load.partition);
+        tprintf("  %08x->%08x\n", start, end);
         start += FLASH_START;
         end += FLASH_START;
         if (end <= start) {
@@ -4726,15 +5472,47 @@ bool erase_command::execute(device_map &devices) {
     }
     uint32_t size = end - start;
 
+    // With --sparse, sectors which are already erased are skipped. On RP2040 they are found from digests computed on
+    // the device, otherwise by reading the flash back, which is still much quicker than erasing it
+    vector<bool> erased_sectors;
+    if (settings.erase.sparse) {
+        erased_sectors = find_erased_sectors(con, model, start, end);
+        if (erased_sectors.empty()) {
+            progress_bar bar("Checking: ");
+            transfer_scheduler scheduler;
+            vector<uint8_t> buf;
+            for (uint32_t addr = start; addr < end; ) {
+                bar.progress(addr-start, end-start);
+                uint32_t this_chunk_size = scheduler.next_batch(addr, end);
+                auto batch_start = std::chrono::steady_clock::now();
+                raw_access.read_into_vector(addr, this_chunk_size, buf);
+                for (uint32_t offset = 0; offset < this_chunk_size; offset += FLASH_SECTOR_ERASE_SIZE) {
+                    erased_sectors.push_back(is_erased(buf.data() + offset, FLASH_SECTOR_ERASE_SIZE));
+                }
+                scheduler.completed(this_chunk_size, std::chrono::steady_clock::now() - batch_start);
+                addr += this_chunk_size;
+            }
+            bar.progress(100);
+        }
+    }
+    uint32_t skipped = 0;
     {
         progress_bar bar("Erasing: ");
         for (uint32_t addr = start; addr < end; addr += FLASH_SECTOR_ERASE_SIZE) {
             bar.progress(addr-start, end-start);
+            if (!erased_sectors.empty() && erased_sectors[(addr - start) / FLASH_SECTOR_ERASE_SIZE]) {
+                skipped += FLASH_SECTOR_ERASE_SIZE;
+                continue;
+            }
             con.flash_erase(addr, FLASH_SECTOR_ERASE_SIZE);
         }
         bar.progress(100);
     }
-    std::cout << "Erased " << size << " bytes\n";
+    if (skipped) {
+        tcout << "Erased " << size - skipped << " bytes (" << skipped << " bytes were already erased)\n";
+    } else {
+        tcout << "Erased " << size << " bytes\n";
+    }
     return false;
 }
 #endif
@@ -4753,18 +5531,18 @@ bool get_target_partition(picoboot::connection &con, uint32_t* start = nullptr,
     con.get_info(&cmd, loc_flags_id_buf, sizeof(loc_flags_id_buf));
     assert(loc_flags_id_buf_32[0] == 3);
     if ((int)loc_flags_id_buf_32[1] < 0) {
-        printf("Family ID %s cannot be downloaded anywhere\n", family_name(settings.family_id).c_str());
+        tprintf("Family ID %s cannot be downloaded anywhere\n", family_name(settings.family_id).c_str());
         return false;
     } else {
         if (loc_flags_id_buf_32[1] == PARTITION_TABLE_NO_PARTITION_INDEX) {
-            printf("Family ID %s can be downloaded in absolute space:\n", family_name(settings.family_id).c_str());
+            tprintf("Family ID %s can be downloaded in absolute space:\n", family_name(settings.family_id).c_str());
         } else {
-            printf("Family ID %s can be downloaded in partition %d:\n", family_name(settings.family_id).c_str(), loc_flags_id_buf_32[1]);
+            tprintf("Family ID %s can be downloaded in partition %d:\n", family_name(settings.family_id).c_str(), loc_flags_id_buf_32[1]);
         }
         uint32_t location_and_permissions = loc_flags_id_buf_32[2];
         uint32_t saddr = ((location_and_permissions >> PICOBIN_PARTITION_LOCATION_FIRST_SECTOR_LSB) & 0x1fffu) * 4096;
         uint32_t eaddr = (((location_and_permissions >> PICOBIN_PARTITION_LOCATION_LAST_SECTOR_LSB) & 0x1fffu) + 1) * 4096;
-        printf("  %08x->%08x\n", saddr, eaddr);
+        tprintf("  %08x->%08x\n", saddr, eaddr);
         if (start) *start = saddr;
         if (end) *end = eaddr;
         return true;
@@ -4842,86 +5620,192 @@ bool load_guts(picoboot::connection con, iostream_memory_access &file_access) {
             }
         }
     }
+    // With --compress, flash is programmed by code run on the device, from LZ4 compressed data which it decompresses
+    // into RAM; that needs PC_EXEC, which only RP2040 has
+    bool compress = false;
+    uint32_t rom_flash_range_program = 0;
+    uint32_t rom_flash_flush_cache = 0;
+    if (settings.load.compress && uses_flash) {
+        if (model->chip() == rp2040) {
+            rom_flash_range_program = bootrom_func_lookup_rp2040(raw_access, rom_table_code('R', 'P'));
+            rom_flash_flush_cache = bootrom_func_lookup_rp2040(raw_access, rom_table_code('F', 'C'));
+            compress = true;
+        } else {
+            fos << "Compressed loading is only supported on RP2040, so the flash data will be sent uncompressed\n";
+        }
+    }
+    // A batch of file data staged for writing to the device; for flash it covers whole erase sectors
+    struct load_batch {
+        range target;
+        uint32_t progress_to;
+        vector<uint8_t> data;
+    };
     for (auto mem_range : ranges) {
         enum memory_type type = get_memory_type(mem_range.from, model);
-        // new scope for progress bar
-        {
-            progress_bar bar("Loading into " + memory_names[type] + ": ");
-            // Use batches of size/100 rounded up to FLASH_SECTOR_ERASE_SIZE
-            uint32_t batch_size = calculate_chunk_size(mem_range.len());
-            bool ok = true;
-            vector<uint8_t> file_buf;
-            vector<uint8_t> device_buf;
-            for (uint32_t base = mem_range.from; base < mem_range.to && ok;) {
-                uint32_t this_batch = std::min(mem_range.to - base, batch_size);
+        // the batch sizes adapt to the time taken to send each one to the device
+        transfer_scheduler scheduler;
+        // For --update on RP2040 the digest of each flash sector is computed on the device, so unchanged
+        // sectors are skipped without being read back
+        range digest_range;
+        vector<uint32_t> device_crcs;
+        if (type == flash && settings.load.update && model->chip() == rp2040) {
+            digest_range = range(mem_range.from & ~(FLASH_SECTOR_ERASE_SIZE - 1),
+                                 (mem_range.to + FLASH_SECTOR_ERASE_SIZE - 1) & ~(FLASH_SECTOR_ERASE_SIZE - 1));
+            try {
+                device_crcs = con.flash_crc32(digest_range.from, FLASH_SECTOR_ERASE_SIZE, digest_range.len() / FLASH_SECTOR_ERASE_SIZE);
+            } catch (picoboot::command_failure &) {
+                // the code couldn't be run (e.g. on a simulated device), so the flash is read back instead
+                device_crcs.clear();
+            }
+        }
+        // File decode for batch N+1 runs on the staging thread, while erase/program of batch N and the
+        // verify readback of batch N-1 are pipelined on the USB connection
+        staging_thread<load_batch> staging(4, [&, mem_range, type](bounded_queue<load_batch> &queue) {
+            for (uint32_t base = mem_range.from; base < mem_range.to;) {
+                uint32_t this_batch = scheduler.next_batch(base, mem_range.to);
+                load_batch batch;
                 if (type == flash) {
-                    // we have to erase an entire page, so then fill with zeros
+                    // we have to erase an entire page, so then fill with 0xff which is left as erased
                     range aligned_range(base & ~(FLASH_SECTOR_ERASE_SIZE - 1),
                                         (base + this_batch + FLASH_SECTOR_ERASE_SIZE - 1) & ~(FLASH_SECTOR_ERASE_SIZE - 1));
                     range read_range(base, base + this_batch);
                     read_range.intersect(aligned_range);
-                    file_access.read_into_vector(read_range.from, read_range.to - read_range.from, file_buf, true); // zero fill to cope with holes
-                    // zero padding up to batch_size
-                    file_buf.insert(file_buf.begin(), read_range.from - aligned_range.from, 0);
-                    file_buf.insert(file_buf.end(), aligned_range.to - read_range.to, 0);
-                    assert(file_buf.size() == aligned_range.len());
-
-                    bool skip = false;
-                    if (settings.load.update) {
-                        vector<uint8_t> read_device_buf;
-                        raw_access.read_into_vector(aligned_range.from, file_buf.size(), read_device_buf);
-                        skip = file_buf == read_device_buf;
-                    }
-                    if (!skip) {
-                        con.exit_xip();
-                        con.flash_erase(aligned_range.from, file_buf.size());
-                        raw_access.write_vector(aligned_range.from, file_buf);
-                    }
+                    file_access.read_into_vector(read_range.from, read_range.to - read_range.from, batch.data, true); // zero fill (or erased, if sparse) to cope with holes
+                    // 0xff padding up to batch_size
+                    batch.data.insert(batch.data.begin(), read_range.from - aligned_range.from, 0xff);
+                    batch.data.insert(batch.data.end(), aligned_range.to - read_range.to, 0xff);
+                    assert(batch.data.size() == aligned_range.len());
+                    batch.target = aligned_range;
                     base = read_range.to; // about to add batch_size
                 } else {
-                    file_access.read_into_vector(base, this_batch, file_buf);
-                    raw_access.write_vector(base, file_buf);
+                    file_access.read_into_vector(base, this_batch, batch.data);
+                    batch.target = range(base, base + this_batch);
                     base += this_batch;
                 }
-                bar.progress(base - mem_range.from, mem_range.to - mem_range.from);
+                batch.progress_to = base;
+                if (!queue.push(std::move(batch))) break;
             }
-        }
-    }
-    for (auto mem_range : ranges) {
-        enum memory_type type = get_memory_type(mem_range.from, model);
-        if (settings.load.verify) {
-            bool ok = true;
-            {
-                progress_bar bar("Verifying " + memory_names[type] + ": ");
-                uint32_t batch_size = calculate_chunk_size(mem_range.len());
-                vector<uint8_t> file_buf;
-                vector<uint8_t> device_buf;
-                uint32_t pos = mem_range.from;
-                for (uint32_t base = mem_range.from; base < mem_range.to && ok; base += batch_size) {
-                    uint32_t this_batch = std::min(mem_range.to - base, batch_size);
-                    // note we pass zero_fill = true in case the file has holes, but this does
-                    // mean that the verification will fail if those holes are not filled with zeros
-                    // on the device
-                    file_access.read_into_vector(base, this_batch, file_buf, true);
-                    raw_access.read_into_vector(base, this_batch, device_buf);
-                    assert(file_buf.size() == device_buf.size());
-                    for (unsigned int i = 0; i < this_batch; i++) {
-                        if (file_buf[i] != device_buf[i]) {
-                            pos = base + i;
-                            ok = false;
-                            break;
+        });
+        bool ok = true;
+        // new scope for progress bar
+        {
+            progress_bar bar("Loading into " + memory_names[type] + ": ");
+            load_batch batch;
+            load_batch written;
+            bool have_written = false;
+            vector<uint8_t> device_buf;
+            vector<picoboot_range_op> ops;
+            vector<range> compressed_runs;
+            auto check_written = [&]() {
+                if (settings.load.verify && have_written && ok && written.data != device_buf) {
+                    ok = false;
+                }
+            };
+            // flash on RP2040 is checked against digests computed on the device just after it is programmed,
+            // rather than being read back with the next batch
+            bool device_digests = settings.load.verify && type == flash && can_digest_flash(model, mem_range.from, mem_range.to);
+            auto check_digests = [&]() {
+                try {
+                    if (first_mismatched_sector(con, batch.target.from, batch.data.data(), batch.target.len()) != batch.target.to) {
+                        ok = false;
+                    }
+                } catch (picoboot::command_failure &) {
+                    // the code couldn't be run (e.g. on a simulated device), so read this batch and the rest back
+                    device_digests = false;
+                    con.exit_xip();
+                    device_buf.resize(batch.data.size());
+                    con.range_batch({{PC_READ, {batch.target.from, batch.target.len(), device_buf.data()}}});
+                    ok = batch.data == device_buf;
+                }
+            };
+            while (ok && staging.pop(batch)) {
+                auto batch_start = std::chrono::steady_clock::now();
+                ops.clear();
+                compressed_runs.clear();
+                if (type == flash) con.exit_xip();
+                if (settings.load.verify && have_written) {
+                    device_buf.resize(written.data.size());
+                    ops.push_back({PC_READ, {written.target.from, written.target.len(), device_buf.data()}});
+                }
+                auto write = [&](uint32_t from, uint32_t to) {
+                    if (type == flash && compress) {
+                        compressed_runs.emplace_back(from, to);
+                    } else {
+                        ops.push_back({PC_WRITE, {from, to - from, batch.data.data() + (from - batch.target.from)}});
+                    }
+                };
+                auto program = [&](uint32_t from, uint32_t to) {
+                    if (type != flash) {
+                        write(from, to);
+                        return;
+                    }
+                    ops.push_back({PC_FLASH_ERASE, {from, to - from, nullptr}});
+                    // pages which are all 0xff are left as they are after the erase
+                    for (uint32_t page = from; page < to;) {
+                        uint32_t run_from = page;
+                        while (page < to && !is_erased(batch.data.data() + (page - batch.target.from), PAGE_SIZE)) {
+                            page += PAGE_SIZE;
+                        }
+                        if (page > run_from) write(run_from, page);
+                        while (page < to && is_erased(batch.data.data() + (page - batch.target.from), PAGE_SIZE)) {
+                            page += PAGE_SIZE;
                         }
                     }
-                    if (ok) {
-                        pos = base + this_batch;
+                };
+                if (type == flash && settings.load.update) {
+                    // only erase and program the runs of sectors whose contents differ
+                    vector<uint8_t> read_device_buf;
+                    if (device_crcs.empty()) {
+                        raw_access.read_into_vector(batch.target.from, batch.data.size(), read_device_buf);
                     }
-                    bar.progress(pos - mem_range.from, mem_range.to - mem_range.from);
+                    uint32_t run_from = 0;
+                    bool in_run = false;
+                    for (uint32_t sector = batch.target.from; sector < batch.target.to; sector += FLASH_SECTOR_ERASE_SIZE) {
+                        uint32_t offset = sector - batch.target.from;
+                        bool changed;
+                        if (!device_crcs.empty()) {
+                            uint32_t crc = crc32_msb(batch.data.data() + offset, FLASH_SECTOR_ERASE_SIZE, 0xffffffff);
+                            changed = crc != device_crcs[(sector - digest_range.from) / FLASH_SECTOR_ERASE_SIZE];
+                        } else {
+                            changed = memcmp(batch.data.data() + offset, read_device_buf.data() + offset, FLASH_SECTOR_ERASE_SIZE) != 0;
+                        }
+                        if (changed && !in_run) {
+                            run_from = sector;
+                            in_run = true;
+                        } else if (!changed && in_run) {
+                            program(run_from, sector);
+                            in_run = false;
+                        }
+                    }
+                    if (in_run) program(run_from, batch.target.to);
+                } else {
+                    program(batch.target.from, batch.target.to);
+                }
+                con.range_batch(ops);
+                for (const auto &run : compressed_runs) {
+                    con.flash_program_lz4(run.from, batch.data.data() + (run.from - batch.target.from), run.len(),
+                                          rom_flash_range_program, rom_flash_flush_cache);
                 }
+                raw_access.invalidate_cache(batch.target.from, batch.target.len());
+                check_written();
+                if (device_digests) check_digests();
+                scheduler.completed(batch.target.len(), std::chrono::steady_clock::now() - batch_start);
+                bar.progress(batch.progress_to - mem_range.from, mem_range.to - mem_range.from);
+                std::swap(written, batch);
+                have_written = !device_digests;
             }
+            if (settings.load.verify && have_written && ok) {
+                if (type == flash) con.exit_xip();
+                device_buf.resize(written.data.size());
+                con.range_batch({{PC_READ, {written.target.from, written.target.len(), device_buf.data()}}});
+                check_written();
+            }
+        }
+        if (settings.load.verify) {
             if (ok) {
-                std::cout << "  OK\n";
+                tcout << "  OK\n";
             } else {
-                std::cout << "  FAILED\n";
+                tcout << "  FAILED\n";
                 fail(ERROR_VERIFICATION_FAILED, "The device contents did not match the file");
             }
         }
@@ -4961,7 +5845,7 @@ bool load_guts(picoboot::connection con, iostream_memory_access &file_access) {
             con.reboot(flash == get_memory_type(start, model) ? 0 : start,
                        model->sram_end(), 500);
         }
-        std::cout << "\nThe device was rebooted to start the application.\n";
+        tcout << "\nThe device was rebooted to start the application.\n";
         return true;
     }
     return false;
@@ -4981,8 +5865,8 @@ bool load_command::execute(device_map &devices) {
         }
         uint32_t start = std::get<0>((*partitions)[settings.load.partition]);
         uint32_t end = std::get<1>((*partitions)[settings.load.partition]);
-        printf("Downloading into partition %d:\n", settings.load.partition);
-        printf("  %08x->%08x\n", start, end);
+        tprintf("Downloading into partition %d:\n", settings.load.partition);
+        tprintf("  %08x->%08x\n", start, end);
         settings.offset = start + FLASH_START;
         settings.offset_set = true;
         settings.partition_size = end - start;
@@ -5011,6 +5895,9 @@ bool load_command::execute(device_map &devices) {
     if (settings.offset_set && get_file_type() != filetype::bin && raw_access.get_model()->chip() == rp2040) {
         fail(ERROR_ARGS, "Offset only valid for BIN files");
     }
+    // with --sparse, holes in flash are left erased, rather than being written with zeros
+    file_access.set_model(raw_access.get_model());
+    file_access.set_erased_holes(settings.load.sparse);
     bool ret = load_guts(con, file_access);
     return ret;
 }
@@ -5104,7 +5991,7 @@ void sign_guts_elf(elf_file* elf, private_t private_key, public_t public_key) {
             if (segment == nullptr) {
                 fail(ERROR_NOT_POSSIBLE, "The ELF file does not contain the vector table location %x", vtor_loc);
             }
-            auto content = elf->content(*segment);
+            auto content = elf->content_view(*segment);
             auto offset = vtor_loc - segment->virtual_address();
             uint32_t ep;
             memcpy(&ep, content.data() + offset + 4, sizeof(ep));
@@ -5363,7 +6250,7 @@ bool encrypt_command::execute(device_map &devices) {
     if (isElf) {
         elf_file source_file(settings.verbose);
         elf_file *elf = &source_file;
-        elf->read_file(get_file(ios::in|ios::binary));
+        read_elf_file_idx(elf, 0);
         // Remove any holes in the ELF file, as these cause issues when encrypting
         elf->remove_ph_holes();
         elf->remove_sh_holes();
@@ -5654,7 +6541,8 @@ bool encrypt_command::execute(device_map &devices) {
     return false;
 }
 
-bool seal_command::execute(device_map &devices) {
+// Seal the infile (filenames[0]) to the outfile (filenames[1])
+static void seal_file(const private_t &private_key, const public_t &public_key) {
     bool isElf = false;
     bool isBin = false;
     bool isUf2 = false;
@@ -5672,6 +6560,173 @@ bool seal_command::execute(device_map &devices) {
         fail(ERROR_ARGS, "Can only sign to same file type");
     }
 
+    if (isElf) {
+        elf_file source_file(settings.verbose);
+        elf_file *elf = &source_file;
+        read_elf_file_idx(elf, 0);
+        // Remove any holes in the ELF file, as these cause issues when signing/hashing
+        elf->remove_sh_holes();
+        sign_guts_elf(elf, private_key, public_key);
+
+        auto out = get_file_idx(ios::out|ios::binary, 1);
+        elf->write(out);
+        out->close();
+    } else if (isBin) {
+        auto access = get_file_memory_access(0);
+        auto rmap = access.get_rmap();
+        auto ranges = rmap.ranges();
+        assert(ranges.size() == 1);
+        auto bin_start = ranges[0].from;
+        auto bin_size = ranges[0].len();
+
+        auto sig_data = sign_guts_bin(access, private_key, public_key, bin_start, bin_size);
+        auto out = get_file_idx(ios::out|ios::binary, 1);
+        out->write((const char *)sig_data.data(), sig_data.size());
+        out->close();
+    } else if (isUf2) {
+        auto access = get_file_memory_access(0);
+        auto rmap = access.get_rmap();
+        auto ranges = rmap.ranges();
+        auto bin_start = ranges.front().from;
+        auto bin_size = ranges.back().to - bin_start;
+        auto family_id = get_family_id(0);
+
+        auto sig_data = sign_guts_bin(access, private_key, public_key, bin_start, bin_size);
+        auto tmp = std::make_shared<std::stringstream>();
+        tmp->write(reinterpret_cast<const char*>(sig_data.data()), sig_data.size());
+        auto out = get_file_idx(ios::out|ios::binary, 1);
+        bin2uf2(tmp, out, bin_start, family_id, access.get_model(), settings.uf2.abs_block_loc);
+        out->close();
+    } else {
+        fail(ERROR_ARGS, "Must be ELF or BIN");
+    }
+
+    if (!settings.quiet) {
+        auto access = get_file_memory_access(1);
+        set_model_from_metadata(access);
+        fos << "Output File " << settings.filenames[1] << ":\n\n";
+        settings.info.show_basic = true;
+        info_guts(access, nullptr);
+    }
+}
+
+// one infile/outfile pair of seal --batch
+struct seal_job {
+    string infile;
+    string outfile;
+    std::stringstream log;
+    int rc = 0;
+    string error;
+};
+
+// Seal the command line infile/outfile, plus each pair in the --batch list file, using a thread per CPU.
+// The files are independent, so each thread works on its own copy of the settings; the output for each
+// file is collected and shown in order once they are all done
+static void seal_batch(const private_t &private_key, const public_t &public_key) {
+    vector<std::unique_ptr<seal_job>> jobs;
+    auto add_job = [&](const string &infile, const string &outfile) {
+        std::unique_ptr<seal_job> job(new seal_job());
+        job->infile = infile;
+        job->outfile = outfile;
+        jobs.push_back(std::move(job));
+    };
+    add_job(settings.filenames[0], settings.filenames[1]);
+
+    std::ifstream list(settings.seal.batch);
+    if (!list.good()) {
+        fail(ERROR_READ_FAILED, "Could not open batch list file %s", settings.seal.batch.c_str());
+    }
+    string line;
+    int line_num = 0;
+    while (std::getline(list, line)) {
+        line_num++;
+        std::stringstream ss(line);
+        string infile, outfile, extra;
+        if (!(ss >> infile) || infile[0] == '#') continue;
+        if (!(ss >> outfile) || (ss >> extra)) {
+            fail(ERROR_ARGS, "%s:%d: expected an infile and an outfile", settings.seal.batch.c_str(), line_num);
+        }
+        add_job(infile, outfile);
+    }
+    // the jobs run at the same time, so no job may write a file which another job reads or writes (an infile which
+    // is also its own outfile is fine, as it is read before being written)
+    vector<std::pair<bool, file_identity>> infile_ids(jobs.size()), outfile_ids(jobs.size());
+    for (size_t i = 0; i < jobs.size(); i++) {
+        infile_ids[i].first = get_file_identity(jobs[i]->infile, infile_ids[i].second);
+        outfile_ids[i].first = get_file_identity(jobs[i]->outfile, outfile_ids[i].second);
+    }
+    for (size_t i = 0; i < jobs.size(); i++) {
+        for (size_t j = 0; j < jobs.size(); j++) {
+            if (i == j) continue;
+            bool clash = jobs[i]->outfile == jobs[j]->outfile || jobs[i]->outfile == jobs[j]->infile;
+            if (outfile_ids[i].first) {
+                clash = clash || (infile_ids[j].first && outfile_ids[i].second.same_file(infile_ids[j].second)) ||
+                                 (outfile_ids[j].first && outfile_ids[i].second.same_file(outfile_ids[j].second));
+            }
+            if (clash) {
+                fail(ERROR_ARGS, "Output file %s of the seal batch is also used by %s -> %s", jobs[i]->outfile.c_str(),
+                     jobs[j]->infile.c_str(), jobs[j]->outfile.c_str());
+            }
+        }
+    }
+
+    const _settings shared_settings = settings;
+    std::atomic<size_t> next_job(0);
+    auto worker = [&]() {
+        settings = shared_settings;
+        settings.file_types[0].clear();
+        settings.file_types[1].clear();
+        for (size_t i = next_job++; i < jobs.size(); i = next_job++) {
+            seal_job *job = jobs[i].get();
+            settings.filenames[0] = job->infile;
+            settings.filenames[1] = job->outfile;
+            // sealing can update the version settings from the file, so start each file afresh
+            settings.seal = shared_settings.seal;
+            settings.info = shared_settings.info;
+            fos_ptr = std::make_shared<clipp::formatting_ostream<std::ostream>>(job->log);
+            try {
+                seal_file(private_key, public_key);
+            } catch (failure_error &e) {
+                job->rc = e.code();
+                job->error = e.what();
+            } catch (std::exception &e) {
+                job->rc = ERROR_UNKNOWN;
+                job->error = e.what();
+            }
+        }
+    };
+    unsigned int num_threads = std::max(1u, std::thread::hardware_concurrency());
+    num_threads = std::min(num_threads, (unsigned int)jobs.size());
+    vector<std::thread> threads;
+    for (unsigned int i = 0; i < num_threads; i++) {
+        threads.emplace_back(worker);
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    int rc = 0;
+    unsigned int failed = 0;
+    for (const auto &job : jobs) {
+        if (job->rc) {
+            if (!rc) rc = job->rc;
+            failed++;
+        }
+        if (!settings.quiet) {
+            fos << job->log.str();
+        }
+    }
+    for (const auto &job : jobs) {
+        if (settings.quiet && !job->rc) continue;
+        fos << job->infile << " -> " << job->outfile << ": " << (job->rc ? "ERROR: " + job->error : "OK") << "\n";
+    }
+    fos.flush();
+    if (rc) {
+        fail(rc, "Failed to seal %d of %d files", failed, (int)jobs.size());
+    }
+}
+
+bool seal_command::execute(device_map &devices) {
     if (settings.seal.sign && settings.filenames[2].empty()) {
         fail(ERROR_ARGS, "missing key file for signing");
     }
@@ -5712,45 +6767,10 @@ bool seal_command::execute(device_map &devices) {
 
     if (settings.seal.sign) read_keys(settings.filenames[2], &public_key, &private_key);
 
-    if (isElf) {
-        elf_file source_file(settings.verbose);
-        elf_file *elf = &source_file;
-        elf->read_file(get_file(ios::in|ios::binary));
-        // Remove any holes in the ELF file, as these cause issues when signing/hashing
-        elf->remove_sh_holes();
-        sign_guts_elf(elf, private_key, public_key);
-
-        auto out = get_file_idx(ios::out|ios::binary, 1);
-        elf->write(out);
-        out->close();
-    } else if (isBin) {
-        auto access = get_file_memory_access(0);
-        auto rmap = access.get_rmap();
-        auto ranges = rmap.ranges();
-        assert(ranges.size() == 1);
-        auto bin_start = ranges[0].from;
-        auto bin_size = ranges[0].len();
-
-        auto sig_data = sign_guts_bin(access, private_key, public_key, bin_start, bin_size);
-        auto out = get_file_idx(ios::out|ios::binary, 1);
-        out->write((const char *)sig_data.data(), sig_data.size());
-        out->close();
-    } else if (isUf2) {
-        auto access = get_file_memory_access(0);
-        auto rmap = access.get_rmap();
-        auto ranges = rmap.ranges();
-        auto bin_start = ranges.front().from;
-        auto bin_size = ranges.back().to - bin_start;
-        auto family_id = get_family_id(0);
-
-        auto sig_data = sign_guts_bin(access, private_key, public_key, bin_start, bin_size);
-        auto tmp = std::make_shared<std::stringstream>();
-        tmp->write(reinterpret_cast<const char*>(sig_data.data()), sig_data.size());
-        auto out = get_file_idx(ios::out|ios::binary, 1);
-        bin2uf2(tmp, out, bin_start, family_id, access.get_model(), settings.uf2.abs_block_loc);
-        out->close();
+    if (settings.seal.batch.empty()) {
+        seal_file(private_key, public_key);
     } else {
-        fail(ERROR_ARGS, "Must be ELF or BIN");
+        seal_batch(private_key, public_key);
     }
 
     if (settings.seal.sign) {
@@ -5789,14 +6809,6 @@ bool seal_command::execute(device_map &devices) {
         }
     }
 
-    if (!settings.quiet) {
-        auto access = get_file_memory_access(1);
-        set_model_from_metadata(access);
-        fos << "Output File " << settings.filenames[1] << ":\n\n";
-        settings.info.show_basic = true;
-        info_guts(access, nullptr);
-    }
-
     return false;
 }
 #endif
@@ -5921,6 +6933,9 @@ bool verify_command::execute(device_map &devices) {
     if (settings.offset_set && get_file_type() != filetype::bin && model->chip() == rp2040) {
         fail(ERROR_ARGS, "Offset only valid for BIN files");
     }
+    // with --sparse, holes in flash (e.g. pages left out of a sparse UF2) are compared as erased
+    file_access.set_model(model);
+    file_access.set_erased_holes(settings.verify.sparse);
     auto ranges = get_coalesced_ranges(file_access, model);
     if (settings.range_set) {
         range filter(settings.from, settings.to);
@@ -5930,7 +6945,7 @@ bool verify_command::execute(device_map &devices) {
     }
     ranges.erase(std::remove_if(ranges.begin(), ranges.end(), std::mem_fn(&range::empty)), ranges.end());
     if (ranges.empty()) {
-        std::cout << "No ranges to verify.\n";
+        tcout << "No ranges to verify.\n";
     } else {
         for (auto mem_range : ranges) {
             enum memory_type t1 = get_memory_type(mem_range.from, model);
@@ -5944,12 +6959,18 @@ bool verify_command::execute(device_map &devices) {
                     progress_bar bar("Verifying " + memory_names[t1] + ": ");
                     vector<uint8_t> file_buf;
                     vector<uint8_t> device_buf;
-                    uint32_t batch_size = calculate_chunk_size(mem_range.len());
-                    for(uint32_t base = mem_range.from; base < mem_range.to && ok; base += batch_size) {
-                        uint32_t this_batch = std::min(mem_range.to - base, batch_size);
-                        // note we pass zero_fill = true in case the file has holes, but this does
-                        // mean that the verification will fail if those holes are not filled with zeros
-                        // on the device
+                    transfer_scheduler scheduler;
+                    // flash on RP2040 is checked against digests computed on the device, otherwise it is read back
+                    uint32_t read_back_end = mem_range.to;
+                    if (verify_flash_with_digests(con, raw_access, file_access, mem_range, bar, ok, pos)) {
+                        read_back_end = mem_range.from;
+                    }
+                    for(uint32_t base = mem_range.from; base < read_back_end && ok; ) {
+                        uint32_t this_batch = scheduler.next_batch(base, mem_range.to);
+                        auto batch_start = std::chrono::steady_clock::now();
+                        // note we pass zero_fill = true in case the file has holes; with --sparse, holes in
+                        // flash read as erased (0xff), but otherwise verification will fail if those holes
+                        // are not filled with zeros on the device
                         file_access.read_into_vector(base, this_batch, file_buf, true);
                         raw_access.read_into_vector(base, this_batch, device_buf);
                         assert(file_buf.size() == device_buf.size());
@@ -5963,13 +6984,15 @@ bool verify_command::execute(device_map &devices) {
                         if (ok) {
                             pos = base + this_batch;
                         }
+                        scheduler.completed(this_batch, std::chrono::steady_clock::now() - batch_start);
+                        base += this_batch;
                         bar.progress(pos - mem_range.from, mem_range.to - mem_range.from);
                     }
                 }
                 if (ok) {
-                    std::cout << "  OK\n";
+                    tcout << "  OK\n";
                 } else {
-                    std::cout << "  First mismatch at " << hex_string(pos) << "\n";
+                    tcout << "  First mismatch at " << hex_string(pos) << "\n";
                     uint32_t display_from = (pos - 15) & ~15;
                     uint32_t display_to = display_from + 48;
                     range valid(display_from, display_to);
@@ -6176,10 +7199,7 @@ bool get_mask(const std::string& sel, uint32_t &mask, int max_bit) {
 void init_matches(const otp_reg *reg, uint32_t reg_row, const std::string& field_sel, int max_bit,
                   std::function<void(otp_match)> func, bool fuzzy = true) {
     if (!reg) {
-        auto f = otp_regs.find(reg_row);
-        if (f != otp_regs.end()) {
-            reg = &f->second;
-        }
+        reg = otp_regs.find(reg_row);
     }
     std::vector<otp_match> matches;
     otp_match m;
@@ -6202,7 +7222,7 @@ void init_matches(const otp_reg *reg, uint32_t reg_row, const std::string& field
                 // field name
                 auto upper_field = uppercase(field_sel);
                 for(const auto &f : reg->fields) {
-                    if (f.upper_name.find(upper_field) != string::npos && fuzzy) {
+                    if (f.upper_name.contains(upper_field) && fuzzy) {
                         m.field = &f;
                         m.mask = f.mask;
                         func(m);
@@ -6276,11 +7296,18 @@ std::map<std::pair<uint32_t,uint32_t>, otp_match> filter_otp(std::vector<string>
                 }
             } else {
                 auto upper = uppercase(reg_sel);
-                for(const auto &e : otp_regs) {
-                    if (e.second.upper_name.find(upper, 0) != string::npos && fuzzy) {
-                        init_matches(&e.second, e.second.row, field_sel, max_bit, match_adder);
-                    } else if (e.second.upper_name == upper || e.second.upper_name == "OTP_DATA_" + upper) {
-                        init_matches(&e.second, e.second.row, field_sel, max_bit, match_adder, false);
+                if (fuzzy) {
+                    for(const auto reg : otp_regs) {
+                        if (reg->upper_name.contains(upper)) {
+                            init_matches(reg, reg->row, field_sel, max_bit, match_adder);
+                        }
+                    }
+                } else {
+                    for(const auto reg : otp_regs.find_name(upper)) {
+                        init_matches(reg, reg->row, field_sel, max_bit, match_adder, false);
+                    }
+                    for(const auto reg : otp_regs.find_name("OTP_DATA_" + upper)) {
+                        init_matches(reg, reg->row, field_sel, max_bit, match_adder, false);
                     }
                 }
             }
@@ -6466,7 +7493,7 @@ bool partition_create_command::execute(device_map &devices) {
     elf_file *elf = &source_file;
     std::shared_ptr<block> pt_block;
     if (!settings.filenames[2].empty()) {
-        elf->read_file(get_file_idx(ios::in|ios::binary, 2));
+        read_elf_file_idx(elf, 2);
         std::unique_ptr<block> first_block = find_first_block(elf);
         if (!first_block) {
             fail(ERROR_FORMAT, "No first block found");
@@ -7459,15 +8486,214 @@ static void check_otp_write_error(picoboot::command_failure &e, bool ecc) {
     }
 }
 
-bool settings_select_ecc(void) {
-    return settings.otp.ecc && !settings.otp.raw;
-}
-
-uint8_t otp_cmd_max_bits(void) {
-    return settings_select_ecc() ? 16 : 24;
-}
-
-typedef std::function<void(uint8_t *buffer, uint32_t len, picoboot_otp_cmd &otp_cmd)> otp_read_func_t;
+// Cached access to the OTP rows of a device. The page locks are learnt once from the PAGEn_LOCK rows, so
+// whole runs of readable pages can be read with a single command each, and pages which the bootloader won't
+// let us read are never asked for. The raw and ECC values of each row are cached separately, as the device
+// does the ECC correction
+struct otp_memory_access {
+    explicit otp_memory_access(picoboot::connection &con) : con(con) {
+        std::fill(raw_state.begin(), raw_state.end(), row_unknown);
+        std::fill(ecc_state.begin(), ecc_state.end(), row_unknown);
+    }
+
+    // Make sure the wanted rows are in the cache, reading any that aren't in as few commands as possible
+    void prefetch(const std::vector<bool> &want, bool ecc) {
+        learn_permissions();
+        auto &state = ecc ? ecc_state : raw_state;
+        uint32_t run_start = 0, run_count = 0;
+        auto flush_run = [&]() {
+            if (run_count) fetch(run_start, run_count, ecc);
+            run_count = 0;
+        };
+        auto add_to_run = [&](uint32_t from, uint32_t count) {
+            if (run_count && (run_start + run_count != from || run_count + count > max_rows_per_read)) {
+                flush_run();
+            }
+            if (!run_count) run_start = from;
+            run_count += count;
+        };
+        for (uint32_t page = 0; page < OTP_PAGE_COUNT; page++) {
+            uint32_t page_start = page * OTP_PAGE_ROWS;
+            if (page >= OTP_PAGE_COUNT - OTP_SPECIAL_PAGES) {
+                // permissions within the special pages are per row, so only read the rows asked for
+                for (uint32_t r = page_start; r < page_start + OTP_PAGE_ROWS; r++) {
+                    if (want[r] && state[r] == row_unknown) {
+                        add_to_run(r, 1);
+                    } else {
+                        flush_run();
+                    }
+                }
+                continue;
+            }
+            bool wanted = false;
+            for (uint32_t r = page_start; r < page_start + OTP_PAGE_ROWS; r++) wanted |= want[r] && state[r] == row_unknown;
+            if (!wanted) {
+                flush_run();
+            } else if (!page_readable(page)) {
+                flush_run();
+                for (uint32_t r = page_start; r < page_start + OTP_PAGE_ROWS; r++) {
+                    if (state[r] == row_unknown) state[r] = row_unreadable;
+                }
+            } else {
+                add_to_run(page_start, OTP_PAGE_ROWS);
+            }
+        }
+        flush_run();
+    }
+
+    void prefetch(uint32_t row, uint32_t count, bool ecc) {
+        assert(row + count <= OTP_ROW_COUNT);
+        std::vector<bool> want(OTP_ROW_COUNT);
+        std::fill(want.begin() + row, want.begin() + row + count, true);
+        prefetch(want, ecc);
+    }
+
+    bool readable(uint32_t row, bool ecc) {
+        auto &state = ecc ? ecc_state : raw_state;
+        if (state[row] == row_unknown) prefetch(row, 1, ecc);
+        return state[row] == row_cached;
+    }
+
+    // Read rows (4 bytes per row raw, or 2 bytes per row with ECC), failing like the device would if any can't be read
+    void read(uint32_t row, uint32_t count, bool ecc, uint8_t *buffer) {
+        prefetch(row, count, ecc);
+        for (uint32_t r = row; r < row + count; r++) {
+            if (!readable(r, ecc)) throw picoboot::command_failure(PICOBOOT_NOT_PERMITTED);
+            if (ecc) {
+                memcpy(buffer + (r - row) * 2, &ecc_values[r], 2);
+            } else {
+                memcpy(buffer + (r - row) * 4, &raw_values[r], 4);
+            }
+        }
+    }
+
+    uint32_t read_raw(uint32_t row) {
+        uint32_t value;
+        read(row, 1, false, (uint8_t *)&value);
+        return value;
+    }
+
+    // Whether the page locks allow the bootloader to write to the row (rows in the special pages have their own
+    // rules, so are left to the device)
+    bool writable(uint32_t row) {
+        uint32_t page = row / OTP_PAGE_ROWS;
+        learn_permissions();
+        if (!have_permissions || page >= OTP_PAGE_COUNT - OTP_SPECIAL_PAGES) return true;
+        return !(lock1[page] & OTP_DATA_PAGE0_LOCK1_LOCK_BL_BITS) &&
+               !(lock1[page] & OTP_DATA_PAGE0_LOCK1_LOCK_S_BITS) &&
+               !(lock0[page] & OTP_DATA_PAGE0_LOCK0_KEY_W_BITS);
+    }
+
+    void write(picoboot_otp_cmd *otp_cmd, uint8_t *buffer, uint32_t len) {
+        for (uint32_t r = otp_cmd->wRow; r < std::min((uint32_t)OTP_ROW_COUNT, (uint32_t)otp_cmd->wRow + otp_cmd->wRowCount); r++) {
+            raw_state[r] = row_unknown;
+            ecc_state[r] = row_unknown;
+            if (r >= OTP_DATA_PAGE0_LOCK0_ROW) have_permissions = tried_permissions = false;
+        }
+        con.otp_write(otp_cmd, buffer, len);
+    }
+
+private:
+    enum row_state : uint8_t {
+        row_unknown,
+        row_cached,
+        row_unreadable
+    };
+    static const uint32_t max_rows_per_read = 16 * OTP_PAGE_ROWS;
+
+    // the lock rows are always readable, so read them all in one go
+    void learn_permissions() {
+        if (tried_permissions) return;
+        tried_permissions = true;
+        const uint32_t lock_rows = OTP_PAGE_COUNT * 2;
+        fetch(OTP_DATA_PAGE0_LOCK0_ROW, lock_rows, false);
+        for (uint32_t page = 0; page < OTP_PAGE_COUNT; page++) {
+            uint32_t row = OTP_DATA_PAGE0_LOCK0_ROW + page * 2;
+            if (raw_state[row] != row_cached || raw_state[row + 1] != row_cached) return;
+            lock0[page] = majority_vote(raw_values[row]);
+            lock1[page] = majority_vote(raw_values[row + 1]);
+        }
+        have_permissions = true;
+    }
+
+    // locks are stored three times over, in bits 7:0, 15:8 and 23:16
+    static uint8_t majority_vote(uint32_t raw) {
+        uint8_t a = raw, b = raw >> 8, c = raw >> 16;
+        return (a & b) | (a & c) | (b & c);
+    }
+
+    bool page_readable(uint32_t page) const {
+        if (!have_permissions || page >= OTP_PAGE_COUNT - OTP_SPECIAL_PAGES) return true;
+        uint32_t lock_bl = (lock1[page] & OTP_DATA_PAGE0_LOCK1_LOCK_BL_BITS) >> OTP_DATA_PAGE0_LOCK1_LOCK_BL_LSB;
+        uint32_t lock_s = (lock1[page] & OTP_DATA_PAGE0_LOCK1_LOCK_S_BITS) >> OTP_DATA_PAGE0_LOCK1_LOCK_S_LSB;
+        // 2 is reserved, and behaves as inaccessible
+        if (lock_bl >= 2 || lock_s >= 2) return false;
+        // the bootloader can't enter keys
+        if ((lock0[page] & OTP_DATA_PAGE0_LOCK0_KEY_R_BITS) && (lock0[page] & OTP_DATA_PAGE0_LOCK0_NO_KEY_STATE_BITS)) return false;
+        return true;
+    }
+
+    // Read rows with one command; if that isn't permitted, split the rows up until the ones which can't be
+    // read are found (normal pages are all or nothing, but rows in the special pages are permitted individually)
+    void fetch(uint32_t row, uint32_t count, bool ecc) {
+        uint32_t row_size = ecc ? 2 : 4;
+        std::vector<uint8_t> buffer(count * row_size);
+        struct picoboot_otp_cmd otp_cmd;
+        otp_cmd.wRow = row;
+        otp_cmd.wRowCount = count;
+        otp_cmd.bEcc = ecc;
+        try {
+            con.otp_read(&otp_cmd, buffer.data(), buffer.size());
+        } catch (picoboot::command_failure& e) {
+            if (e.get_code() != PICOBOOT_NOT_PERMITTED) throw;
+            uint32_t first_page = row / OTP_PAGE_ROWS;
+            uint32_t last_page = (row + count - 1) / OTP_PAGE_ROWS;
+            uint32_t split = 0;
+            if (first_page != last_page) {
+                split = ((first_page + last_page + 1) / 2) * OTP_PAGE_ROWS;
+            } else if (first_page >= OTP_PAGE_COUNT - OTP_SPECIAL_PAGES && count > 1) {
+                split = row + count / 2;
+            }
+            if (split) {
+                fetch(row, split - row, ecc);
+                fetch(split, row + count - split, ecc);
+            } else {
+                auto &state = ecc ? ecc_state : raw_state;
+                std::fill(state.begin() + row, state.begin() + row + count, row_unreadable);
+            }
+            return;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            if (ecc) {
+                memcpy(&ecc_values[row + i], buffer.data() + i * 2, 2);
+                ecc_state[row + i] = row_cached;
+            } else {
+                memcpy(&raw_values[row + i], buffer.data() + i * 4, 4);
+                raw_state[row + i] = row_cached;
+            }
+        }
+    }
+
+    picoboot::connection &con;
+    bool tried_permissions = false;
+    bool have_permissions = false;
+    std::array<uint8_t, OTP_PAGE_COUNT> lock0 = {};
+    std::array<uint8_t, OTP_PAGE_COUNT> lock1 = {};
+    std::array<uint32_t, OTP_ROW_COUNT> raw_values = {};
+    std::array<uint16_t, OTP_ROW_COUNT> ecc_values = {};
+    std::array<row_state, OTP_ROW_COUNT> raw_state;
+    std::array<row_state, OTP_ROW_COUNT> ecc_state;
+};
+
+bool settings_select_ecc(void) {
+    return settings.otp.ecc && !settings.otp.raw;
+}
+
+uint8_t otp_cmd_max_bits(void) {
+    return settings_select_ecc() ? 16 : 24;
+}
+
+typedef std::function<void(uint8_t *buffer, uint32_t len, picoboot_otp_cmd &otp_cmd)> otp_read_func_t;
 typedef std::function<void(uint8_t *buffer, uint32_t len, picoboot_otp_cmd &otp_cmd)> otp_write_func_t;
 void process_otp_json(json &otp_json, model_t model, otp_read_func_t read_func, otp_write_func_t write_func) {
     int raw_max_bits = 24;
@@ -7640,33 +8866,24 @@ bool otp_get_command::execute(device_map &devices) {
     uint32_t last_reg_row = 1; // invalid
     bool first = true;
     char buf[512];
-    uint32_t raw_buffer[OTP_PAGE_ROWS];
-    memset(raw_buffer, 0xaa, sizeof(raw_buffer));
     int indent0 = settings.otp.list_pages ? 18 : 8;
-    uint32_t last_page = -1;
+    // Read all the matched rows (and their redundant copies) up front
+    otp_memory_access otp(con);
+    std::vector<bool> wanted_rows(OTP_ROW_COUNT);
+    for (const auto& e : matches) {
+        const auto &m = e.second;
+        int redundancy = settings.otp.redundancy;
+        if (redundancy < 0) redundancy = m.reg ? m.reg->redundancy : 1;
+        for (uint32_t r = m.reg_row; r < std::min((uint32_t)OTP_ROW_COUNT, m.reg_row + std::max(redundancy, 1)); r++) {
+            wanted_rows[r] = true;
+        }
+    }
+    otp.prefetch(wanted_rows, false);
     for (const auto& e : matches) {
         const auto &m = e.second;
         bool do_ecc = settings.otp.ecc;
         int redundancy = settings.otp.redundancy;
         uint32_t corrected_val = 0;
-        if (m.reg_row / OTP_PAGE_ROWS != last_page) {
-            // todo pre-check page lock
-            struct picoboot_otp_cmd otp_cmd;
-            if (m.reg_row / OTP_PAGE_ROWS >= OTP_PAGE_COUNT - OTP_SPECIAL_PAGES) {
-                // Read individual rows for lock words
-                otp_cmd.wRow = m.reg_row;
-                otp_cmd.wRowCount = 1;
-                otp_cmd.bEcc = 0;
-                con.otp_read(&otp_cmd, (uint8_t *)&(raw_buffer[m.reg_row % OTP_PAGE_ROWS]), sizeof(raw_buffer[0]));
-            } else {
-                // Otherwise read a page at a time
-                last_page = m.reg_row / OTP_PAGE_ROWS;
-                otp_cmd.wRow = last_page * OTP_PAGE_ROWS;
-                otp_cmd.wRowCount = OTP_PAGE_ROWS;
-                otp_cmd.bEcc = 0;
-                con.otp_read(&otp_cmd, (uint8_t *)raw_buffer, sizeof(raw_buffer));
-            }
-        }
         if (m.reg_row != last_reg_row) {
             last_reg_row = m.reg_row;
             // Write out header for row
@@ -7709,12 +8926,12 @@ bool otp_get_command::execute(device_map &devices) {
             }
             fos.first_column(4);
             fos.hanging_indent(10);
-            uint32_t raw_value = raw_buffer[m.reg_row % OTP_PAGE_ROWS];
+            uint32_t raw_value = otp.read_raw(m.reg_row);
             char raw_buf[16 * 1024];
             uint8_t buf_pos = 0;
             buf_pos += snprintf(raw_buf+buf_pos, sizeof(raw_buf), "RAW_VALUE=0x%06x", raw_value);
             for (int i=1; i < std::max(redundancy, 1); i++) {
-                raw_value = raw_buffer[(m.reg_row % OTP_PAGE_ROWS) + i];
+                raw_value = otp.read_raw(m.reg_row + i);
                 buf_pos += snprintf(raw_buf+buf_pos, sizeof(raw_buf) - buf_pos, ";0x%06x", raw_value);
                 if (3 == (raw_value >> 22)) {
                     raw_value ^= 0xffffff;
@@ -7738,7 +8955,7 @@ bool otp_get_command::execute(device_map &devices) {
                 bool diff = false;
                 bool crit = m.reg ? m.reg->crit : false;
                 for (int i=0; i < redundancy; i++) {
-                    raw_value = raw_buffer[(m.reg_row % OTP_PAGE_ROWS) + i];
+                    raw_value = otp.read_raw(m.reg_row + i);
                     for (int b=0; b < 24; b++) raw_value & (1 << b) ? sets[b]++ : clears[b]++;
                 }
                 for (int b=0; b < 24; b++){
@@ -7801,13 +9018,11 @@ bool otp_get_command::execute(device_map &devices) {
 }
 
 bool otp_dump_command::execute(device_map &devices) {
-    // todo pre-check page lock
     bool do_ecc = settings.otp.ecc && !settings.otp.raw;
     vector<uint8_t> raw_buffer;
     uint8_t row_size = do_ecc ? 2 : 4;
     raw_buffer.resize(OTP_ROW_COUNT * row_size);
-    std::map<int, string> page_errors;
-    std::map<int, string> row_errors;
+    std::vector<bool> unreadable_rows(OTP_ROW_COUNT);
 
     if (!settings.filenames[0].empty()) {
         std::shared_ptr<std::fstream> file = get_file(ios::in|ios::binary);
@@ -7846,35 +9061,13 @@ bool otp_dump_command::execute(device_map &devices) {
         fos_ptr = fos_base_ptr;
     } else {
         auto con = get_single_picoboot_cmd_compatible_device_connection("otp dump", devices, {PC_OTP_READ}, false);
-        struct picoboot_otp_cmd otp_cmd;
-        otp_cmd.bEcc = do_ecc;
-        // Read most pages by page, as permissions are per page
-        otp_cmd.wRowCount = OTP_PAGE_ROWS;
-        for (int i=0; i < OTP_PAGE_COUNT - OTP_SPECIAL_PAGES; i++) {
-            otp_cmd.wRow = i * OTP_PAGE_ROWS;
-            try {
-                con.otp_read(&otp_cmd, raw_buffer.data() + i*(raw_buffer.size() / OTP_PAGE_COUNT), raw_buffer.size() / OTP_PAGE_COUNT);
-            } catch (picoboot::command_failure& e) {
-                if (e.get_code() == PICOBOOT_NOT_PERMITTED) {
-                    page_errors[i] = e.what();
-                } else {
-                    throw e;
-                }
-            }
-        }
-
-        // Read special pages by row, as permissions are special
-        otp_cmd.wRowCount = 1;
-        for (int i=(OTP_PAGE_COUNT - OTP_SPECIAL_PAGES) * OTP_PAGE_ROWS; i < OTP_PAGE_COUNT * OTP_PAGE_ROWS; i++) {
-            otp_cmd.wRow = i;
-            try {
-                con.otp_read(&otp_cmd, raw_buffer.data() + i * row_size, row_size);
-            } catch (picoboot::command_failure& e) {
-                if (e.get_code() == PICOBOOT_NOT_PERMITTED) {
-                    row_errors[i] = e.what();
-                } else {
-                    throw e;
-                }
+        otp_memory_access otp(con);
+        otp.prefetch(0, OTP_ROW_COUNT, do_ecc);
+        for (int i=0; i < OTP_ROW_COUNT; i++) {
+            if (otp.readable(i, do_ecc)) {
+                otp.read(i, 1, do_ecc, raw_buffer.data() + i * row_size);
+            } else {
+                unreadable_rows[i] = true;
             }
         }
     }
@@ -7898,7 +9091,7 @@ bool otp_dump_command::execute(device_map &devices) {
             }
 
             for (int j = i; j < i + 8; j++) {
-                if (row_errors.find(j) != row_errors.end() || page_errors.find(j / OTP_PAGE_ROWS) != page_errors.end()) {
+                if (unreadable_rows[j]) {
                     snprintf(buf, sizeof(buf), "%s, ", do_ecc ? "XXXX" : "XXXXXXXX");
                 } else if (do_ecc) {
                     snprintf(buf, sizeof(buf), "%04x, ", ((uint16_t *) raw_buffer.data())[j]);
@@ -7924,13 +9117,13 @@ bool otp_load_command::execute(device_map &devices) {
         hack_init_otp_regs();
         json otp_json = json::parse(*file);
         // todo validation on json
+        otp_memory_access otp(con);
         process_otp_json(otp_json, model,
             [&](uint8_t *buffer, uint32_t len, picoboot_otp_cmd &otp_cmd) {
-                picoboot_memory_access raw_access(con);
-                con.otp_read(&otp_cmd, buffer, len);
+                otp.read(otp_cmd.wRow, otp_cmd.wRowCount, otp_cmd.bEcc, buffer);
             }, [&](uint8_t *buffer, uint32_t len, picoboot_otp_cmd &otp_cmd) {
                 try {
-                    con.otp_write(&otp_cmd, buffer, len);
+                    otp.write(&otp_cmd, buffer, len);
                 } catch (picoboot::command_failure &e) {
                     check_otp_write_error(e, otp_cmd.bEcc);
                     throw e;
@@ -7971,12 +9164,12 @@ bool otp_load_command::execute(device_map &devices) {
     unsigned int i;
     for(i=0;i<file_size;i++) {
         if (file_buffer[i] != verify_buffer[i]) {
-            std::cout << "  Mismatch at row " << hex_string(i/row_size) << "\n";
+            tcout << "  Mismatch at row " << hex_string(i/row_size) << "\n";
             break;
         }
     }
     if (i == file_size) {
-        std::cout << "  Verified OK\n";
+        tcout << "  Verified OK\n";
     }
     return false;
 }
@@ -8089,14 +9282,16 @@ bool otp_set_command::execute(device_map &devices) {
     uint32_t reg_row = *unique_rows.begin();
     char buf[512];
     int indent0 = settings.otp.list_pages ? 18 : 8;
-    // todo check page permissions
     // todo write only
+    otp_memory_access otp(con);
+    if (!otp.writable(reg_row)) {
+        fail(ERROR_NOT_POSSIBLE, "OTP page %d is locked against writes by the bootloader", reg_row / OTP_PAGE_ROWS);
+    }
     struct picoboot_otp_cmd otp_cmd;
     otp_cmd.wRow = reg_row;
     otp_cmd.wRowCount = 1;
     otp_cmd.bEcc = 0;
-    uint32_t old_raw_value;
-    con.otp_read(&otp_cmd, (uint8_t *)&old_raw_value, sizeof(old_raw_value));
+    uint32_t old_raw_value = otp.read_raw(reg_row);
     fos.first_column(0);
     fos.hanging_indent(7);
     snprintf(buf, sizeof(buf), "ROW 0x%04x", reg_row);
@@ -8525,9 +9720,9 @@ bool reboot_command::execute(device_map &devices) {
         reboot_device(std::get<1>(devices[dr_vidpid_stdio_usb][0]), std::get<2>(devices[dr_vidpid_stdio_usb][0]), settings.reboot_usb);
         if (!quiet) {
             if (settings.reboot_usb) {
-                std::cout << "The device was asked to reboot into BOOTSEL mode.\n";
+                tcout << "The device was asked to reboot into BOOTSEL mode.\n";
             } else {
-                std::cout << "The device was asked to reboot into application mode.\n";
+                tcout << "The device was asked to reboot into application mode.\n";
             }
         }
     } else {
@@ -8583,9 +9778,9 @@ bool reboot_command::execute(device_map &devices) {
         }
         if (!quiet) {
             if (settings.reboot_usb) {
-                std::cout << "The device was rebooted into BOOTSEL mode.\n";
+                tcout << "The device was rebooted into BOOTSEL mode.\n";
             } else {
-                std::cout << "The device was rebooted into application mode.\n";
+                tcout << "The device was rebooted into application mode.\n";
             }
         }
     }
@@ -8617,6 +9812,63 @@ static void sleep_ms(int ms) {
 #endif
 }
 
+#if HAS_LIBUSB
+// Waits for a device to re-attach after being rebooted. Where libusb supports hotplug, the wait ends as soon as
+// a device with a matching vid/pid arrives; otherwise (or if the arrival isn't the device we're after, or it
+// isn't ready to be opened yet) the caller re-enumerates after a poll interval, which starts short and grows
+struct device_arrival_watch {
+    explicit device_arrival_watch(libusb_context *ctx) : ctx(ctx) {
+        if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) return;
+        int vid = settings.vid != -1 ? settings.vid : LIBUSB_HOTPLUG_MATCH_ANY;
+        int pid = settings.pid != -1 ? settings.pid : LIBUSB_HOTPLUG_MATCH_ANY;
+        if (libusb_hotplug_register_callback(ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_NO_FLAGS,
+                                             vid, pid, LIBUSB_HOTPLUG_MATCH_ANY, arrived, this, &handle) == LIBUSB_SUCCESS) {
+            registered = true;
+        }
+    }
+
+    ~device_arrival_watch() {
+        if (registered) libusb_hotplug_deregister_callback(ctx, handle);
+    }
+
+    // wait until something arrives, or until the current poll interval is up
+    void wait() {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(poll_ms);
+        if (registered) {
+            while (!arrivals && std::chrono::steady_clock::now() < deadline) {
+                auto left = std::chrono::duration_cast<std::chrono::microseconds>(deadline - std::chrono::steady_clock::now());
+                struct timeval tv;
+                tv.tv_sec = (long)(left.count() / 1000000);
+                tv.tv_usec = (long)(left.count() % 1000000);
+                libusb_handle_events_timeout_completed(ctx, &tv, &arrivals);
+            }
+        } else {
+            sleep_ms(poll_ms);
+        }
+        if (!arrivals) poll_ms = std::min(poll_ms * 2, max_poll_ms);
+        arrivals = 0;
+    }
+
+private:
+    static int LIBUSB_CALL arrived(libusb_context *, libusb_device *dev, libusb_hotplug_event, void *user_data) {
+        auto watch = (device_arrival_watch *)user_data;
+        struct libusb_device_descriptor desc;
+        // with no vid/pid filter, only count devices which could be in BOOTSEL mode
+        if (settings.vid != -1 || (!libusb_get_device_descriptor(dev, &desc) && desc.idVendor == VENDOR_ID_RASPBERRY_PI)) {
+            watch->arrivals++;
+        }
+        return 0;
+    }
+
+    static const int max_poll_ms = 800;
+    libusb_context *ctx;
+    libusb_hotplug_callback_handle handle;
+    bool registered = false;
+    int arrivals = 0;
+    int poll_ms = 100;
+};
+#endif
+
 void get_terminal_size(int& width, int& height) {
 #if defined(DOCS_WIDTH)
     width = DOCS_WIDTH;
@@ -8644,25 +9896,504 @@ void cancelled(int) {
     throw cancelled_exception();
 }
 
-int main(int argc, char **argv) {
-    int tw=0, th=0;
-    get_terminal_size(tw, th);
-    if (tw) {
-        fos.last_column(std::max(tw, 40));
+// set on SIGINT/SIGTERM while several devices are being worked on; each device's thread polls it, as throwing
+// from the handler would unwind whichever thread it interrupted
+static std::atomic<bool> cancel_requested(false);
+static void request_cancel(int) {
+    cancel_requested = true;
+}
+
+#if HAS_LIBUSB
+// one device's share of a command being run on several devices at once
+struct device_job {
+    chip_t chip;
+    libusb_device *device;
+    libusb_device_handle *handle;
+    string name;
+    string serial;
+    std::stringstream log;
+    int percent = 0;
+    bool done = false;
+    int rc = 0;
+    string error;
+    double seconds = 0;
+};
+
+static string device_serial(chip_t chip, libusb_device *device, libusb_device_handle *handle) {
+    if (chip == rp2040) {
+        // the RP2040 USB serial number is not unique, so use the flash ID as picoboot_open_device does
+        uint64_t id = 0;
+        if (picoboot_flash_id(handle, &id)) return "";
+        std::stringstream ss;
+        ss << std::hex << std::uppercase << std::setfill('0') << std::setw(16) << id;
+        return ss.str();
     }
+    struct libusb_device_descriptor desc;
+    char ser_str[128];
+    if (libusb_get_device_descriptor(device, &desc) ||
+        libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, (unsigned char*)ser_str, sizeof(ser_str)) < 0) {
+        return "";
+    }
+    return ser_str;
+}
 
-    int rc = parse(argc, argv);
-    if (rc) return rc;
-    if (!selected_cmd) {
-        return 0;
+static bool serial_matches(const device_job &job, const string &ser) {
+    if (job.serial.empty()) return false;
+    if (job.chip == rp2040) {
+        return strtoull(ser.c_str(), nullptr, 16) == strtoull(job.serial.c_str(), nullptr, 16);
     }
+    return ser == job.serial;
+}
 
-    if (settings.quiet) {
-        fos_ptr = fos_null_ptr;
+// Run the selected command on every BOOTSEL device (or just those named by --serial-list), each on its own
+// thread with its own connection. Progress is shown for the devices as a whole, followed by each device's
+// status and output, and finally a JSON summary. Returns the first failing device's error code.
+static int run_on_all_devices(device_map &devices) {
+    vector<std::unique_ptr<device_job>> jobs;
+    for (const auto &d : devices[dr_vidpid_bootrom_ok]) {
+        std::unique_ptr<device_job> job(new device_job());
+        job->chip = std::get<0>(d);
+        job->device = std::get<1>(d);
+        job->handle = std::get<2>(d);
+        job->name = bus_device_string(job->device, job->chip);
+        job->serial = device_serial(job->chip, job->device, job->handle);
+        jobs.push_back(std::move(job));
+    }
+    vector<string> missing;
+    if (!settings.serial_list.empty()) {
+        vector<std::unique_ptr<device_job>> selected;
+        std::stringstream list(settings.serial_list);
+        string ser;
+        while (std::getline(list, ser, ',')) {
+            if (ser.empty()) continue;
+            auto it = std::find_if(jobs.begin(), jobs.end(), [&](const std::unique_ptr<device_job> &job) {
+                return job && serial_matches(*job, ser);
+            });
+            if (it == jobs.end()) {
+                missing.push_back(ser);
+            } else {
+                selected.push_back(std::move(*it));
+            }
+        }
+        jobs = std::move(selected);
+    }
+
+    std::mutex mutex;
+    unsigned int complete = 0;
+    size_t status_len = 0;
+    // call with mutex held
+    auto print_status = [&]() {
+        int total = 0;
+        for (const auto &job : jobs) total += job->done ? 100 : job->percent;
+        int percent = jobs.empty() ? 100 : total / (int)jobs.size();
+        const int width = 30;
+        int len = (width * percent) / 100;
+        std::stringstream ss;
+        ss << "Devices complete " << complete << "/" << jobs.size() << ": [" << string(len, '=') << string(width - len, ' ') << "]  " << percent << "%";
+        status_len = ss.str().length();
+        std::cout << ss.str() << "\r" << std::flush;
+    };
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        print_status();
+    }
+
+    const _settings shared_settings = settings;
+    auto start = std::chrono::steady_clock::now();
+    cancel_requested = false;
+    signal(SIGINT, request_cancel);
+    signal(SIGTERM, request_cancel);
+    vector<std::thread> threads;
+    auto join_all = [&]() {
+        for (auto &t : threads) {
+            if (t.joinable()) t.join();
+        }
+    };
+    try {
+        for (const auto &job_ptr : jobs) {
+            device_job *job = job_ptr.get();
+            threads.emplace_back([&, job]() {
+                settings = shared_settings;
+                selected_chip = job->chip;
+                fos_ptr = std::make_shared<clipp::formatting_ostream<std::ostream>>(job->log);
+                tcout_ptr = &job->log;
+                progress_sink = [&, job](int percent) {
+                    if (cancel_requested) throw cancelled_exception();
+                    std::lock_guard<std::mutex> lock(mutex);
+                    job->percent = percent;
+                    print_status();
+                };
+                device_map job_devices;
+                job_devices[dr_vidpid_bootrom_ok].emplace_back(std::make_tuple(job->chip, job->device, job->handle));
+                try {
+                    if (cancel_requested) throw cancelled_exception();
+                    selected_cmd->execute(job_devices);
+                } catch (failure_error &e) {
+                    job->rc = e.code();
+                    job->error = e.what();
+                } catch (picoboot::command_failure& e) {
+                    job->rc = ERROR_UNKNOWN;
+                    job->error = "The " + chip_name(job->chip) + " device returned an error: " + e.what();
+                } catch (picoboot::connection_error&) {
+                    job->rc = ERROR_CONNECTION;
+                    job->error = "Communication with " + chip_name(job->chip) + " device failed";
+                } catch (cancelled_exception&) {
+                    job->rc = ERROR_CANCELLED;
+                    job->error = "Cancelled";
+                } catch (std::exception &e) {
+                    job->rc = ERROR_UNKNOWN;
+                    job->error = e.what();
+                }
+                progress_sink = nullptr;
+                std::lock_guard<std::mutex> lock(mutex);
+                job->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                job->done = true;
+                complete++;
+                std::cout << string(status_len, ' ') << "\r" << job->name << ": " << (job->rc ? "ERROR: " + job->error : "OK") << "\n";
+                print_status();
+            });
+        }
+    } catch (...) {
+        // a thread couldn't be started; the others must be stopped and joined before unwinding
+        cancel_requested = true;
+        join_all();
+        signal(SIGINT, cancelled);
+        signal(SIGTERM, cancelled);
+        throw;
+    }
+    join_all();
+    signal(SIGINT, cancelled);
+    signal(SIGTERM, cancelled);
+    std::cout << "\n";
+
+    int rc = 0;
+    for (const auto &ser : missing) {
+        std::cout << "ERROR: No RP-series device in BOOTSEL mode was found with serial number " << ser << "\n";
+        if (!rc) rc = ERROR_NO_DEVICE;
     }
+    for (const auto &job : jobs) {
+        if (!rc) rc = job->rc;
+        string log = job->log.str();
+        if (!settings.quiet && !log.empty()) {
+            fos.first_column(0); fos.hanging_indent(0);
+            fos << "\n" << job->name << ":\n" << string(job->name.length() + 1, '-') << "\n" << log;
+        }
+    }
+    fos.flush();
+
+    json summary;
+    summary["command"] = selected_cmd->name();
+    summary["devices"] = json::array();
+    unsigned int failed = 0;
+    for (const auto &job : jobs) {
+        json j;
+        j["device"] = job->name;
+        j["bus"] = libusb_get_bus_number(job->device);
+        j["address"] = libusb_get_device_address(job->device);
+        j["serial"] = job->serial;
+        j["status"] = job->rc ? "error" : "ok";
+        j["exit_code"] = job->rc;
+        if (job->rc) {
+            j["error"] = job->error;
+            failed++;
+        }
+        j["seconds"] = job->seconds;
+        summary["devices"].push_back(j);
+    }
+    for (const auto &ser : missing) {
+        json j;
+        j["serial"] = ser;
+        j["status"] = "not found";
+        j["exit_code"] = ERROR_NO_DEVICE;
+        summary["devices"].push_back(j);
+    }
+    summary["ok"] = jobs.size() - failed;
+    summary["failed"] = failed + missing.size();
+    std::cout << "\n" << std::setw(4) << summary << std::endl;
+    return rc;
+}
+#endif
 
 #if HAS_LIBUSB
-    libusb_context *ctx = nullptr;
+static const char *picoboot_cmd_name(uint8_t id) {
+    switch (id) {
+        case PC_EXCLUSIVE_ACCESS: return "EXCLUSIVE_ACCESS";
+        case PC_REBOOT: return "REBOOT";
+        case PC_FLASH_ERASE: return "FLASH_ERASE";
+        case PC_READ: return "READ";
+        case PC_WRITE: return "WRITE";
+        case PC_EXIT_XIP: return "EXIT_XIP";
+        case PC_ENTER_CMD_XIP: return "ENTER_CMD_XIP";
+        case PC_EXEC: return "EXEC";
+        case PC_VECTORIZE_FLASH: return "VECTORIZE_FLASH";
+        case PC_REBOOT2: return "REBOOT2";
+        case PC_GET_INFO: return "GET_INFO";
+        case PC_OTP_READ: return "OTP_READ";
+        case PC_OTP_WRITE: return "OTP_WRITE";
+        default: return "UNKNOWN";
+    }
+}
+
+// Records the timing of every PICOBOOT command for --trace, which writes them to a file in Chrome trace event format
+// (for chrome://tracing or Perfetto), and prints a summary of where the time went
+struct usb_tracer {
+    typedef std::chrono::steady_clock clock;
+
+    explicit usb_tracer(string filename) : filename(std::move(filename)), epoch(clock::now()) {
+        active = this;
+        picoboot_set_trace(trace);
+    }
+
+    ~usb_tracer() {
+        picoboot_set_trace(nullptr);
+        active = nullptr;
+    }
+
+    void write_file();
+    void print_summary();
+
+private:
+    struct record {
+        libusb_device_handle *device;
+        uint8_t cmd_id;
+        uint32_t token;
+        uint32_t transfer_length;
+        unsigned int timeout;
+        clock::time_point start;
+        // the command, data and ack phases; the data phase is skipped for commands with no data
+        std::array<clock::time_point, 3> phase_end;
+        std::array<bool, 3> phase_done;
+        clock::time_point end;
+        int status;
+
+        int64_t phase_us(int phase) const {
+            if (!phase_done[phase]) return 0;
+            auto from = start;
+            for (int i = phase - 1; i >= 0; i--) {
+                if (phase_done[i]) {
+                    from = phase_end[i];
+                    break;
+                }
+            }
+            return std::chrono::duration_cast<std::chrono::microseconds>(phase_end[phase] - from).count();
+        }
+
+        int64_t duration_us() const {
+            return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+        }
+    };
+
+    static void trace(libusb_device_handle *usb_device, const struct picoboot_cmd *cmd, unsigned int timeout,
+                      enum picoboot_trace_point point, int status);
+
+    int64_t since_epoch_us(clock::time_point t) const {
+        return std::chrono::duration_cast<std::chrono::microseconds>(t - epoch).count();
+    }
+
+    static usb_tracer *active;
+    std::mutex mutex;
+    std::map<std::pair<libusb_device_handle *, uint32_t>, record> in_flight;
+    vector<record> records;
+    string filename;
+    clock::time_point epoch;
+};
+
+usb_tracer *usb_tracer::active;
+
+void usb_tracer::trace(libusb_device_handle *usb_device, const struct picoboot_cmd *cmd, unsigned int timeout,
+                       enum picoboot_trace_point point, int status) {
+    auto now = clock::now();
+    usb_tracer *tracer = active;
+    if (!tracer) return;
+    std::lock_guard<std::mutex> lock(tracer->mutex);
+    auto key = std::make_pair(usb_device, cmd->dToken);
+    if (point == PICOBOOT_TRACE_START) {
+        record r = {};
+        r.device = usb_device;
+        r.cmd_id = cmd->bCmdId;
+        r.token = cmd->dToken;
+        r.transfer_length = cmd->dTransferLength;
+        r.timeout = timeout;
+        r.start = now;
+        tracer->in_flight[key] = r;
+        return;
+    }
+    auto it = tracer->in_flight.find(key);
+    if (it == tracer->in_flight.end()) return;
+    record &r = it->second;
+    if (point == PICOBOOT_TRACE_END) {
+        r.end = now;
+        r.status = status;
+        tracer->records.push_back(r);
+        tracer->in_flight.erase(it);
+    } else {
+        int phase = point - PICOBOOT_TRACE_CMD_PHASE;
+        r.phase_end[phase] = now;
+        r.phase_done[phase] = true;
+        if (phase == 1) r.timeout = timeout;
+    }
+}
+
+void usb_tracer::write_file() {
+    std::lock_guard<std::mutex> lock(mutex);
+    json events = json::array();
+    std::map<libusb_device_handle *, int> tids;
+    for (const auto &r : records) {
+        auto tid = tids.find(r.device);
+        if (tid == tids.end()) {
+            tid = tids.emplace(r.device, (int)tids.size() + 1).first;
+            json name;
+            name["name"] = "thread_name";
+            name["ph"] = "M";
+            name["pid"] = 1;
+            name["tid"] = tid->second;
+            if (picoboot_get_transport(r.device)) {
+                name["args"]["name"] = "simulated device";
+            } else {
+                libusb_device *dev = libusb_get_device(r.device);
+                name["args"]["name"] = "bus " + std::to_string(libusb_get_bus_number(dev)) +
+                                       " address " + std::to_string(libusb_get_device_address(dev));
+            }
+            events.push_back(name);
+        }
+        json e;
+        e["name"] = picoboot_cmd_name(r.cmd_id);
+        e["cat"] = "picoboot";
+        e["ph"] = "X";
+        e["pid"] = 1;
+        e["tid"] = tid->second;
+        e["ts"] = since_epoch_us(r.start);
+        e["dur"] = r.duration_us();
+        e["args"]["token"] = r.token;
+        e["args"]["length"] = r.transfer_length;
+        e["args"]["timeout_ms"] = r.timeout;
+        e["args"]["cmd_us"] = r.phase_us(0);
+        e["args"]["data_us"] = r.phase_us(1);
+        e["args"]["ack_us"] = r.phase_us(2);
+        e["args"]["status"] = r.status;
+        events.push_back(e);
+    }
+    json trace;
+    trace["traceEvents"] = events;
+    trace["displayTimeUnit"] = "ms";
+    FILE *out = fopen(filename.c_str(), "w");
+    if (!out) {
+        fail(ERROR_WRITE_FAILED, "Could not open trace file %s", filename.c_str());
+    }
+    string s = trace.dump();
+    bool ok = fwrite(s.data(), 1, s.size(), out) == s.size();
+    fclose(out);
+    if (!ok) {
+        fail_write_error();
+    }
+}
+
+void usb_tracer::print_summary() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (records.empty()) return;
+    auto sorted = records;
+    std::sort(sorted.begin(), sorted.end(), [](const record &a, const record &b) { return a.start < b.start; });
+
+    // the time with no command in flight (per device, as they are independent) is host side overhead
+    int64_t busy_us = 0;
+    int64_t idle_us = 0;
+    int64_t longest_idle_us = 0;
+    std::map<libusb_device_handle *, clock::time_point> busy_until;
+    for (const auto &r : sorted) {
+        auto it = busy_until.find(r.device);
+        if (it == busy_until.end()) {
+            busy_until[r.device] = r.end;
+            busy_us += r.duration_us();
+            continue;
+        }
+        if (r.start > it->second) {
+            int64_t gap = std::chrono::duration_cast<std::chrono::microseconds>(r.start - it->second).count();
+            idle_us += gap;
+            longest_idle_us = std::max(longest_idle_us, gap);
+        }
+        if (r.end > it->second) {
+            busy_us += std::chrono::duration_cast<std::chrono::microseconds>(r.end - std::max(r.start, it->second)).count();
+            it->second = r.end;
+        }
+    }
+
+    struct cmd_stats {
+        vector<int64_t> durations;
+        uint64_t bytes = 0;
+        int64_t data_us = 0;
+        int64_t ack_us = 0;
+        unsigned int errors = 0;
+    };
+    std::map<string, cmd_stats> stats;
+    for (const auto &r : sorted) {
+        auto &s = stats[picoboot_cmd_name(r.cmd_id)];
+        s.durations.push_back(r.duration_us());
+        s.bytes += r.transfer_length;
+        s.data_us += r.phase_us(1);
+        s.ack_us += r.phase_us(2);
+        if (r.status) s.errors++;
+    }
+    auto percentile = [](const vector<int64_t> &sorted_durations, unsigned int p) {
+        size_t rank = (sorted_durations.size() * p + 99) / 100;
+        return sorted_durations[rank ? rank - 1 : 0] / 1000.0;
+    };
+
+    char buf[256];
+    fos.first_column(0);
+    fos.hanging_indent(0);
+    snprintf(buf, sizeof(buf), "\nUSB trace: %u commands, busy %.1f ms, idle %.1f ms between commands (longest gap %.1f ms)\n",
+             (unsigned int)records.size(), busy_us / 1000.0, idle_us / 1000.0, longest_idle_us / 1000.0);
+    fos << buf;
+    snprintf(buf, sizeof(buf), "  %-16s %6s %10s %8s %8s %8s %9s %9s %6s\n",
+             "command", "count", "bytes", "MB/s", "p50 ms", "p99 ms", "data ms", "ack ms", "errors");
+    fos << buf;
+    for (auto &entry : stats) {
+        auto &s = entry.second;
+        std::sort(s.durations.begin(), s.durations.end());
+        int64_t total_us = std::accumulate(s.durations.begin(), s.durations.end(), (int64_t)0);
+        double mbps = total_us ? (double)s.bytes / (double)total_us : 0;
+        snprintf(buf, sizeof(buf), "  %-16s %6u %10" PRIu64 " %8.2f %8.2f %8.2f %9.1f %9.1f %6u\n",
+                 entry.first.c_str(), (unsigned int)s.durations.size(), s.bytes, mbps,
+                 percentile(s.durations, 50), percentile(s.durations, 99),
+                 s.data_us / 1000.0, s.ack_us / 1000.0, s.errors);
+        fos << buf;
+    }
+    fos << "Trace written to " << filename << "\n";
+    fos.flush();
+}
+#endif
+
+#if HAS_LIBUSB
+// Devices held open by picotool serve between commands
+struct served_devices {
+    ~served_devices() {
+        close();
+    }
+
+    void close() {
+        for (const auto &handle : handles) {
+            libusb_close(handle);
+        }
+        handles.clear();
+        if (devs) libusb_free_device_list(devs, 1);
+        devs = nullptr;
+        devices.clear();
+        served_rom_headers.clear();
+        valid = false;
+    }
+
+    struct libusb_device **devs = nullptr;
+    device_map devices;
+    vector<libusb_device_handle *> handles;
+    // cleared when devices come or go, or a command may have rebooted one, so they are found again
+    bool valid = false;
+};
+
+// Run the selected command, finding the device(s) for it, and first rebooting a device into BOOTSEL mode if forced.
+// picotool serve passes in its libusb context, and the devices it keeps open between commands
+static int run_selected_command(libusb_context *ctx, served_devices *served) {
+    int rc = 0;
+    bool own_ctx = false;
 
     // save complicating the grammar
     if (settings.force_no_reboot) settings.force = true;
@@ -8670,6 +10401,11 @@ int main(int argc, char **argv) {
     struct libusb_device **devs = nullptr;
     device_map devices;
     vector<libusb_device_handle *> to_close;
+    std::unique_ptr<device_arrival_watch> arrival_watch;
+    std::unique_ptr<usb_tracer> tracer;
+    std::unique_ptr<picoboot::simulated_device> sim;
+    auto reboot_deadline = std::chrono::steady_clock::now();
+    int next_dot_ms = 1000;
 
     try {
         signal(SIGINT, cancelled);
@@ -8679,15 +10415,56 @@ int main(int argc, char **argv) {
             fail(ERROR_ARGS, "Cannot specify both -u and -a reboot options");
         }
 
-        if (selected_cmd->get_device_support() != cmd::none) {
+        bool multiple_devices = settings.all_devices || !settings.serial_list.empty();
+        if (multiple_devices) {
+            if (!selected_cmd->supports_multiple_devices()) {
+                fail(ERROR_ARGS, "--all-devices and --serial-list are only supported by the load, verify, erase, reboot and otp load commands");
+            }
+            if (settings.force) {
+                fail(ERROR_ARGS, "--all-devices and --serial-list cannot be combined with -f or -F");
+            }
+            if (!settings.ser.empty()) {
+                fail(ERROR_ARGS, "--ser cannot be combined with --all-devices or --serial-list");
+            }
+            // each device's outcome is reported in the summary instead
+            reboot_cmd->quiet = true;
+        }
+
+        // PICOTOOL_SIMULATOR replaces the USB devices with a single simulated one (see picoboot_sim.h)
+        const char *sim_spec = getenv("PICOTOOL_SIMULATOR");
+        if (selected_cmd->get_device_support() == cmd::none) {
+            ctx = nullptr;
+        } else if (sim_spec) {
+            if (multiple_devices || settings.force) {
+                fail(ERROR_ARGS, "--all-devices, --serial-list, -f and -F cannot be used with PICOTOOL_SIMULATOR");
+            }
+            ctx = nullptr;
+            sim.reset(new picoboot::simulated_device(sim_spec));
+            devices[dr_vidpid_bootrom_ok].emplace_back(std::make_tuple(sim->chip(), nullptr, sim->handle()));
+        } else if (!ctx) {
             if (libusb_init(&ctx)) {
                 fail(ERROR_USB, "Failed to initialise libUSB\n");
             }
+            own_ctx = true;
+            picoboot_set_context(ctx);
+        }
+        if ((ctx || sim) && !settings.trace.empty()) {
+            tracer.reset(new usb_tracer(settings.trace));
+        }
+        // the served devices can only be used as they are if no device filters apply; otherwise they are closed, so
+        // they can be opened again below
+        bool use_served = served && !sim && !settings.force && settings.bus == -1 && settings.address == -1 &&
+                          settings.vid == -1 && settings.pid == -1 && settings.ser.empty();
+        if (served && (!use_served || !served->valid)) {
+            served->close();
         }
 
         // we only loop a second time if we want to reboot some devices (which may cause device
-        for (int tries = 0; !rc && tries <= MAX_REBOOT_TRIES; tries++) {
-            if (ctx) {
+        for (int tries = 0; !rc; tries++) {
+            bool last_try = tries && std::chrono::steady_clock::now() >= reboot_deadline;
+            if (ctx && use_served && served->valid) {
+                devices = served->devices;
+            } else if (ctx) {
                 if (libusb_get_device_list(ctx, &devs) < 0) {
                     fail(ERROR_USB, "Failed to enumerate USB devices\n");
                 }
@@ -8704,6 +10481,21 @@ int main(int argc, char **argv) {
                         devices[result].emplace_back(std::make_tuple(chip, *dev, handle));
                     }
                 }
+                if (use_served) {
+                    // hand the devices over to be kept open
+                    served->devs = devs;
+                    served->devices = devices;
+                    served->handles = to_close;
+                    served->valid = true;
+                    devs = nullptr;
+                    to_close.clear();
+                }
+            }
+            if (multiple_devices && !devices[dr_vidpid_bootrom_ok].empty()) {
+                rc = run_on_all_devices(devices);
+                // some devices may have rebooted
+                if (served) served->valid = false;
+                break;
             }
             auto supported = selected_cmd->get_device_support();
             switch (supported) {
@@ -8713,7 +10505,7 @@ int main(int argc, char **argv) {
                 case cmd::device_support::one:
                     if (devices[dr_vidpid_bootrom_ok].empty() &&
                         (!settings.force || devices[dr_vidpid_stdio_usb].empty())) {
-                        if (tries == 0 || tries == MAX_REBOOT_TRIES) {
+                        if (tries == 0 || last_try) {
                             if (tries) {
                                 fos << "\n\n";
                             }
@@ -8820,12 +10612,19 @@ int main(int argc, char **argv) {
                                 }
                             }
 
+                            // watch for arrivals from before the reboot, so we can't miss the device coming back
+                            arrival_watch.reset(new device_arrival_watch(ctx));
                             reboot_device(to_reboot, to_reboot_handle, true, 1);
+                            reboot_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(REBOOT_TIMEOUT_MS);
                             fos << "The device was asked to reboot into BOOTSEL mode so the command can be executed.";
-                        } else if (tries == 1) {
-                            fos << "\nWaiting for device to reboot";
                         } else {
-                            fos << "...";
+                            int waited_ms = REBOOT_TIMEOUT_MS - (int)std::chrono::duration_cast<std::chrono::milliseconds>(reboot_deadline - std::chrono::steady_clock::now()).count();
+                            if (tries == 1) {
+                                fos << "\nWaiting for device to reboot";
+                            } else if (waited_ms >= next_dot_ms) {
+                                fos << "...";
+                                next_dot_ms += 1000;
+                            }
                         }
                         fos.flush();
                         for (const auto &handle : to_close) {
@@ -8835,7 +10634,7 @@ int main(int argc, char **argv) {
                         devs = nullptr;
                         to_close.clear();
                         devices.clear();
-                        sleep_ms(1200);
+                        arrival_watch->wait();
 
                         // we now clear bus/address filters, because the device may have moved, so the only way we can find it
                         // again is to assume it has the same serial number.
@@ -8847,7 +10646,9 @@ int main(int argc, char **argv) {
                 if (tries) {
                     fos << "\n\n";
                 }
-                if (!selected_cmd->execute(devices) && tries) {
+                bool rebooted = selected_cmd->execute(devices);
+                if (served && (rebooted || tries)) served->valid = false;
+                if (!rebooted && tries) {
                     if (settings.force_no_reboot) {
                         fos << "\nThe device has been left accessible, but without the drive mounted; use 'picotool reboot' to reboot into regular BOOTSEL mode or application mode.\n";
                     } else {
@@ -8878,12 +10679,538 @@ int main(int argc, char **argv) {
         rc = ERROR_UNKNOWN;
     }
 
+    if (tracer) {
+        // the trace is written even if the command failed, as that may be what is being investigated
+        try {
+            tracer->write_file();
+            tracer->print_summary();
+        } catch (failure_error &e) {
+            std::cout << "ERROR: " << e.what() << "\n";
+            if (!rc) rc = e.code();
+        }
+        tracer.reset();
+    }
+    if (sim) {
+        // the flash and OTP are kept however the command ended, as a real device would
+        try {
+            sim->save();
+        } catch (failure_error &e) {
+            std::cout << "ERROR: " << e.what() << "\n";
+            if (!rc) rc = e.code();
+        }
+        sim.reset();
+    }
     for(const auto &handle : to_close) {
         libusb_close(handle);
     }
     if (devs) libusb_free_device_list(devs, 1);
-    if (ctx) libusb_exit(ctx);
+    arrival_watch.reset();
+    if (served && rc) served->valid = false;
+    if (own_ctx) {
+        picoboot_set_context(nullptr);
+        libusb_exit(ctx);
+    }
+    return rc;
+
+}
+
+// picotool serve protocol: the client sends a serve_request_header, with its stdin, stdout and stderr attached
+// (SCM_RIGHTS), followed by the working directory and command line arguments, each NUL terminated. The command's
+// output goes straight to the client's stdout and stderr, then the server replies with the int32_t exit code
+#define SERVE_REQUEST_MAGIC 0x31767270u // 'prv1'
+#define SERVE_MAX_REQUEST_SIZE 0x10000u
+
+struct serve_request_header {
+    uint32_t magic;
+    uint32_t len;
+};
+
+#if defined(__unix__) || defined(__APPLE__)
+static bool read_all(int fd, void *buffer, size_t len) {
+    auto p = (uint8_t *)buffer;
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool write_all(int fd, const void *buffer, size_t len) {
+    auto p = (const uint8_t *)buffer;
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// The runtime directory is private to the user, so there is no default in a shared directory such as /tmp
+static string default_serve_socket() {
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir && *runtime_dir) {
+        return string(runtime_dir) + "/picotool.sock";
+    }
+    return "";
+}
+
+// Whether the process at the other end of the socket belongs to this user, as commands are run with our access
+// to the devices and files
+static bool peer_is_same_user(int fd) {
+#if defined(__APPLE__)
+    uid_t uid;
+    gid_t gid;
+    if (getpeereid(fd, &uid, &gid)) return false;
+    return uid == getuid();
+#elif defined(SO_PEERCRED)
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) || len != sizeof(cred)) return false;
+    return cred.uid == getuid();
+#else
+    return false;
+#endif
+}
+
+static bool serve_socket_address(const string &path, sockaddr_un &addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) return false;
+    strcpy(addr.sun_path, path.c_str());
+    return true;
+}
+
+// Run the command line on a picotool serve process instead, if PICOTOOL_SERVER is set to its socket. Returns false
+// if there is no server to run it, so it should be run here
+static bool run_on_server(int argc, char **argv, int &rc) {
+    const char *path = getenv("PICOTOOL_SERVER");
+    if (!path || !*path || (argc > 1 && !strcmp(argv[1], "serve"))) return false;
+    sockaddr_un addr;
+    if (!serve_socket_address(path, addr)) return false;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+    if (connect(fd, (sockaddr *)&addr, sizeof(addr))) {
+        close(fd);
+        return false;
+    }
+    if (!peer_is_same_user(fd)) {
+        close(fd);
+        std::cout << "ERROR: The picotool server at " << path << " is not running as this user\n";
+        rc = ERROR_CONNECTION;
+        return true;
+    }
+
+    std::vector<char> payload;
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd))) cwd[0] = 0;
+    payload.insert(payload.end(), cwd, cwd + strlen(cwd) + 1);
+    for (int i = 1; i < argc; i++) {
+        payload.insert(payload.end(), argv[i], argv[i] + strlen(argv[i]) + 1);
+    }
+    if (payload.size() > SERVE_MAX_REQUEST_SIZE) {
+        close(fd);
+        return false;
+    }
+
+    serve_request_header header = { SERVE_REQUEST_MAGIC, (uint32_t)payload.size() };
+    int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    iovec iov = { &header, sizeof(header) };
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        cmsghdr align;
+    } control;
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    int32_t result;
+    fflush(stdout);
+    if (sendmsg(fd, &msg, 0) != sizeof(header) || !write_all(fd, payload.data(), payload.size())) {
+        close(fd);
+        return false;
+    }
+    if (read_all(fd, &result, sizeof(result))) {
+        rc = result;
+    } else {
+        std::cout << "ERROR: Lost connection to picotool server at " << path << "\n";
+        rc = ERROR_CONNECTION;
+    }
+    close(fd);
+    return true;
+}
+
+static volatile sig_atomic_t serve_stopping;
+static void stop_serving(int) {
+    serve_stopping = 1;
+}
+
+// Run one client's command, with its stdin, stdout, stderr and working directory
+static void serve_request(int fd, libusb_context *ctx, served_devices &served) {
+    serve_request_header header;
+    int fds[3] = { -1, -1, -1 };
+    iovec iov = { &header, sizeof(header) };
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        cmsghdr align;
+    } control;
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if (recvmsg(fd, &msg, 0) != sizeof(header)) return;
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    }
+    auto close_fds = [&]() {
+        for (auto &f : fds) {
+            if (f >= 0) close(f);
+            f = -1;
+        }
+    };
+    std::vector<char> payload(header.len);
+    if (header.magic != SERVE_REQUEST_MAGIC || header.len > SERVE_MAX_REQUEST_SIZE || fds[2] < 0 ||
+        !read_all(fd, payload.data(), payload.size()) || payload.empty() || payload.back()) {
+        close_fds();
+        return;
+    }
+    vector<char *> args;
+    for (size_t pos = 0; pos < payload.size(); pos += strlen(&payload[pos]) + 1) {
+        args.push_back(&payload[pos]);
+    }
+    // the server's directory is restored by fd, which works even if its path is no longer reachable (the path
+    // is only needed if the directory can't be opened)
+    int server_cwd = open(".", O_RDONLY);
+    char server_cwd_path[4096];
+    if (server_cwd >= 0 || !getcwd(server_cwd_path, sizeof(server_cwd_path))) server_cwd_path[0] = 0;
+    string client_cwd = args[0];
+    args[0] = (char *)"picotool";
+
+    // swap in the client's stdin, stdout and stderr
+    fflush(stdout);
+    fflush(stderr);
+    std::cout.flush();
+    int saved[3];
+    for (int i = 0; i < 3; i++) {
+        saved[i] = dup(i);
+        dup2(fds[i], i);
+    }
+    close_fds();
+
+    int rc;
+    if (chdir(client_cwd.c_str())) {
+        std::cout << "ERROR: Cannot change to directory " << client_cwd << "\n";
+        rc = ERROR_NOT_POSSIBLE;
+    } else {
+        settings = _settings();
+        selected_cmd = nullptr;
+        selected_chip = unknown;
+        fos_ptr = fos_base_ptr;
+        reboot_cmd->quiet = false;
+        int tw = 0, th = 0;
+        get_terminal_size(tw, th);
+        if (tw) {
+            fos.last_column(std::max(tw, 40));
+        }
+        fos.first_column(0);
+        fos.hanging_indent(0);
+        rc = parse((int)args.size(), args.data());
+        if (!rc && selected_cmd) {
+            if (selected_cmd->name() == "serve") {
+                std::cout << "ERROR: Cannot run serve from a picotool server\n";
+                rc = ERROR_ARGS;
+            } else {
+                if (settings.quiet) {
+                    fos_ptr = fos_null_ptr;
+                }
+                rc = run_selected_command(ctx, &served);
+            }
+        }
+        fos_ptr = fos_base_ptr;
+    }
+    fos.flush();
+    std::cout.flush();
+    std::cout.clear();
+    fflush(stdout);
+    fflush(stderr);
+
+    for (int i = 0; i < 3; i++) {
+        dup2(saved[i], i);
+        close(saved[i]);
+    }
+    bool restored = server_cwd >= 0 ? !fchdir(server_cwd) : server_cwd_path[0] && !chdir(server_cwd_path);
+    if (server_cwd >= 0) close(server_cwd);
+    // the client gets its exit code whatever happens here
+    int32_t result = rc;
+    write_all(fd, &result, sizeof(result));
+    if (!restored) {
+        fail(ERROR_NOT_POSSIBLE, "Cannot change back to the server's directory");
+    }
+}
+
+static int LIBUSB_CALL served_device_changed(libusb_context *, libusb_device *, libusb_hotplug_event, void *user_data) {
+    ((served_devices *)user_data)->valid = false;
+    return 0;
+}
+#endif
+
+bool serve_command::execute(device_map &devices) {
+#if defined(__unix__) || defined(__APPLE__)
+    string path = settings.serve.socket.empty() ? default_serve_socket() : settings.serve.socket;
+    if (path.empty()) {
+        fail(ERROR_ARGS, "XDG_RUNTIME_DIR is not set, so the socket must be given with --socket");
+    }
+    sockaddr_un addr;
+    if (!serve_socket_address(path, addr)) {
+        fail(ERROR_ARGS, "Socket path %s is too long", path.c_str());
+    }
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        fail(ERROR_NOT_POSSIBLE, "Failed to create socket");
+    }
+    // only replace the socket if nothing is listening on it
+    if (!connect(listen_fd, (sockaddr *)&addr, sizeof(addr))) {
+        close(listen_fd);
+        fail(ERROR_NOT_POSSIBLE, "A picotool server is already running on %s", path.c_str());
+    }
+    close(listen_fd);
+    unlink(path.c_str());
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    // create the socket accessible only to this user
+    mode_t old_umask = umask(0077);
+    bool bound = listen_fd >= 0 && !bind(listen_fd, (sockaddr *)&addr, sizeof(addr));
+    umask(old_umask);
+    if (!bound || listen(listen_fd, 16)) {
+        if (listen_fd >= 0) close(listen_fd);
+        fail(ERROR_NOT_POSSIBLE, "Failed to listen on %s", path.c_str());
+    }
+
+    libusb_context *ctx = nullptr;
+    if (libusb_init(&ctx)) {
+        close(listen_fd);
+        unlink(path.c_str());
+        fail(ERROR_USB, "Failed to initialise libUSB\n");
+    }
+    picoboot_set_context(ctx);
+    served_rom_headers.enabled = true;
+    const _settings serve_settings = settings;
+    auto serve_cmd = selected_cmd;
+    {
+        served_devices served;
+        libusb_hotplug_callback_handle hotplug_handle;
+        bool hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+                       libusb_hotplug_register_callback(ctx, (libusb_hotplug_event)(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+                                                        LIBUSB_HOTPLUG_NO_FLAGS, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+                                                        LIBUSB_HOTPLUG_MATCH_ANY, served_device_changed, &served, &hotplug_handle) == LIBUSB_SUCCESS;
+
+        // stop between requests on SIGINT/SIGTERM, so accept must not be restarted
+        struct sigaction sa = {};
+        sa.sa_handler = stop_serving;
+        sigaction(SIGINT, &sa, nullptr);
+        sigaction(SIGTERM, &sa, nullptr);
+        signal(SIGPIPE, SIG_IGN);
+        serve_stopping = 0;
+
+        fos << "Serving picotool commands on " << path << "; set PICOTOOL_SERVER=" << path << " to use it\n";
+        fos.flush();
+        while (!serve_stopping) {
+            int fd = accept(listen_fd, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            if (!peer_is_same_user(fd)) {
+                std::cout << "Ignoring a request from another user\n";
+                close(fd);
+                continue;
+            }
+            if (hotplug) {
+                // pick up any devices that came or went since the last request
+                struct timeval zero = {0, 0};
+                libusb_handle_events_timeout_completed(ctx, &zero, nullptr);
+            } else {
+                served.valid = false;
+            }
+            try {
+                serve_request(fd, ctx, served);
+            } catch (std::exception &e) {
+                std::cout << "ERROR: " << e.what() << "\n";
+                served.valid = false;
+            }
+            close(fd);
+            // commands set their own signal handlers
+            sigaction(SIGINT, &sa, nullptr);
+            sigaction(SIGTERM, &sa, nullptr);
+        }
+        if (hotplug) libusb_hotplug_deregister_callback(ctx, hotplug_handle);
+    }
+    settings = serve_settings;
+    selected_cmd = serve_cmd;
+    fos_ptr = settings.quiet ? fos_null_ptr : fos_base_ptr;
+    served_rom_headers.enabled = false;
+    picoboot_set_context(nullptr);
+    libusb_exit(ctx);
+    close(listen_fd);
+    unlink(path.c_str());
+    fos << "Stopped serving on " << path << "\n";
+#else
+    fail(ERROR_NOT_POSSIBLE, "serve is only supported on Linux and macOS");
+#endif
+    return false;
+}
+
+#endif
+
+#if PICOTOOL_BENCH
+// Benchmarks of the file handling paths that live in this file; picotool_bench builds it without main()
+using bench::state;
+
+static std::shared_ptr<std::stringstream> bench_stream(const vector<uint8_t> &data) {
+    return std::make_shared<std::stringstream>(string(data.begin(), data.end()));
+}
+
+// rmap of the synthetic ELF, whose segments are separated by the configured gap
+static range_map<size_t> bench_elf_rmap(std::shared_ptr<std::stringstream> file) {
+    range_map<size_t> rmap;
+    build_rmap_elf(file, rmap);
+    return rmap;
+}
+
+static void bench_build_rmap_uf2(state &st) {
+    auto uf2 = bench::synthetic_uf2();
+    auto file = bench_stream(uf2);
+    while (st.keep_running()) {
+        range_map<size_t> rmap;
+        auto index = build_uf2_index(file);
+        build_rmap_uf2(*index, rmap);
+    }
+    st.set_bytes_per_iteration(uf2.size());
+}
+BENCHMARK(build_rmap_uf2);
+
+static void bench_build_rmap_elf(state &st) {
+    auto file = bench_stream(bench::synthetic_elf());
+    while (st.keep_running()) {
+        range_map<size_t> rmap;
+        build_rmap_elf(file, rmap);
+    }
+}
+BENCHMARK(build_rmap_elf);
+
+// lookups of every page in address order, as when reading through a file
+static void bench_range_map_find(state &st) {
+    range_map<size_t> rmap;
+    build_rmap_uf2(*build_uf2_index(bench_stream(bench::synthetic_uf2())), rmap);
+    uint32_t end = FLASH_START + bench::get_config().size;
+    size_t sum = 0;
+    while (st.keep_running()) {
+        for (uint32_t addr = FLASH_START; addr < end; addr += PAGE_SIZE) {
+            sum += rmap.find(addr).t;
+        }
+    }
+    if (!sum) fail(ERROR_UNKNOWN, "No pages found");
+}
+BENCHMARK(range_map_find);
+
+// lookups of every page in a shuffled order, which defeats the remembered position
+static void bench_range_map_find_random(state &st) {
+    range_map<size_t> rmap;
+    build_rmap_uf2(*build_uf2_index(bench_stream(bench::synthetic_uf2())), rmap);
+    vector<uint32_t> addrs;
+    for (uint32_t addr = FLASH_START; addr < FLASH_START + bench::get_config().size; addr += PAGE_SIZE) {
+        addrs.push_back(addr);
+    }
+    std::shuffle(addrs.begin(), addrs.end(), std::mt19937(2350));
+    size_t sum = 0;
+    while (st.keep_running()) {
+        for (auto addr : addrs) {
+            sum += rmap.find(addr).t;
+        }
+    }
+    if (!sum) fail(ERROR_UNKNOWN, "No pages found");
+}
+BENCHMARK(range_map_find_random);
+
+static void bench_iostream_memory_access_read(state &st) {
+    auto file = bench_stream(bench::synthetic_elf());
+    auto rmap = bench_elf_rmap(file);
+    iostream_memory_access access(file, rmap, FLASH_START);
+    access.set_model(std::make_shared<model_rp2350>());
+    // the whole of the binary, including the gaps between the segments
+    uint32_t size = rmap.ranges().back().to - FLASH_START;
+    vector<uint8_t> buffer(size);
+    while (st.keep_running()) {
+        access.read(FLASH_START, buffer.data(), size, true);
+    }
+    st.set_bytes_per_iteration(size);
+}
+BENCHMARK(iostream_memory_access_read);
+
+static void bench_init_otp_regs() {
+    static bool done;
+    if (!done) {
+        init_otp(otp_regs);
+        done = true;
+    }
+}
+
+// as used by otp list
+static void bench_filter_otp_all(state &st) {
+    bench_init_otp_regs();
+    while (st.keep_running()) {
+        auto matches = filter_otp({":"}, 24, true);
+    }
+}
+BENCHMARK(filter_otp_all);
+
+// as used to find a single register by name
+static void bench_filter_otp_name(state &st) {
+    bench_init_otp_regs();
+    while (st.keep_running()) {
+        auto matches = filter_otp({"usb_boot_flags"}, 24, false);
+    }
+}
+BENCHMARK(filter_otp_name);
 
+#else
+int main(int argc, char **argv) {
+#if HAS_LIBUSB && (defined(__unix__) || defined(__APPLE__))
+    {
+        int server_rc;
+        if (run_on_server(argc, argv, server_rc)) return server_rc;
+    }
+#endif
+    int tw=0, th=0;
+    get_terminal_size(tw, th);
+    if (tw) {
+        fos.last_column(std::max(tw, 40));
+    }
+
+    int rc = parse(argc, argv);
+    if (rc) return rc;
+    if (!selected_cmd) {
+        return 0;
+    }
+
+    if (settings.quiet) {
+        fos_ptr = fos_null_ptr;
+    }
+
+#if HAS_LIBUSB
+    rc = run_selected_command(nullptr, nullptr);
 #else
     device_map devices;
 
@@ -8905,3 +11232,4 @@ int main(int argc, char **argv) {
 
     return rc;
 }
+#endif
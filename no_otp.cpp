@@ -20,4 +20,8 @@ std::basic_string<T> uppercase(const std::basic_string<T>& s)
     return s2;
 }
 
-void init_otp(std::map<uint32_t, otp_reg> &otp_regs, std::vector<std::string> extra_otp_files) {}
+const otp_reg *otp_reg_list::find(uint32_t row) const { return nullptr; }
+
+std::vector<const otp_reg *> otp_reg_list::find_name(const std::string& upper_name) const { return {}; }
+
+void init_otp(otp_reg_list &otp_regs, std::vector<std::string> extra_otp_files) {}
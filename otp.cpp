@@ -1,17 +1,13 @@
 
 #include <algorithm>
-#include <map>
+#include <deque>
 #include <fstream>
 
 #include "otp.h"
 
-#include "whereami++.h"
+#include "nlohmann/json.hpp"
 
-#if CODE_OTP
-#include "otp_contents.h"
-#else
-#include "data_locs.h"
-#endif
+using json = nlohmann::json;
 
 #ifndef NDEBUG
 #define DEBUG_LOG(...) printf(__VA_ARGS__)
@@ -19,7 +15,7 @@
 #define DEBUG_LOG(...) ((void)0)
 #endif
 
-#include "rp2350.json.h"
+#include "rp2350_otp.h"
 
 template <typename T>
 std::basic_string<T> lowercase(const std::basic_string<T>& s)
@@ -37,38 +33,82 @@ std::basic_string<T> uppercase(const std::basic_string<T>& s)
     return s2;
 }
 
-void init_otp(std::map<uint32_t, otp_reg> &otp_regs, std::vector<std::string> extra_otp_files) {
-#if CODE_OTP
-    std::transform(otp_reg_list.begin(), otp_reg_list.end(), std::inserter(otp_regs, otp_regs.end()), [](const otp_reg& r) { return std::make_pair( r.row, r); });
-#elif 0
-    // search same directory as executable
-    whereami::whereami_path_t executablePath = whereami::getExecutablePath();
-    std::string local_loc = executablePath.dirname() + "/";
-    if (std::find(data_locs.begin(), data_locs.end(), local_loc) == data_locs.end()) {
-        data_locs.insert(data_locs.begin(), local_loc);
+// Registers from extra JSON files, along with their strings and fields, which are kept for the rest of the program
+static std::deque<std::string> extra_string_store;
+static std::deque<std::vector<otp_field>> extra_field_store;
+static std::deque<otp_reg> extra_reg_store;
+
+static otp_str keep_string(const std::string &s) {
+    extra_string_store.push_back(s);
+    return otp_str(extra_string_store.back().c_str());
+}
+
+static otp_reg reg_from_json(const json &j) {
+    otp_reg reg = {};
+    std::string name = j.at("name").get<std::string>();
+    reg.name = keep_string(name);
+    reg.upper_name = keep_string(uppercase(name));
+    reg.description = keep_string(j.at("description").get<std::string>());
+    j.at("row").get_to(reg.row);
+    if (j.contains("ecc")) j.at("ecc").get_to(reg.ecc);
+    if (j.contains("crit")) j.at("crit").get_to(reg.crit);
+    if (j.contains("redundancy")) j.at("redundancy").get_to(reg.redundancy);
+
+    if (j.contains("fields")) {
+        std::vector<otp_field> fields;
+        for (const auto &jf : j.at("fields")) {
+            otp_field field = {};
+            std::string field_name = jf.at("name").get<std::string>();
+            field.name = keep_string(field_name);
+            field.upper_name = keep_string(uppercase(field_name));
+            jf.at("mask").get_to(field.mask);
+            field.description = keep_string(jf.at("description").get<std::string>());
+            fields.push_back(field);
+        }
+        extra_field_store.push_back(std::move(fields));
+        reg.fields = otp_field_list(extra_field_store.back().data(), extra_field_store.back().size());
     }
-    std::string local_loc_debug = executablePath.dirname() + "/../";
-    if (std::find(data_locs.begin(), data_locs.end(), local_loc_debug) == data_locs.end()) {
-        data_locs.insert(data_locs.begin(), local_loc_debug);
+    if (j.contains("mask")) {
+        j.at("mask").get_to(reg.mask);
+    } else {
+        reg.mask = reg.ecc ? 0xffff : 0xffffff;
     }
-    // and search ../ in case exe in subdirectory Debug
-    for (auto loc : data_locs) {
-        std::string filename = loc + "rp2350_otp_contents.json";
-        std::ifstream i(filename);
-        if (i.good()) {
-            printf("Picking OTP JSON file %s\n", filename.c_str());
-            json j;
-            i >> j;
-            std::transform(j.begin(), j.end(), std::inserter(otp_regs, otp_regs.end()), [](const otp_reg& r) { return std::make_pair( r.row, r); });
-            break;
-        } else {
-            DEBUG_LOG("Can't find JSON file %s\n", filename.c_str());
-        }
+
+    if (j.contains("seq_length") || j.contains("seq_index") || j.contains("seq_prefix")) {
+        j.at("seq_length").get_to(reg.seq_length);
+        j.at("seq_index").get_to(reg.seq_index);
+        reg.seq_prefix = keep_string(j.at("seq_prefix").get<std::string>());
+    }
+    return reg;
+}
+
+const otp_reg *otp_reg_list::find(uint32_t row) const {
+    auto it = std::lower_bound(regs.begin(), regs.end(), row, [](const otp_reg *r, uint32_t row) { return r->row < row; });
+    if (it == regs.end() || (*it)->row != row) return nullptr;
+    return *it;
+}
+
+std::vector<const otp_reg *> otp_reg_list::find_name(const std::string& upper_name) const {
+    std::vector<const otp_reg *> found;
+    const size_t num_buckets = sizeof(otp_builtin_name_seeds) / sizeof(otp_builtin_name_seeds[0]);
+    const size_t num_slots = sizeof(otp_builtin_name_slots) / sizeof(otp_builtin_name_slots[0]);
+    uint32_t seed = otp_builtin_name_seeds[otp_name_hash(upper_name.c_str(), 0) % num_buckets];
+    int idx = otp_builtin_name_slots[otp_name_hash(upper_name.c_str(), seed) & (num_slots - 1)];
+    if (idx >= 0 && otp_builtin_regs[idx].upper_name == upper_name) {
+        found.push_back(&otp_builtin_regs[idx]);
+    }
+    for (const auto reg : extra_regs) {
+        if (reg->upper_name == upper_name) found.push_back(reg);
+    }
+    return found;
+}
+
+void init_otp(otp_reg_list &otp_regs, std::vector<std::string> extra_otp_files) {
+    otp_regs.regs.clear();
+    otp_regs.extra_regs.clear();
+    for (const auto &reg : otp_builtin_regs) {
+        otp_regs.regs.push_back(&reg);
     }
-#else
-    json j = json::parse(rp2350_json);
-    std::transform(j.begin(), j.end(), std::inserter(otp_regs, otp_regs.end()), [](const otp_reg& r) { return std::make_pair( r.row, r); });
-#endif
 
     for (auto filename : extra_otp_files) {
         std::ifstream i(filename);
@@ -76,7 +116,16 @@ void init_otp(std::map<uint32_t, otp_reg> &otp_regs, std::vector<std::string> ex
             printf("Adding OTP JSON file %s\n", filename.c_str());
             json j;
             i >> j;
-            std::transform(j.begin(), j.end(), std::inserter(otp_regs, otp_regs.end()), [](const otp_reg& r) { return std::make_pair( r.row, r); });
+            for (const auto &jr : j) {
+                extra_reg_store.push_back(reg_from_json(jr));
+                const otp_reg *reg = &extra_reg_store.back();
+                // registers at rows which are already known are ignored
+                auto it = std::lower_bound(otp_regs.regs.begin(), otp_regs.regs.end(), reg->row, [](const otp_reg *r, uint32_t row) { return r->row < row; });
+                if (it == otp_regs.regs.end() || (*it)->row != reg->row) {
+                    otp_regs.regs.insert(it, reg);
+                    otp_regs.extra_regs.push_back(reg);
+                }
+            }
         } else {
             printf("Can't find JSON file %s\n", filename.c_str());
         }
@@ -8,90 +8,93 @@
 #define _OTP_H
 
 #include <string>
-#include <cassert>
+#include <cstring>
+#include <ostream>
 #include <vector>
 #include <cstdint>
 
-#include "nlohmann/json.hpp"
-
-using json = nlohmann::json;
-
 template <typename T> std::basic_string<T> lowercase(const std::basic_string<T>& s);
 template <typename T> std::basic_string<T> uppercase(const std::basic_string<T>& s);
 
+// String in the OTP register definitions. It doesn't own the characters, which are either in the built in
+// table, or kept by init_otp for registers added from JSON files
+struct otp_str {
+    constexpr otp_str() : s("") {}
+    constexpr explicit otp_str(const char *s) : s(s) {}
+    const char *c_str() const { return s; }
+    bool empty() const { return !*s; }
+    bool contains(const std::string &sub) const { return strstr(s, sub.c_str()) != nullptr; }
+    bool operator==(const std::string &other) const { return other == s; }
+    operator std::string() const { return s; }
+    friend std::ostream& operator<<(std::ostream& os, const otp_str& str) { return os << str.s; }
+private:
+    const char *s;
+};
+
 struct otp_field {
-    otp_field() = default;
-    otp_field(std::string name, uint32_t mask) : name(std::move(name)), mask(mask) {
-        upper_name = uppercase(this->name);
-    }
-    otp_field(std::string name, uint32_t mask, std::string description) : otp_field(std::move(name), mask) {
-        this->description = std::move(description);
-    }
-    std::string name;
-    std::string upper_name;
+    otp_str name;
+    otp_str upper_name;
     uint32_t mask;
-    std::string description;
-
-    friend void to_json(json& nlohmann_json_j, const otp_field& nlohmann_json_t) {
-        NLOHMANN_JSON_EXPAND(NLOHMANN_JSON_PASTE(NLOHMANN_JSON_TO, name, mask, description))
-    }
+    otp_str description;
+};
 
-    friend void from_json(const json& nlohmann_json_j, otp_field& nlohmann_json_t) {
-        NLOHMANN_JSON_EXPAND(NLOHMANN_JSON_PASTE(NLOHMANN_JSON_FROM, name, mask, description))
-        nlohmann_json_t.upper_name = uppercase(nlohmann_json_t.name);
-    }
+struct otp_field_list {
+    constexpr otp_field_list() : first(nullptr), count(0) {}
+    constexpr otp_field_list(const otp_field *first, size_t count) : first(first), count(count) {}
+    const otp_field *begin() const { return first; }
+    const otp_field *end() const { return first + count; }
+    bool empty() const { return !count; }
+    size_t size() const { return count; }
+private:
+    const otp_field *first;
+    size_t count;
 };
 
 struct otp_reg {
-    otp_reg() = default;
-    explicit otp_reg(std::string name, uint32_t row, uint32_t mask) : name(std::move(name)), row(row), mask(mask) {
-        upper_name = uppercase(this->name);
-    }
-    otp_reg& with_ecc() { assert(!redundancy); ecc = true; return *this; }
-    otp_reg& with_crit() { assert(!ecc); crit = true; return *this; }
-    otp_reg& with_redundancy(int r) { assert(!ecc); redundancy = r; return *this; }
-    otp_reg& with_description(std::string d) { description = std::move(d); return *this; }
-    otp_reg& with_field(const otp_field& field) { fields.push_back(field); return *this; }
-    otp_reg& with_sequence(std::string prefix, int index, int length) { seq_prefix = std::move(prefix); seq_index = index; seq_length = length; return *this; }
-    std::string name;
-    std::string upper_name;
-    std::string description;
-    uint32_t row = 0xffffffff;
-    uint32_t mask = 0;
-    bool ecc = false;
-    bool crit = false;
-    unsigned int redundancy = 0;
-    unsigned int seq_length = 0;
-    unsigned int seq_index = 0;
-    std::string seq_prefix;
-    std::vector<otp_field> fields;
+    otp_str name;
+    otp_str upper_name;
+    otp_str description;
+    uint32_t row;
+    uint32_t mask;
+    bool ecc;
+    bool crit;
+    unsigned int redundancy;
+    unsigned int seq_length;
+    unsigned int seq_index;
+    otp_str seq_prefix;
+    otp_field_list fields;
+};
 
-    friend void to_json(json& nlohmann_json_j, const otp_reg& nlohmann_json_t) {
-        NLOHMANN_JSON_EXPAND(NLOHMANN_JSON_PASTE(NLOHMANN_JSON_TO, name, description, ecc, crit, fields, mask, redundancy, row, seq_index, seq_length, seq_prefix))
+// Hash used for the perfect hash of the built in register names (otp_header_parse has a copy)
+inline uint32_t otp_name_hash(const char *s, uint32_t seed) {
+    uint32_t h = 0x811c9dc5u ^ (seed * 0x9e3779b9u);
+    while (*s) {
+        h ^= (uint8_t)*s++;
+        h *= 0x01000193u;
     }
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    return h;
+}
 
-    friend void from_json(const json& nlohmann_json_j, otp_reg& nlohmann_json_t) {
-        NLOHMANN_JSON_EXPAND(NLOHMANN_JSON_PASTE(NLOHMANN_JSON_FROM, name, description, row))
-        if (nlohmann_json_j.contains("ecc")) nlohmann_json_j.at("ecc").get_to(nlohmann_json_t.ecc);
-        if (nlohmann_json_j.contains("crit")) nlohmann_json_j.at("crit").get_to(nlohmann_json_t.crit);
-        if (nlohmann_json_j.contains("redundancy")) nlohmann_json_j.at("redundancy").get_to(nlohmann_json_t.redundancy);
-
-        if (nlohmann_json_j.contains("fields")) nlohmann_json_j.at("fields").get_to(nlohmann_json_t.fields);
-        if (nlohmann_json_j.contains("mask")){
-            nlohmann_json_j.at("mask").get_to(nlohmann_json_t.mask);
-        } else {
-            nlohmann_json_t.mask = nlohmann_json_t.ecc ? 0xffff : 0xffffff;
-        }
+// The known OTP registers in row order - the built in ones, which are a constant table generated from
+// otp_data.h, plus any from extra JSON files
+struct otp_reg_list {
+    typedef std::vector<const otp_reg *>::const_iterator const_iterator;
+    const_iterator begin() const { return regs.begin(); }
+    const_iterator end() const { return regs.end(); }
+    // register at the given row, or nullptr
+    const otp_reg *find(uint32_t row) const;
+    // registers with the given upper case name
+    std::vector<const otp_reg *> find_name(const std::string& upper_name) const;
 
-        if (nlohmann_json_j.contains("seq_length") || nlohmann_json_j.contains("seq_index") || nlohmann_json_j.contains("seq_prefix")) {
-            nlohmann_json_j.at("seq_length").get_to(nlohmann_json_t.seq_length);
-            nlohmann_json_j.at("seq_index").get_to(nlohmann_json_t.seq_index);
-            nlohmann_json_j.at("seq_prefix").get_to(nlohmann_json_t.seq_prefix);
-        }
-        nlohmann_json_t.upper_name = uppercase(nlohmann_json_t.name);
-    }
+private:
+    friend void init_otp(otp_reg_list &otp_regs, std::vector<std::string> extra_otp_files);
+    std::vector<const otp_reg *> regs;
+    std::vector<const otp_reg *> extra_regs;
 };
 
-void init_otp(std::map<uint32_t, otp_reg> &otp_regs, std::vector<std::string> extra_otp_files = {});
+void init_otp(otp_reg_list &otp_regs, std::vector<std::string> extra_otp_files = {});
 
 #endif
@@ -11,6 +11,9 @@
 #include <map>
 #include <cassert>
 #include <cstdint>
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
 
 #include "nlohmann/json.hpp"
 
@@ -33,7 +36,8 @@ using json = nlohmann::json;
 // todo values?
 
 static void usage() {
-    std::cerr << "usage: otp_header_parser <otp_data.h filename> <output header filename>" << std::endl;
+    std::cerr << "usage: otp_header_parser <otp_data.h filename> <output filename>..." << std::endl;
+    std::cerr << "  outputs ending in .json get the registers as JSON, otherwise as a C++ header with a constexpr table" << std::endl;
 }
 
 enum {
@@ -122,8 +126,142 @@ bool valid_description(std::string description) {
     return true;
 }
 
+// Must match otp_name_hash in otp.h
+static uint32_t otp_name_hash(const char *s, uint32_t seed) {
+    uint32_t h = 0x811c9dc5u ^ (seed * 0x9e3779b9u);
+    while (*s) {
+        h ^= (uint8_t)*s++;
+        h *= 0x01000193u;
+    }
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    return h;
+}
+
+static std::string uppercase(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), toupper);
+    return s;
+}
+
+static std::string c_string_literal(const std::string &s) {
+    std::stringstream ss;
+    ss << '"';
+    for (char c : s) {
+        if (c == '"' || c == '\\' || c == '?') {
+            ss << '\\' << c;
+        } else if (c < 0x20 || c > 0x7e) {
+            ss << "\\x" << std::hex << std::setw(2) << std::setfill('0') << (int)(uint8_t)c << "\"\"";
+        } else {
+            ss << c;
+        }
+    }
+    ss << '"';
+    return ss.str();
+}
+
+// Write the registers as a flat constexpr table, sorted by row, with the strings interned in one pool and a
+// perfect hash from upper case register name to table index (see otp.h)
+static void write_table_header(std::ostream &out) {
+    std::vector<const otp_reg *> regs;
+    for (const auto &e : otp_regs) {
+        regs.push_back(&e.second);
+    }
+    std::sort(regs.begin(), regs.end(), [](const otp_reg *a, const otp_reg *b) { return a->row < b->row; });
+    for (size_t i = 1; i < regs.size(); i++) {
+        if (regs[i]->row == regs[i-1]->row) {
+            throw std::runtime_error("duplicate OTP row " + regs[i]->name + " and " + regs[i-1]->name);
+        }
+    }
+
+    std::vector<std::string> strings;
+    std::map<std::string, size_t> string_indexes;
+    auto intern = [&](const std::string &str) {
+        auto it = string_indexes.find(str);
+        if (it == string_indexes.end()) {
+            it = string_indexes.emplace(str, strings.size()).first;
+            strings.push_back(str);
+        }
+        return "otp_str(otp_strings[" + std::to_string(it->second) + "])";
+    };
+
+    // hash and displace: each register name hashes to a bucket, and each bucket gets the seed which puts
+    // all of its names in free slots
+    const size_t num_buckets = std::max((size_t)1, regs.size() / 4);
+    size_t num_slots = 1;
+    while (num_slots < regs.size() + regs.size() / 4) num_slots <<= 1;
+    std::vector<std::vector<size_t>> buckets(num_buckets);
+    std::vector<std::string> upper_names;
+    for (size_t i = 0; i < regs.size(); i++) {
+        upper_names.push_back(uppercase(regs[i]->name));
+        buckets[otp_name_hash(upper_names[i].c_str(), 0) % num_buckets].push_back(i);
+    }
+    std::vector<size_t> bucket_order(num_buckets);
+    for (size_t b = 0; b < num_buckets; b++) bucket_order[b] = b;
+    std::stable_sort(bucket_order.begin(), bucket_order.end(), [&](size_t a, size_t b) { return buckets[a].size() > buckets[b].size(); });
+    std::vector<uint32_t> seeds(num_buckets, 0);
+    std::vector<int> slots(num_slots, -1);
+    for (size_t b : bucket_order) {
+        if (buckets[b].empty()) break;
+        for (uint32_t seed = 1; ; seed++) {
+            if (seed == 0xffff) throw std::runtime_error("could not build OTP register name hash");
+            std::vector<size_t> trial;
+            for (size_t i : buckets[b]) {
+                size_t slot = otp_name_hash(upper_names[i].c_str(), seed) & (num_slots - 1);
+                if (slots[slot] >= 0 || std::find(trial.begin(), trial.end(), slot) != trial.end()) break;
+                trial.push_back(slot);
+            }
+            if (trial.size() == buckets[b].size()) {
+                for (size_t k = 0; k < trial.size(); k++) slots[trial[k]] = (int)buckets[b][k];
+                seeds[b] = seed;
+                break;
+            }
+        }
+    }
+
+    std::stringstream fields_out;
+    std::stringstream regs_out;
+    size_t num_fields = 0;
+    for (size_t i = 0; i < regs.size(); i++) {
+        const auto &r = *regs[i];
+        size_t first_field = num_fields;
+        for (const auto &f : r.fields) {
+            fields_out << "    {" << intern(f.name) << ", " << intern(uppercase(f.name)) << ", 0x" << std::hex << f.mask << std::dec
+                       << ", " << intern(f.description) << "},\n";
+            num_fields++;
+        }
+        regs_out << "    {" << intern(r.name) << ", " << intern(upper_names[i]) << ", " << intern(r.description)
+                 << ", 0x" << std::hex << r.row << ", 0x" << r.mask << std::dec
+                 << ", " << (r.ecc ? "true" : "false") << ", " << (r.crit ? "true" : "false")
+                 << ", " << r.redundancy << ", " << r.seq_length << ", " << r.seq_index << ", " << intern(r.seq_prefix)
+                 << ", otp_field_list(otp_builtin_fields + " << first_field << ", " << r.fields.size() << ")},\n";
+    }
+
+    out << "// GENERATED FILE; DO NOT EDIT" << std::endl << std::endl;
+    out << "#pragma once" << std::endl << std::endl;
+    out << "static constexpr const char *otp_strings[] = {" << std::endl;
+    for (const auto &str : strings) {
+        out << "    " << c_string_literal(str) << "," << std::endl;
+    }
+    out << "};" << std::endl << std::endl;
+    out << "static constexpr otp_field otp_builtin_fields[] = {" << std::endl;
+    if (!num_fields) out << "    {}," << std::endl;
+    out << fields_out.str() << "};" << std::endl << std::endl;
+    out << "static constexpr otp_reg otp_builtin_regs[] = {" << std::endl << regs_out.str() << "};" << std::endl << std::endl;
+    out << "static constexpr uint16_t otp_builtin_name_seeds[] = {";
+    for (size_t b = 0; b < num_buckets; b++) {
+        out << (b % 16 ? " " : "\n    ") << seeds[b] << ",";
+    }
+    out << std::endl << "};" << std::endl << std::endl;
+    out << "static constexpr int16_t otp_builtin_name_slots[] = {";
+    for (size_t k = 0; k < num_slots; k++) {
+        out << (k % 16 ? " " : "\n    ") << slots[k] << ",";
+    }
+    out << std::endl << "};" << std::endl;
+}
+
 int main(int argc, char **argv) {
-    if (argc < 2) {
+    if (argc < 3) {
         usage();
         return ERROR_ARGS;
     }
@@ -338,49 +476,21 @@ int main(int argc, char **argv) {
                 return ERROR_INPUT;
             }
         }
-        std::ofstream out_file(argv[2]);
-    #if CODE_OTP
-        out_file << "// GENERATE FILE; DO NOT EDIT // " << std::endl << std::endl;
-        out_file << "#pragma once" << std::endl;
-        out_file << "std::vector<otp_reg> otp_reg_list = {" << std::endl;
-        for (const auto &e : otp_regs) {
-            const auto &r = e.second;
-            out_file << "    otp_reg(\"" << e.first << "\", 0x" << std::hex << r.row << ", 0x" << r.mask << ")";
-            if (r.ecc) {
-                out_file << std::endl << "        .with_ecc()";
-            }
-            if (r.redundancy > 1) {
-                out_file << std::endl << "        .with_redundancy(" << std::dec << r.redundancy << ")";
-            }
-            if (r.crit) {
-                out_file << std::endl << "        .with_crit()";
-            }
-            if (valid_description(r.description)) {
-                out_file << std::endl << "        .with_description(\"" << r.description << "\")";
-            }
-            if (!r.seq_prefix.empty()) {
-                out_file << std::endl << "        .with_sequence(\"" << std::dec << r.seq_prefix << "\", " << r.seq_index << ", " << r.seq_length << ")";
-            }
-            for(const auto &f : r.fields) {
-                out_file << std::endl << "        .with_field(otp_field(\"" << f.name << "\", 0x" << std:: hex << f.mask;
-                if (valid_description(f.description)) {
-                    out_file << ", \"" << f.description << "\"";
-                }
-                out_file << "))";
+        for (int i = 2; i < argc; i++) {
+            std::string out_name = argv[i];
+            std::ofstream out_file(out_name);
+            if (ends_with(out_name, ".json")) {
+                json j;
+
+                std::vector<otp_reg> otp_regs_vec;
+                for(auto const& e: otp_regs)
+                    otp_regs_vec.push_back(e.second);
+                j = otp_regs_vec;
+                out_file << std::setw(4) << j << std::endl;
+            } else {
+                write_table_header(out_file);
             }
-            out_file << ",";
-            out_file << std::endl;
         }
-        out_file << "};" << std::endl;
-    #else
-        json j;
-
-        std::vector<otp_reg> otp_regs_vec;
-        for(auto const& e: otp_regs)
-            otp_regs_vec.push_back(e.second);
-        j = otp_regs_vec;
-        out_file << std::setw(4) << j << std::endl;
-    #endif
     } catch (std::exception &e) {
         cerr << "ERROR: " << e.what() << "\n\n";
         return ERROR_UNKNOWN;
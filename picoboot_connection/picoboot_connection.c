@@ -8,8 +8,14 @@
 #include <string.h>
 #include <stdbool.h>
 #include <inttypes.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
 
 #include "picoboot_connection.h"
+#include "addresses.h"
 #include "boot/bootrom_constants.h"
 #include "pico/stdio_usb/reset_interface.h"
 
@@ -21,49 +27,133 @@
 #endif
 
 static bool verbose;
-static bool definitely_exclusive;
-static enum {
+static libusb_context *async_ctx;
+static picoboot_trace_fn trace_fn;
+
+enum xip_state {
     XIP_UNKOWN,
     XIP_ACTIVE,
     XIP_INACTIVE,
-} xip_state;
+};
 
-// todo test sparse binary (well actually two range is this)
+// State tracked per open PICOBOOT device, so that several devices can be driven at once (each from its own
+// thread). The table is shared, so it is only searched or changed with device_states_lock held; each entry's
+// fields belong to the thread driving that device.
+struct picoboot_device_state {
+    libusb_device_handle *handle;
+    unsigned int interface_num;
+    unsigned int out_ep;
+    unsigned int in_ep;
+    enum xip_state xip_state;
+    bool definitely_exclusive;
+    uint32_t next_token;
+    int one_time_bulk_timeout;
+    // set for devices which aren't reached through libusb
+    const struct picoboot_transport *transport;
+};
 
-uint32_t crc32_for_byte(uint32_t remainder) {
-    const uint32_t POLYNOMIAL = 0x4C11DB7;
-    remainder <<= 24u;
-    for (unsigned int bit = 8; bit > 0; bit--) {
-        if (remainder & 0x80000000)
-            remainder = (remainder << 1) ^ POLYNOMIAL;
-        else
-            remainder = (remainder << 1);
+#define PICOBOOT_MAX_DEVICE_STATES 128u
+static struct picoboot_device_state device_states[PICOBOOT_MAX_DEVICE_STATES];
+static unsigned int next_device_state;
+// used for handles that were not opened via picoboot_open_device
+static struct picoboot_device_state unknown_device_state = { .next_token = 1 };
+
+#ifdef _WIN32
+static SRWLOCK device_states_lock = SRWLOCK_INIT;
+static void lock_device_states(void) { AcquireSRWLockExclusive(&device_states_lock); }
+static void unlock_device_states(void) { ReleaseSRWLockExclusive(&device_states_lock); }
+#else
+static pthread_mutex_t device_states_lock = PTHREAD_MUTEX_INITIALIZER;
+static void lock_device_states(void) { pthread_mutex_lock(&device_states_lock); }
+static void unlock_device_states(void) { pthread_mutex_unlock(&device_states_lock); }
+#endif
+
+// call with device_states_lock held
+static struct picoboot_device_state *find_device_state(libusb_device_handle *usb_device) {
+    for (unsigned int i = 0; i < PICOBOOT_MAX_DEVICE_STATES; i++) {
+        if (device_states[i].handle == usb_device) return &device_states[i];
     }
-    return remainder;
+    return &unknown_device_state;
 }
 
-uint32_t crc32_sw(const uint8_t *buf, unsigned int count, uint32_t crc) {
-    static uint32_t table[0x100];
-    if (!table[1]) {
-        for (unsigned int i = 0; i < count_of(table); i++) {
-            table[i] = crc32_for_byte(i);
-        }
+// call with device_states_lock held
+static struct picoboot_device_state *claim_device_state(libusb_device_handle *usb_device) {
+    struct picoboot_device_state *state = find_device_state(usb_device);
+    if (state == &unknown_device_state) state = find_device_state(NULL);
+    if (state == &unknown_device_state) {
+        // handles are recycled once closed, so just reuse the oldest entry
+        state = &device_states[next_device_state++ % PICOBOOT_MAX_DEVICE_STATES];
     }
-    for (unsigned int i = 0; i < count; ++i) {
-        crc = (crc << 8u) ^ table[(uint8_t) ((crc >> 24u) ^ buf[i])];
-    }
-    return crc;
+    memset(state, 0, sizeof(*state));
+    state->handle = usb_device;
+    state->next_token = 1;
+    return state;
+}
+
+static struct picoboot_device_state *device_state(libusb_device_handle *usb_device) {
+    lock_device_states();
+    struct picoboot_device_state *state = find_device_state(usb_device);
+    unlock_device_states();
+    return state;
+}
+
+static struct picoboot_device_state *new_device_state(libusb_device_handle *usb_device) {
+    lock_device_states();
+    struct picoboot_device_state *state = claim_device_state(usb_device);
+    unlock_device_states();
+    return state;
 }
 
-unsigned int interface;
-unsigned int out_ep;
-unsigned int in_ep;
+// the USB transfers, which go to the device's transport instead of libusb if it has one
+static int bulk_transfer(libusb_device_handle *usb_device, unsigned char endpoint, uint8_t *data, int length,
+                         int *transferred, unsigned int timeout) {
+    const struct picoboot_transport *transport = device_state(usb_device)->transport;
+    if (transport) return transport->bulk_transfer(transport->ctx, endpoint, data, length, transferred, timeout);
+    return libusb_bulk_transfer(usb_device, endpoint, data, length, transferred, timeout);
+}
+
+static int control_transfer(libusb_device_handle *usb_device, uint8_t request_type, uint8_t request, uint16_t value,
+                            uint16_t index, uint8_t *data, uint16_t length, unsigned int timeout) {
+    const struct picoboot_transport *transport = device_state(usb_device)->transport;
+    if (transport) return transport->control_transfer(transport->ctx, request_type, request, value, index, data, length, timeout);
+    return libusb_control_transfer(usb_device, request_type, request, value, index, data, length, timeout);
+}
+
+static int clear_halt(libusb_device_handle *usb_device, unsigned char endpoint) {
+    const struct picoboot_transport *transport = device_state(usb_device)->transport;
+    if (transport) return transport->clear_halt(transport->ctx, endpoint);
+    return libusb_clear_halt(usb_device, endpoint);
+}
+
+libusb_device_handle *picoboot_open_transport(const struct picoboot_transport *transport, unsigned int out_ep, unsigned int in_ep) {
+    // the handle only identifies the device state, which is where it points
+    lock_device_states();
+    struct picoboot_device_state *state = claim_device_state(NULL);
+    state->handle = (libusb_device_handle *) state;
+    state->out_ep = out_ep;
+    state->in_ep = in_ep;
+    state->transport = transport;
+    unlock_device_states();
+    return state->handle;
+}
+
+void picoboot_close_transport(libusb_device_handle *usb_device) {
+    lock_device_states();
+    struct picoboot_device_state *state = find_device_state(usb_device);
+    if (state->transport) memset(state, 0, sizeof(*state));
+    unlock_device_states();
+}
+
+const struct picoboot_transport *picoboot_get_transport(libusb_device_handle *usb_device) {
+    return device_state(usb_device)->transport;
+}
+
+// todo test sparse binary (well actually two range is this)
 
 enum picoboot_device_result picoboot_open_device(libusb_device *device, libusb_device_handle **dev_handle, chip_t *chip, int vid, int pid, const char* ser) {
     struct libusb_device_descriptor desc;
     struct libusb_config_descriptor *config;
 
-    definitely_exclusive = false;
     *dev_handle = NULL;
     *chip = unknown;
     int ret = libusb_get_device_descriptor(device, &desc);
@@ -155,19 +245,20 @@ enum picoboot_device_result picoboot_open_device(libusb_device *device, libusb_d
     }
 
     if (!ret) {
+        struct picoboot_device_state *state = new_device_state(*dev_handle);
         if (config->bNumInterfaces == 1) {
-            interface = 0;
+            state->interface_num = 0;
         } else {
-            interface = 1;
+            state->interface_num = 1;
         }
-        if (config->interface[interface].altsetting[0].bInterfaceClass == 0xff &&
-            config->interface[interface].altsetting[0].bNumEndpoints == 2) {
-            out_ep = config->interface[interface].altsetting[0].endpoint[0].bEndpointAddress;
-            in_ep = config->interface[interface].altsetting[0].endpoint[1].bEndpointAddress;
+        const struct libusb_interface_descriptor *desc_if = &config->interface[state->interface_num].altsetting[0];
+        if (desc_if->bInterfaceClass == 0xff && desc_if->bNumEndpoints == 2) {
+            state->out_ep = desc_if->endpoint[0].bEndpointAddress;
+            state->in_ep = desc_if->endpoint[1].bEndpointAddress;
         }
-        if (out_ep && in_ep && !(out_ep & 0x80u) && (in_ep & 0x80u)) {
+        if (state->out_ep && state->in_ep && !(state->out_ep & 0x80u) && (state->in_ep & 0x80u)) {
             if (verbose) output("Found PICOBOOT interface\n");
-            ret = libusb_claim_interface(*dev_handle, interface);
+            ret = libusb_claim_interface(*dev_handle, state->interface_num);
             if (ret) {
                 if (verbose) output("Failed to claim interface\n");
                 return dr_vidpid_bootrom_no_interface;
@@ -227,7 +318,7 @@ enum picoboot_device_result picoboot_open_device(libusb_device *device, libusb_d
 static bool is_halted(libusb_device_handle *usb_device, int ep) {
     uint8_t data[2];
 
-    int transferred = libusb_control_transfer(
+    int transferred = control_transfer(
             usb_device,
             /*LIBUSB_REQUEST_TYPE_STANDARD | */LIBUSB_RECIPIENT_ENDPOINT | LIBUSB_ENDPOINT_IN,
             LIBUSB_REQUEST_GET_STATUS,
@@ -247,21 +338,22 @@ static bool is_halted(libusb_device_handle *usb_device, int ep) {
 }
 
 int picoboot_reset(libusb_device_handle *usb_device) {
+    struct picoboot_device_state *state = device_state(usb_device);
     if (verbose) output("RESET\n");
-    if (is_halted(usb_device, in_ep))
-        libusb_clear_halt(usb_device, in_ep);
-    if (is_halted(usb_device, out_ep))
-        libusb_clear_halt(usb_device, out_ep);
+    if (is_halted(usb_device, state->in_ep))
+        clear_halt(usb_device, state->in_ep);
+    if (is_halted(usb_device, state->out_ep))
+        clear_halt(usb_device, state->out_ep);
     int ret =
-            libusb_control_transfer(usb_device, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE,
-                                    PICOBOOT_IF_RESET, 0, interface, NULL, 0, 1000);
+            control_transfer(usb_device, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE,
+                             PICOBOOT_IF_RESET, 0, state->interface_num, NULL, 0, 1000);
 
     if (ret != 0) {
         output("  ...failed\n");
         return ret;
     }
     if (verbose) output("  ...ok\n");
-    definitely_exclusive = false;
+    state->definitely_exclusive = false;
     return 0;
 }
 
@@ -271,9 +363,9 @@ int picoboot_cmd_status_verbose(libusb_device_handle *usb_device, struct picoboo
 
     if (local_verbose) output("CMD_STATUS\n");
     int ret =
-            libusb_control_transfer(usb_device,
-                                    LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_IN,
-                                    PICOBOOT_IF_CMD_STATUS, 0, interface, (uint8_t *) status, sizeof(*status), 1000);
+            control_transfer(usb_device,
+                             LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_IN,
+                             PICOBOOT_IF_CMD_STATUS, 0, device_state(usb_device)->interface_num, (uint8_t *) status, sizeof(*status), 1000);
 
     if (ret != sizeof(*status)) {
         output("  ...failed\n");
@@ -289,37 +381,94 @@ int picoboot_cmd_status(libusb_device_handle *usb_device, struct picoboot_cmd_st
     return picoboot_cmd_status_verbose(usb_device, status, verbose);
 }
 
-int one_time_bulk_timeout;
+// do our defensive best to keep the xip_state and exclusive var up to date after a successful command
+static void update_state_after_cmd(struct picoboot_device_state *state, const struct picoboot_cmd *cmd, enum xip_state saved_xip_state, bool saved_exclusive) {
+    switch (cmd->bCmdId) {
+        case PC_EXIT_XIP:
+            state->xip_state = XIP_INACTIVE;
+            break;
+        case PC_ENTER_CMD_XIP:
+            state->xip_state = XIP_ACTIVE;
+            break;
+        case PC_READ:
+        case PC_WRITE:
+            // whitelist PC_READ and PC_WRITE as not affecting xip state
+            state->xip_state = saved_xip_state;
+            break;
+        default:
+            state->xip_state = XIP_UNKOWN;
+            break;
+    }
+    switch (cmd->bCmdId) {
+        case PC_EXCLUSIVE_ACCESS:
+            state->definitely_exclusive = cmd->exclusive_cmd.bExclusive;
+            break;
+        case PC_ENTER_CMD_XIP:
+        case PC_EXIT_XIP:
+        case PC_READ:
+        case PC_WRITE:
+            // whitelist PC_READ and PC_WRITE as not affecting xip state
+            state->definitely_exclusive = saved_exclusive;
+            break;
+        default:
+            state->definitely_exclusive = false;
+            break;
+    }
+}
+
+static void trace(libusb_device_handle *usb_device, const struct picoboot_cmd *cmd, unsigned int timeout,
+                  enum picoboot_trace_point point, int status) {
+    if (trace_fn) trace_fn(usb_device, cmd, timeout, point, status);
+}
+
+void picoboot_set_trace(picoboot_trace_fn fn) {
+    trace_fn = fn;
+}
+
+static int picoboot_cmd_phases(libusb_device_handle *usb_device, struct picoboot_cmd *cmd, uint8_t *buffer, unsigned int buf_size);
 
 int picoboot_cmd(libusb_device_handle *usb_device, struct picoboot_cmd *cmd, uint8_t *buffer, unsigned int buf_size) {
+    struct picoboot_device_state *state = device_state(usb_device);
+    cmd->dMagic = PICOBOOT_MAGIC;
+    cmd->dToken = state->next_token++;
+    unsigned int timeout = state->one_time_bulk_timeout ? state->one_time_bulk_timeout : 10000;
+    trace(usb_device, cmd, timeout, PICOBOOT_TRACE_START, 0);
+    int ret = picoboot_cmd_phases(usb_device, cmd, buffer, buf_size);
+    trace(usb_device, cmd, timeout, PICOBOOT_TRACE_END, ret);
+    return ret;
+}
+
+static int picoboot_cmd_phases(libusb_device_handle *usb_device, struct picoboot_cmd *cmd, uint8_t *buffer, unsigned int buf_size) {
+    struct picoboot_device_state *state = device_state(usb_device);
+    unsigned int out_ep = state->out_ep;
+    unsigned int in_ep = state->in_ep;
     int sent = 0;
     int ret;
 
-    static int token = 1;
-    cmd->dMagic = PICOBOOT_MAGIC;
-    cmd->dToken = token++;
-    ret = libusb_bulk_transfer(usb_device, out_ep, (uint8_t *) cmd, sizeof(struct picoboot_cmd), &sent, 3000);
+    ret = bulk_transfer(usb_device, out_ep, (uint8_t *) cmd, sizeof(struct picoboot_cmd), &sent, 3000);
+    trace(usb_device, cmd, 3000, PICOBOOT_TRACE_CMD_PHASE, ret || sent == sizeof(struct picoboot_cmd) ? ret : LIBUSB_ERROR_IO);
 
     if (ret != 0 || sent != sizeof(struct picoboot_cmd)) {
         output("   ...failed to send command %d\n", ret);
         return ret;
     }
 
-    int saved_xip_state = xip_state;
-    bool saved_exclusive = definitely_exclusive;
-    xip_state = XIP_UNKOWN;
-    definitely_exclusive = false;
+    enum xip_state saved_xip_state = state->xip_state;
+    bool saved_exclusive = state->definitely_exclusive;
+    state->xip_state = XIP_UNKOWN;
+    state->definitely_exclusive = false;
     int timeout = 10000;
-    if (one_time_bulk_timeout) {
-        timeout = one_time_bulk_timeout;
-        one_time_bulk_timeout = 0;
+    if (state->one_time_bulk_timeout) {
+        timeout = state->one_time_bulk_timeout;
+        state->one_time_bulk_timeout = 0;
     }
     if (cmd->dTransferLength != 0) {
         assert(buf_size >= cmd->dTransferLength);
         if (cmd->bCmdId & 0x80u) {
             if (verbose) output("  receive %d...\n", cmd->dTransferLength);
             int received = 0;
-            ret = libusb_bulk_transfer(usb_device, in_ep, buffer, cmd->dTransferLength, &received, timeout);
+            ret = bulk_transfer(usb_device, in_ep, buffer, cmd->dTransferLength, &received, timeout);
+            trace(usb_device, cmd, timeout, PICOBOOT_TRACE_DATA_PHASE, ret || received == (int) cmd->dTransferLength ? ret : LIBUSB_ERROR_IO);
             if (ret != 0 || received != (int) cmd->dTransferLength) {
                 output("  ...failed to receive data %d %d/%d\n", ret, received, cmd->dTransferLength);
                 if (!ret) ret = 1;
@@ -327,7 +476,8 @@ int picoboot_cmd(libusb_device_handle *usb_device, struct picoboot_cmd *cmd, uin
             }
         } else {
             if (verbose) output("  send %d...\n", cmd->dTransferLength);
-            ret = libusb_bulk_transfer(usb_device, out_ep, buffer, cmd->dTransferLength, &sent, timeout);
+            ret = bulk_transfer(usb_device, out_ep, buffer, cmd->dTransferLength, &sent, timeout);
+            trace(usb_device, cmd, timeout, PICOBOOT_TRACE_DATA_PHASE, ret || sent == (int) cmd->dTransferLength ? ret : LIBUSB_ERROR_IO);
             if (ret != 0 || sent != (int) cmd->dTransferLength) {
                 output("  ...failed to send data %d %d/%d\n", ret, sent, cmd->dTransferLength);
                 if (!ret) ret = 1;
@@ -340,49 +490,230 @@ int picoboot_cmd(libusb_device_handle *usb_device, struct picoboot_cmd *cmd, uin
     // ack is in opposite direction
     int received = 0;
     uint8_t spoon[64];
+    int ack_timeout = cmd->dTransferLength == 0 ? timeout : 3000;
     if (cmd->bCmdId & 0x80u) {
         if (verbose) output("zero length out\n");
-        ret = libusb_bulk_transfer(usb_device, out_ep, spoon, 1, &received, cmd->dTransferLength == 0 ? timeout : 3000);
+        ret = bulk_transfer(usb_device, out_ep, spoon, 1, &received, ack_timeout);
     } else {
         if (verbose) output("zero length in\n");
-        ret = libusb_bulk_transfer(usb_device, in_ep, spoon, 1, &received, cmd->dTransferLength == 0 ? timeout : 3000);
+        ret = bulk_transfer(usb_device, in_ep, spoon, 1, &received, ack_timeout);
+    }
+    trace(usb_device, cmd, ack_timeout, PICOBOOT_TRACE_ACK_PHASE, ret);
+    if (!ret) {
+        update_state_after_cmd(state, cmd, saved_xip_state, saved_exclusive);
+    }
+
+    return ret;
+}
+
+void picoboot_set_context(libusb_context *ctx) {
+    async_ctx = ctx;
+}
+
+// Pipelined command execution using the libusb async API.
+//
+// Each command is made up of up to three bulk transfers (command, data, ack). The transfers for up to
+// PICOBOOT_MAX_IN_FLIGHT commands are submitted ahead of time; libusb queues them in order per endpoint,
+// so the device NAKs each phase until it is ready for it, and the bus never sits idle waiting for the
+// host to issue the next command. Completions are reaped strictly in dToken order.
+//
+// libusb times a transfer from when it is submitted, but a queued transfer can't start until the commands ahead
+// of it are done, so its timeout also allows for the time those commands may take.
+
+#define PICOBOOT_MAX_IN_FLIGHT 4u
+
+enum {
+    PHASE_CMD,
+    PHASE_DATA,
+    PHASE_ACK,
+    PHASE_COUNT
+};
+
+struct async_slot {
+    struct picoboot_cmd *cmd;
+    // the data/ack timeout of the command itself
+    unsigned int timeout;
+    // the longest the command may take once the device gets to it
+    unsigned int duration;
+    struct libusb_transfer *transfers[PHASE_COUNT];
+    unsigned int submitted;
+    unsigned int completed;
+    int done;
+    int failed;
+    uint8_t spoon[64];
+};
+
+static void LIBUSB_CALL async_transfer_cb(struct libusb_transfer *transfer) {
+    struct async_slot *slot = (struct async_slot *) transfer->user_data;
+    // for the ack (which may be zero length) we don't check the length
+    bool is_ack = transfer == slot->transfers[PHASE_ACK];
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED || (!is_ack && transfer->actual_length != transfer->length)) {
+        output("  ...async transfer failed status=%d %d/%d\n", transfer->status, transfer->actual_length, transfer->length);
+        if (!slot->failed) {
+            switch (transfer->status) {
+                case LIBUSB_TRANSFER_TIMED_OUT:
+                    slot->failed = LIBUSB_ERROR_TIMEOUT;
+                    break;
+                case LIBUSB_TRANSFER_STALL:
+                    slot->failed = LIBUSB_ERROR_PIPE;
+                    break;
+                case LIBUSB_TRANSFER_NO_DEVICE:
+                    slot->failed = LIBUSB_ERROR_NO_DEVICE;
+                    break;
+                case LIBUSB_TRANSFER_CANCELLED:
+                    slot->failed = LIBUSB_ERROR_INTERRUPTED;
+                    break;
+                default:
+                    slot->failed = LIBUSB_ERROR_IO;
+                    break;
+            }
+        }
+    }
+    if (trace_fn) {
+        static const enum picoboot_trace_point points[PHASE_COUNT] = {
+            PICOBOOT_TRACE_CMD_PHASE, PICOBOOT_TRACE_DATA_PHASE, PICOBOOT_TRACE_ACK_PHASE
+        };
+        for (int phase = 0; phase < PHASE_COUNT; phase++) {
+            if (transfer == slot->transfers[phase]) {
+                trace(transfer->dev_handle, slot->cmd, transfer->timeout, points[phase], slot->failed);
+            }
+        }
+    }
+    if (++slot->completed == slot->submitted) {
+        slot->done = 1;
+    }
+}
+
+static int async_submit(libusb_device_handle *usb_device, struct async_slot *slot, int phase, unsigned char ep,
+                        uint8_t *buffer, int length, unsigned int timeout) {
+    struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+    if (!transfer) return LIBUSB_ERROR_NO_MEM;
+    libusb_fill_bulk_transfer(transfer, usb_device, ep, buffer, length, async_transfer_cb, slot, timeout);
+    slot->transfers[phase] = transfer;
+    slot->submitted++;
+    int ret = libusb_submit_transfer(transfer);
+    if (ret) {
+        slot->submitted--;
+        slot->transfers[phase] = NULL;
+        libusb_free_transfer(transfer);
+    }
+    return ret;
+}
+
+// queued_ms is the longest the commands already in flight may take
+static int async_submit_cmd(libusb_device_handle *usb_device, struct async_slot *slot, struct picoboot_cmd *cmd, uint8_t *buffer,
+                            unsigned int queued_ms) {
+    struct picoboot_device_state *state = device_state(usb_device);
+    unsigned char out_ep = (unsigned char) state->out_ep;
+    unsigned char in_ep = (unsigned char) state->in_ep;
+    memset(slot, 0, sizeof(*slot));
+    slot->cmd = cmd;
+    cmd->dMagic = PICOBOOT_MAGIC;
+    cmd->dToken = state->next_token++;
+    bool is_in = cmd->bCmdId & 0x80u;
+    if (verbose) output("QUEUE cmd %02x tok=%08x len=%08x\n", cmd->bCmdId, cmd->dToken, cmd->dTransferLength);
+    // as for picoboot_cmd
+    slot->timeout = 10000;
+    if (state->one_time_bulk_timeout) {
+        slot->timeout = state->one_time_bulk_timeout;
+        state->one_time_bulk_timeout = 0;
+    }
+    unsigned int ack_timeout = cmd->dTransferLength == 0 ? slot->timeout : 3000;
+    slot->duration = 3000 + (cmd->dTransferLength != 0 ? slot->timeout : 0) + ack_timeout;
+    trace(usb_device, cmd, slot->timeout, PICOBOOT_TRACE_START, 0);
+    int ret = async_submit(usb_device, slot, PHASE_CMD, out_ep, (uint8_t *) cmd, sizeof(struct picoboot_cmd), queued_ms + 3000);
+    if (!ret && cmd->dTransferLength != 0) {
+        ret = async_submit(usb_device, slot, PHASE_DATA, is_in ? in_ep : out_ep, buffer, cmd->dTransferLength,
+                           queued_ms + 3000 + slot->timeout);
     }
     if (!ret) {
-        // do our defensive best to keep the xip_state up to date
-        switch (cmd->bCmdId) {
-            case PC_EXIT_XIP:
-                xip_state = XIP_INACTIVE;
-                break;
-            case PC_ENTER_CMD_XIP:
-                xip_state = XIP_ACTIVE;
-                break;
-            case PC_READ:
-            case PC_WRITE:
-                // whitelist PC_READ and PC_WRITE as not affecting xip state
-                xip_state = saved_xip_state;
-                break;
-            default:
-                xip_state = XIP_UNKOWN;
-                break;
+        // ack is in opposite direction
+        ret = async_submit(usb_device, slot, PHASE_ACK, is_in ? out_ep : in_ep, slot->spoon, 1, queued_ms + slot->duration);
+    }
+    if (ret) {
+        output("   ...failed to queue command %d\n", ret);
+        slot->failed = ret;
+    }
+    return ret;
+}
+
+static void async_wait(struct async_slot *slot) {
+    while (slot->completed < slot->submitted) {
+        if (libusb_handle_events_completed(async_ctx, &slot->done) < 0) {
+            // should not happen; avoid spinning forever if it does
+            if (!slot->failed) slot->failed = LIBUSB_ERROR_OTHER;
+            break;
         }
-        // do our defensive best to keep the exclusive var up to date
-        switch (cmd->bCmdId) {
-            case PC_EXCLUSIVE_ACCESS:
-                definitely_exclusive = cmd->exclusive_cmd.bExclusive;
-                break;
-            case PC_ENTER_CMD_XIP:
-            case PC_EXIT_XIP:
-            case PC_READ:
-            case PC_WRITE:
-                // whitelist PC_READ and PC_WRITE as not affecting xip state
-                definitely_exclusive = saved_exclusive;
-                break;
-            default:
-                definitely_exclusive = false;
-                break;
+    }
+}
+
+static void async_free(struct async_slot *slot) {
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        if (slot->transfers[i]) {
+            libusb_free_transfer(slot->transfers[i]);
+            slot->transfers[i] = NULL;
         }
     }
+}
 
+int picoboot_cmd_pipelined(libusb_device_handle *usb_device, struct picoboot_cmd *cmds, uint8_t **buffers, unsigned int count) {
+    struct async_slot slots[PICOBOOT_MAX_IN_FLIGHT];
+    unsigned int queued = 0;
+    unsigned int reaped = 0;
+    int ret = 0;
+
+    if (!async_ctx || device_state(usb_device)->transport) {
+        // no context to drive the async API with, so fall back to one command at a time
+        for (unsigned int i = 0; i < count && !ret; i++) {
+            ret = picoboot_cmd(usb_device, &cmds[i], buffers[i], cmds[i].dTransferLength);
+        }
+        return ret;
+    }
+
+    struct picoboot_device_state *state = device_state(usb_device);
+    enum xip_state saved_xip_state = state->xip_state;
+    bool saved_exclusive = state->definitely_exclusive;
+    state->xip_state = XIP_UNKOWN;
+    state->definitely_exclusive = false;
+
+    while (reaped < count) {
+        while (!ret && queued < count && queued - reaped < PICOBOOT_MAX_IN_FLIGHT) {
+            unsigned int queued_ms = 0;
+            for (unsigned int i = reaped; i < queued; i++) {
+                queued_ms += slots[i % PICOBOOT_MAX_IN_FLIGHT].duration;
+            }
+            ret = async_submit_cmd(usb_device, &slots[queued % PICOBOOT_MAX_IN_FLIGHT], &cmds[queued], buffers[queued], queued_ms);
+            queued++;
+        }
+        if (reaped == queued) break;
+        struct async_slot *slot = &slots[reaped % PICOBOOT_MAX_IN_FLIGHT];
+        async_wait(slot);
+        if (!ret) ret = slot->failed;
+        if (ret) {
+            // cancel everything still outstanding; we must wait for the cancellations before freeing
+            for (unsigned int i = reaped; i < queued; i++) {
+                struct async_slot *s = &slots[i % PICOBOOT_MAX_IN_FLIGHT];
+                for (int p = 0; p < PHASE_COUNT; p++) {
+                    if (s->transfers[p]) libusb_cancel_transfer(s->transfers[p]);
+                }
+            }
+            for (unsigned int i = reaped; i < queued; i++) {
+                struct async_slot *s = &slots[i % PICOBOOT_MAX_IN_FLIGHT];
+                async_wait(s);
+                trace(usb_device, s->cmd, s->timeout, PICOBOOT_TRACE_END, s->failed ? s->failed : ret);
+                async_free(s);
+            }
+            break;
+        }
+        trace(usb_device, slot->cmd, slot->timeout, PICOBOOT_TRACE_END, 0);
+        assert(slot->cmd->dToken == cmds[reaped].dToken);
+        if (verbose) output("  ... cmd %02x tok=%08x complete\n", slot->cmd->bCmdId, slot->cmd->dToken);
+        update_state_after_cmd(state, slot->cmd, saved_xip_state, saved_exclusive);
+        saved_xip_state = state->xip_state;
+        saved_exclusive = state->definitely_exclusive;
+        async_free(slot);
+        reaped++;
+    }
     return ret;
 }
 
@@ -397,7 +728,8 @@ int picoboot_exclusive_access(libusb_device_handle *usb_device, uint8_t exclusiv
 }
 
 int picoboot_exit_xip(libusb_device_handle *usb_device) {
-    if (definitely_exclusive && xip_state == XIP_INACTIVE) {
+    struct picoboot_device_state *state = device_state(usb_device);
+    if (state->definitely_exclusive && state->xip_state == XIP_INACTIVE) {
         if (verbose) output("Skipping EXIT_XIP");
         return 0;
     }
@@ -406,7 +738,7 @@ int picoboot_exit_xip(libusb_device_handle *usb_device) {
     cmd.bCmdId = PC_EXIT_XIP;
     cmd.bCmdSize = 0;
     cmd.dTransferLength = 0;
-    xip_state = XIP_INACTIVE;
+    state->xip_state = XIP_INACTIVE;
     return picoboot_cmd(usb_device, &cmd, NULL, 0);
 }
 
@@ -416,7 +748,7 @@ int picoboot_enter_cmd_xip(libusb_device_handle *usb_device) {
     cmd.bCmdId = PC_ENTER_CMD_XIP;
     cmd.bCmdSize = 0;
     cmd.dTransferLength = 0;
-    xip_state = XIP_ACTIVE;
+    device_state(usb_device)->xip_state = XIP_ACTIVE;
     return picoboot_cmd(usb_device, &cmd, NULL, 0);
 }
 
@@ -519,6 +851,55 @@ int picoboot_read(libusb_device_handle *usb_device, uint32_t addr, uint8_t *buff
     return ret;
 }
 
+static void fill_range_cmd(struct picoboot_cmd *cmd, enum picoboot_cmd_id id, const struct picoboot_range *range) {
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->bCmdId = id;
+    cmd->bCmdSize = sizeof(cmd->range_cmd);
+    cmd->range_cmd.dAddr = range->addr;
+    cmd->range_cmd.dSize = range->len;
+    // erase has no data phase
+    cmd->dTransferLength = id == PC_FLASH_ERASE ? 0 : range->len;
+}
+
+static int picoboot_range_batch(libusb_device_handle *usb_device, const enum picoboot_cmd_id *ids, size_t id_stride,
+                                const struct picoboot_range *ranges, size_t range_stride, unsigned int count) {
+    if (!count) return 0;
+    struct picoboot_cmd *cmds = (struct picoboot_cmd *) calloc(count, sizeof(struct picoboot_cmd));
+    uint8_t **buffers = (uint8_t **) calloc(count, sizeof(uint8_t *));
+    int ret = LIBUSB_ERROR_NO_MEM;
+    if (cmds && buffers) {
+        for (unsigned int i = 0; i < count; i++) {
+            enum picoboot_cmd_id id = *(const enum picoboot_cmd_id *) ((const uint8_t *) ids + i * id_stride);
+            const struct picoboot_range *range = (const struct picoboot_range *) ((const uint8_t *) ranges + i * range_stride);
+            assert(id == PC_READ || id == PC_WRITE || id == PC_FLASH_ERASE);
+            if (id == PC_READ) memset(range->buffer, 0xaa, range->len);
+            fill_range_cmd(&cmds[i], id, range);
+            buffers[i] = range->buffer;
+        }
+        ret = picoboot_cmd_pipelined(usb_device, cmds, buffers, count);
+    }
+    free(buffers);
+    free(cmds);
+    return ret;
+}
+
+int picoboot_range_op_batch(libusb_device_handle *usb_device, const struct picoboot_range_op *ops, unsigned int count) {
+    if (verbose) output("RANGE BATCH of %u\n", count);
+    return picoboot_range_batch(usb_device, &ops->id, sizeof(*ops), &ops->range, sizeof(*ops), count);
+}
+
+int picoboot_write_batch(libusb_device_handle *usb_device, const struct picoboot_range *ranges, unsigned int count) {
+    if (verbose) output("WRITE BATCH of %u\n", count);
+    enum picoboot_cmd_id id = PC_WRITE;
+    return picoboot_range_batch(usb_device, &id, 0, ranges, sizeof(*ranges), count);
+}
+
+int picoboot_read_batch(libusb_device_handle *usb_device, const struct picoboot_range *ranges, unsigned int count) {
+    if (verbose) output("READ BATCH of %u\n", count);
+    enum picoboot_cmd_id id = PC_READ;
+    return picoboot_range_batch(usb_device, &id, 0, ranges, sizeof(*ranges), count);
+}
+
 int picoboot_otp_write(libusb_device_handle *usb_device, struct picoboot_otp_cmd *otp_cmd, uint8_t *buffer, uint32_t len) {
     struct picoboot_cmd cmd;
     if (verbose) output("OTP WRITE %04x+%08x ecc=%d\n", (unsigned int) otp_cmd->wRow, otp_cmd->wRowCount, otp_cmd->bEcc);
@@ -530,7 +911,7 @@ int picoboot_otp_write(libusb_device_handle *usb_device, struct picoboot_otp_cmd
 #endif
     cmd.otp_cmd = *otp_cmd;
     cmd.dTransferLength = len;
-    one_time_bulk_timeout = 5000 + len * 5;
+    device_state(usb_device)->one_time_bulk_timeout = 5000 + len * 5;
     return picoboot_cmd(usb_device, &cmd, buffer, len);
 }
 
@@ -728,4 +1109,317 @@ flash_id_return:
     picoboot_exclusive_access(usb_device, 0);
     return ret;
 }
+
+// Per sector flash CRC32 via EXEC; the flash is read through the non-caching XIP alias in command XIP mode,
+// so only the digests need to come back over USB
+//
+// 00000000 <flash_crc32>:
+//    0:   b5f0            push    {r4, r5, r6, r7, lr}
+//    2:   a014            adr     r0, #80         @ (54 <params>)
+//    4:   b401            push    {r0}
+//    6:   6907            ldr     r7, [r0, #16]   @ table
+//    8:   6946            ldr     r6, [r0, #20]   @ poly
+//    a:   2200            movs    r2, #0
+// 0000000c <table_loop>:
+//    c:   0611            lsls    r1, r2, #24
+//    e:   2308            movs    r3, #8
+// 00000010 <table_bit>:
+//   10:   0049            lsls    r1, r1, #1
+//   12:   d300            bcc.n   16 <table_bit+0x6>
+//   14:   4071            eors    r1, r6
+//   16:   3b01            subs    r3, #1
+//   18:   d1fa            bne.n   10 <table_bit>
+//   1a:   0093            lsls    r3, r2, #2
+//   1c:   50f9            str     r1, [r7, r3]
+//   1e:   3201            adds    r2, #1
+//   20:   0a13            lsrs    r3, r2, #8
+//   22:   d0f3            beq.n   c <table_loop>
+//   24:   9800            ldr     r0, [sp, #0]
+//   26:   6885            ldr     r5, [r0, #8]    @ count
+//   28:   68c6            ldr     r6, [r0, #12]   @ crcs
+//   2a:   6800            ldr     r0, [r0, #0]    @ addr
+// 0000002c <sector_loop>:
+//   2c:   9c00            ldr     r4, [sp, #0]
+//   2e:   6864            ldr     r4, [r4, #4]    @ sector_len
+//   30:   2100            movs    r1, #0
+//   32:   43c9            mvns    r1, r1
+// 00000034 <byte_loop>:
+//   34:   7802            ldrb    r2, [r0, #0]
+//   36:   3001            adds    r0, #1
+//   38:   0e0b            lsrs    r3, r1, #24
+//   3a:   4053            eors    r3, r2
+//   3c:   009b            lsls    r3, r3, #2
+//   3e:   58fb            ldr     r3, [r7, r3]
+//   40:   0209            lsls    r1, r1, #8
+//   42:   4059            eors    r1, r3
+//   44:   3c01            subs    r4, #1
+//   46:   d1f5            bne.n   34 <byte_loop>
+//   48:   c602            stmia   r6!, {r1}
+//   4a:   3d01            subs    r5, #1
+//   4c:   d1ee            bne.n   2c <sector_loop>
+//   4e:   bc01            pop     {r0}
+//   50:   bdf0            pop     {r4, r5, r6, r7, pc}
+//   52:   46c0            nop                     ; (mov r8, r8)
+// 00000054 <params>:
+//   54:   addr, sector_len, count, crcs, table, poly
+
+static const size_t picoboot_flash_crc32_cmd_len = 0x54;
+static const uint8_t picoboot_flash_crc32_cmd[] = {
+        0xf0, 0xb5, 0x14, 0xa0, 0x01, 0xb4, 0x07, 0x69, 0x46, 0x69, 0x00, 0x22, 0x11, 0x06, 0x08, 0x23,
+        0x49, 0x00, 0x00, 0xd3, 0x71, 0x40, 0x01, 0x3b, 0xfa, 0xd1, 0x93, 0x00, 0xf9, 0x50, 0x01, 0x32,
+        0x13, 0x0a, 0xf3, 0xd0, 0x00, 0x98, 0x85, 0x68, 0xc6, 0x68, 0x00, 0x68, 0x00, 0x9c, 0x64, 0x68,
+        0x00, 0x21, 0xc9, 0x43, 0x02, 0x78, 0x01, 0x30, 0x0b, 0x0e, 0x53, 0x40, 0x9b, 0x00, 0xfb, 0x58,
+        0x09, 0x02, 0x59, 0x40, 0x01, 0x3c, 0xf5, 0xd1, 0x02, 0xc6, 0x01, 0x3d, 0xee, 0xd1, 0x01, 0xbc,
+        0xf0, 0xbd, 0xc0, 0x46
+};
+#define PICOBOOT_FLASH_CRC32_CMD_PROG_SIZE (size_t)(0x54 + 6 * 4)
+
+#define FLASH_CRC32_CODE_LOC SRAM_START
+#define FLASH_CRC32_TABLE_LOC (FLASH_CRC32_CODE_LOC + 0x400)
+#define FLASH_CRC32_RESULT_LOC (FLASH_CRC32_TABLE_LOC + 0x400)
+#define FLASH_CRC32_XIP_NOCACHE_NOALLOC_BASE 0x13000000u // RP2040
+
+int picoboot_flash_crc32(libusb_device_handle *usb_device, uint32_t addr, uint32_t sector_len, uint32_t count, uint32_t *crcs) {
+    if (!count || !sector_len || count > PICOBOOT_FLASH_CRC32_MAX_SECTORS || addr < FLASH_START ||
+        addr + count * sector_len > FLASH_END_RP2040) {
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+    uint8_t prog[PICOBOOT_FLASH_CRC32_CMD_PROG_SIZE];
+    if (verbose) output("FLASH CRC32 %08x+%08x x %d\n", addr, sector_len, count);
+    memcpy(prog, picoboot_flash_crc32_cmd, picoboot_flash_crc32_cmd_len);
+    uint32_t *params = (uint32_t *) (prog + picoboot_flash_crc32_cmd_len);
+    params[0] = addr - FLASH_START + FLASH_CRC32_XIP_NOCACHE_NOALLOC_BASE;
+    params[1] = sector_len;
+    params[2] = count;
+    params[3] = FLASH_CRC32_RESULT_LOC;
+    params[4] = FLASH_CRC32_TABLE_LOC;
+    params[5] = 0x4c11db7;
+
+    // flash must be in a known state and readable via XIP
+    int ret = picoboot_exit_xip(usb_device);
+    if (ret)
+        return ret;
+    ret = picoboot_enter_cmd_xip(usb_device);
+    if (ret)
+        return ret;
+    ret = picoboot_write(usb_device, FLASH_CRC32_CODE_LOC, prog, PICOBOOT_FLASH_CRC32_CMD_PROG_SIZE);
+    if (ret)
+        return ret;
+    ret = picoboot_exec(usb_device, FLASH_CRC32_CODE_LOC);
+    if (ret)
+        return ret;
+    return picoboot_read(usb_device, FLASH_CRC32_RESULT_LOC, (uint8_t *) crcs, count * sizeof(uint32_t));
+}
+
+// LZ4 block format compression (greedy, single probe), for data which is decompressed by the device
+#define LZ4_MIN_MATCH 4u
+#define LZ4_LAST_LITERALS 5u    // the last bytes of a block are always literals
+#define LZ4_MF_LIMIT 12u        // and the last match starts at least this many bytes before the end
+#define LZ4_MAX_OFFSET 65535u
+#define LZ4_HASH_BITS 12u
+
+static uint32_t lz4_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint8_t *lz4_put_length(uint8_t *op, uint32_t len) {
+    for (; len >= 255; len -= 255) {
+        *op++ = 255;
+    }
+    *op++ = (uint8_t) len;
+    return op;
+}
+
+static uint8_t *lz4_put_sequence(uint8_t *op, const uint8_t *literals, uint32_t lit_len, uint32_t offset, uint32_t match_len) {
+    uint8_t *token = op++;
+    *token = (uint8_t) ((lit_len < 15 ? lit_len : 15) << 4);
+    if (lit_len >= 15) op = lz4_put_length(op, lit_len - 15);
+    memcpy(op, literals, lit_len);
+    op += lit_len;
+    if (offset) {
+        uint32_t ml = match_len - LZ4_MIN_MATCH;
+        *token |= (uint8_t) (ml < 15 ? ml : 15);
+        *op++ = (uint8_t) offset;
+        *op++ = (uint8_t) (offset >> 8);
+        if (ml >= 15) op = lz4_put_length(op, ml - 15);
+    }
+    return op;
+}
+
+// dst must hold PICOBOOT_LZ4_BOUND(len) bytes; returns the compressed length
+static uint32_t lz4_compress(const uint8_t *src, uint32_t len, uint8_t *dst) {
+    uint32_t table[1u << LZ4_HASH_BITS];
+    uint8_t *op = dst;
+    uint32_t anchor = 0;
+    if (len > LZ4_MF_LIMIT) {
+        const uint32_t match_limit = len - LZ4_LAST_LITERALS;
+        const uint32_t mf_limit = len - LZ4_MF_LIMIT;
+        memset(table, 0xff, sizeof(table));
+        for (uint32_t pos = 0; pos <= mf_limit;) {
+            uint32_t seq = lz4_read32(src + pos);
+            uint32_t h = (seq * 2654435761u) >> (32 - LZ4_HASH_BITS);
+            uint32_t ref = table[h];
+            table[h] = pos;
+            if (ref == 0xffffffffu || pos - ref > LZ4_MAX_OFFSET || lz4_read32(src + ref) != seq) {
+                pos++;
+                continue;
+            }
+            uint32_t match_len = LZ4_MIN_MATCH;
+            while (pos + match_len < match_limit && src[ref + match_len] == src[pos + match_len]) {
+                match_len++;
+            }
+            op = lz4_put_sequence(op, src + anchor, pos - anchor, pos - ref, match_len);
+            pos += match_len;
+            anchor = pos;
+        }
+    }
+    return (uint32_t) (lz4_put_sequence(op, src + anchor, len - anchor, 0, 0) - dst);
+}
+
+// Flash programming from LZ4 compressed data via EXEC; the data is decompressed into a RAM staging buffer, and
+// programmed with the bootrom's flash_range_program, but only if it decompressed to the expected length
+//
+// 00000000 <flash_program_lz4>:
+//    0:   b5f0            push    {r4, r5, r6, r7, lr}
+//    2:   a71e            adr     r7, #120 <params>
+//    4:   6838            ldr     r0, [r7]           @ src
+//    6:   6879            ldr     r1, [r7, #4]       @ src_len
+//    8:   1841            adds    r1, r0, r1
+//    a:   68fa            ldr     r2, [r7, #12]      @ staging
+// 0000000c <token>:
+//    c:   7803            ldrb    r3, [r0]
+//    e:   3001            adds    r0, #1
+//   10:   091c            lsrs    r4, r3, #4
+//   12:   2c0f            cmp     r4, #15
+//   14:   d101            bne     1a <literals>
+//   16:   f000 f81e       bl      56 <extend>
+// 0000001a <literals>:
+//   1a:   2c00            cmp     r4, #0
+//   1c:   d005            beq     2a <literals_done>
+// 0000001e <literal_loop>:
+//   1e:   7805            ldrb    r5, [r0]
+//   20:   3001            adds    r0, #1
+//   22:   7015            strb    r5, [r2]
+//   24:   3201            adds    r2, #1
+//   26:   3c01            subs    r4, #1
+//   28:   d1f9            bne     1e <literal_loop>
+// 0000002a <literals_done>:
+//   2a:   4288            cmp     r0, r1
+//   2c:   d219            bhs     62 <done>
+//   2e:   7805            ldrb    r5, [r0]
+//   30:   7846            ldrb    r6, [r0, #1]
+//   32:   3002            adds    r0, #2
+//   34:   0236            lsls    r6, r6, #8
+//   36:   4335            orrs    r5, r6
+//   38:   1b56            subs    r6, r2, r5
+//   3a:   240f            movs    r4, #15
+//   3c:   401c            ands    r4, r3
+//   3e:   2c0f            cmp     r4, #15
+//   40:   d101            bne     46 <match>
+//   42:   f000 f808       bl      56 <extend>
+// 00000046 <match>:
+//   46:   3404            adds    r4, #4
+// 00000048 <match_loop>:
+//   48:   7835            ldrb    r5, [r6]
+//   4a:   3601            adds    r6, #1
+//   4c:   7015            strb    r5, [r2]
+//   4e:   3201            adds    r2, #1
+//   50:   3c01            subs    r4, #1
+//   52:   d1f9            bne     48 <match_loop>
+//   54:   e7da            b       c <token>
+// 00000056 <extend>:
+//   56:   7805            ldrb    r5, [r0]
+//   58:   3001            adds    r0, #1
+//   5a:   1964            adds    r4, r4, r5
+//   5c:   2dff            cmp     r5, #255
+//   5e:   d0fa            beq     56 <extend>
+//   60:   4770            bx      lr
+// 00000062 <done>:
+//   62:   68fb            ldr     r3, [r7, #12]      @ staging
+//   64:   1ad2            subs    r2, r2, r3
+//   66:   61ba            str     r2, [r7, #24]      @ result
+//   68:   6939            ldr     r1, [r7, #16]      @ len
+//   6a:   4291            cmp     r1, r2
+//   6c:   d105            bne     7a <out>
+//   6e:   68b8            ldr     r0, [r7, #8]       @ flash_offset
+//   70:   4619            mov     r1, r3
+//   72:   697b            ldr     r3, [r7, #20]      @ flash_range_program
+//   74:   4798            blx     r3
+//   76:   69fb            ldr     r3, [r7, #28]      @ flash_flush_cache
+//   78:   4798            blx     r3
+// 0000007a <out>:
+//   7a:   bdf0            pop     {r4, r5, r6, r7, pc}
+// 0000007c <params>:
+//   7c:   src, src_len, flash_offset, staging, len, flash_range_program, result, flash_flush_cache
+
+static const size_t picoboot_flash_program_lz4_cmd_len = 0x7c;
+static const uint8_t picoboot_flash_program_lz4_cmd[] = {
+        0xf0, 0xb5, 0x1e, 0xa7, 0x38, 0x68, 0x79, 0x68, 0x41, 0x18, 0xfa, 0x68, 0x03, 0x78, 0x01, 0x30,
+        0x1c, 0x09, 0x0f, 0x2c, 0x01, 0xd1, 0x00, 0xf0, 0x1e, 0xf8, 0x00, 0x2c, 0x05, 0xd0, 0x05, 0x78,
+        0x01, 0x30, 0x15, 0x70, 0x01, 0x32, 0x01, 0x3c, 0xf9, 0xd1, 0x88, 0x42, 0x19, 0xd2, 0x05, 0x78,
+        0x46, 0x78, 0x02, 0x30, 0x36, 0x02, 0x35, 0x43, 0x56, 0x1b, 0x0f, 0x24, 0x1c, 0x40, 0x0f, 0x2c,
+        0x01, 0xd1, 0x00, 0xf0, 0x08, 0xf8, 0x04, 0x34, 0x35, 0x78, 0x01, 0x36, 0x15, 0x70, 0x01, 0x32,
+        0x01, 0x3c, 0xf9, 0xd1, 0xda, 0xe7, 0x05, 0x78, 0x01, 0x30, 0x64, 0x19, 0xff, 0x2d, 0xfa, 0xd0,
+        0x70, 0x47, 0xfb, 0x68, 0xd2, 0x1a, 0xba, 0x61, 0x39, 0x69, 0x91, 0x42, 0x05, 0xd1, 0xb8, 0x68,
+        0x19, 0x46, 0x7b, 0x69, 0x98, 0x47, 0xfb, 0x69, 0x98, 0x47, 0xf0, 0xbd
+};
+#define PICOBOOT_FLASH_PROGRAM_LZ4_CMD_PROG_SIZE (size_t)(0x7c + 8 * 4)
+#define FLASH_PROGRAM_LZ4_RESULT_PARAM 6
+
+#define FLASH_PROGRAM_LZ4_CODE_LOC SRAM_START
+#define FLASH_PROGRAM_LZ4_SRC_LOC (FLASH_PROGRAM_LZ4_CODE_LOC + 0x1000)
+#define FLASH_PROGRAM_LZ4_STAGING_LOC (FLASH_PROGRAM_LZ4_CODE_LOC + 0x20000)
+#if FLASH_PROGRAM_LZ4_SRC_LOC + PICOBOOT_LZ4_BOUND(PICOBOOT_FLASH_PROGRAM_LZ4_MAX_LEN) + 3 > FLASH_PROGRAM_LZ4_STAGING_LOC
+#error LZ4 source buffer overlaps the staging buffer
+#endif
+
+int picoboot_flash_program_lz4(libusb_device_handle *usb_device, uint32_t addr, const uint8_t *data, uint32_t len,
+                               uint32_t flash_range_program, uint32_t flash_flush_cache) {
+    if (!len || len > PICOBOOT_FLASH_PROGRAM_LZ4_MAX_LEN || ((addr | len) & (PAGE_SIZE - 1)) || addr < FLASH_START ||
+        addr + len > FLASH_END_RP2040) {
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+    // rounded up to whole words for the write
+    uint8_t *compressed = malloc(PICOBOOT_LZ4_BOUND(len) + 3);
+    if (!compressed)
+        return LIBUSB_ERROR_NO_MEM;
+    uint32_t compressed_len = lz4_compress(data, len, compressed);
+    memset(compressed + compressed_len, 0, 3);
+    if (verbose) output("FLASH PROGRAM LZ4 %08x+%08x (%08x compressed)\n", addr, len, compressed_len);
+
+    uint8_t prog[PICOBOOT_FLASH_PROGRAM_LZ4_CMD_PROG_SIZE];
+    memcpy(prog, picoboot_flash_program_lz4_cmd, picoboot_flash_program_lz4_cmd_len);
+    uint32_t *params = (uint32_t *) (prog + picoboot_flash_program_lz4_cmd_len);
+    params[0] = FLASH_PROGRAM_LZ4_SRC_LOC;
+    params[1] = compressed_len;
+    params[2] = addr - FLASH_START;
+    params[3] = FLASH_PROGRAM_LZ4_STAGING_LOC;
+    params[4] = len;
+    params[5] = flash_range_program;
+    params[FLASH_PROGRAM_LZ4_RESULT_PARAM] = 0;
+    params[7] = flash_flush_cache;
+
+    int ret = picoboot_write(usb_device, FLASH_PROGRAM_LZ4_SRC_LOC, compressed, (compressed_len + 3) & ~3u);
+    free(compressed);
+    if (ret)
+        return ret;
+    // flash_range_program expects the flash to be out of XIP mode
+    ret = picoboot_exit_xip(usb_device);
+    if (ret)
+        return ret;
+    ret = picoboot_write(usb_device, FLASH_PROGRAM_LZ4_CODE_LOC, prog, PICOBOOT_FLASH_PROGRAM_LZ4_CMD_PROG_SIZE);
+    if (ret)
+        return ret;
+    ret = picoboot_exec(usb_device, FLASH_PROGRAM_LZ4_CODE_LOC);
+    if (ret)
+        return ret;
+    uint32_t result;
+    ret = picoboot_read(usb_device, FLASH_PROGRAM_LZ4_CODE_LOC + picoboot_flash_program_lz4_cmd_len + FLASH_PROGRAM_LZ4_RESULT_PARAM * 4,
+                        (uint8_t *) &result, sizeof(result));
+    if (!ret && result != len)
+        ret = LIBUSB_ERROR_IO;
+    return ret;
+}
 #endif
@@ -42,6 +42,19 @@ enum picoboot_device_result {
 
 
 #if HAS_LIBUSB
+// a single PC_READ/PC_WRITE in a batch
+struct picoboot_range {
+    uint32_t addr;
+    uint32_t len;
+    uint8_t *buffer;
+};
+
+// a PC_FLASH_ERASE (buffer unused), PC_WRITE or PC_READ in a mixed batch
+struct picoboot_range_op {
+    enum picoboot_cmd_id id;
+    struct picoboot_range range;
+};
+
 // note that vid and pid are filters, unless both are specified in which case a device with that VID and PID is allowed for RP2350
 enum picoboot_device_result picoboot_open_device(libusb_device *device, libusb_device_handle **dev_handle, chip_t *chip, int vid, int pid, const char* ser);
 
@@ -66,6 +79,54 @@ int picoboot_otp_read(libusb_device_handle *usb_device, struct picoboot_otp_cmd
 int picoboot_poke(libusb_device_handle *usb_device, uint32_t addr, uint32_t data);
 int picoboot_peek(libusb_device_handle *usb_device, uint32_t addr, uint32_t *data);
 int picoboot_flash_id(libusb_device_handle *usb_device, uint64_t *data);
+// RP2040 only: CRC32 (as crc32_msb with an initial value of 0xffffffff) of count consecutive sector_len byte
+// sectors of flash starting at addr, computed on the device
+#define PICOBOOT_FLASH_CRC32_MAX_SECTORS 64u
+int picoboot_flash_crc32(libusb_device_handle *usb_device, uint32_t addr, uint32_t sector_len, uint32_t count, uint32_t *crcs);
+// RP2040 only: program already erased flash from data which is sent LZ4 compressed, and decompressed on the
+// device. addr and len must be multiples of PAGE_SIZE, and flash_range_program and flash_flush_cache are the addresses
+// of those bootrom functions
+#define PICOBOOT_FLASH_PROGRAM_LZ4_MAX_LEN 0x10000u
+#define PICOBOOT_LZ4_BOUND(len) ((len) + (len) / 255u + 16u)
+int picoboot_flash_program_lz4(libusb_device_handle *usb_device, uint32_t addr, const uint8_t *data, uint32_t len,
+                               uint32_t flash_range_program, uint32_t flash_flush_cache);
+
+// a transport other than libusb for a PICOBOOT device, such as a simulator. It is handed the bulk and control transfers
+// which would otherwise go over USB, and returns the same LIBUSB_ERROR_ codes
+struct picoboot_transport {
+    int (*bulk_transfer)(void *ctx, unsigned char endpoint, uint8_t *data, int length, int *transferred, unsigned int timeout);
+    int (*control_transfer)(void *ctx, uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+                            uint8_t *data, uint16_t length, unsigned int timeout);
+    int (*clear_halt)(void *ctx, unsigned char endpoint);
+    void *ctx;
+};
+// returns a handle for a device reached through the transport, for use with the picoboot_ functions (but not with
+// libusb itself) until it is passed to picoboot_close_transport
+libusb_device_handle *picoboot_open_transport(const struct picoboot_transport *transport, unsigned int out_ep, unsigned int in_ep);
+void picoboot_close_transport(libusb_device_handle *usb_device);
+// the transport for the handle, or NULL if it is a libusb device
+const struct picoboot_transport *picoboot_get_transport(libusb_device_handle *usb_device);
+
+// the libusb context used to drive the async (pipelined) transport; without one, batches are issued serially
+void picoboot_set_context(libusb_context *ctx);
+// tracing of the transport: when set, the function is called as each command starts (status is 0), as each of its
+// transfers completes, and when the command ends. Commands issued by picoboot_cmd_pipelined overlap, and their
+// transfer completions may be reported from within libusb event handling
+enum picoboot_trace_point {
+    PICOBOOT_TRACE_START,
+    PICOBOOT_TRACE_CMD_PHASE,
+    PICOBOOT_TRACE_DATA_PHASE,
+    PICOBOOT_TRACE_ACK_PHASE,
+    PICOBOOT_TRACE_END,
+};
+typedef void (*picoboot_trace_fn)(libusb_device_handle *usb_device, const struct picoboot_cmd *cmd, unsigned int timeout,
+                                  enum picoboot_trace_point point, int status);
+void picoboot_set_trace(picoboot_trace_fn fn);
+// issue count commands with several in flight at once; each buffers[i] must hold cmds[i].dTransferLength bytes
+int picoboot_cmd_pipelined(libusb_device_handle *usb_device, struct picoboot_cmd *cmds, uint8_t **buffers, unsigned int count);
+int picoboot_write_batch(libusb_device_handle *usb_device, const struct picoboot_range *ranges, unsigned int count);
+int picoboot_read_batch(libusb_device_handle *usb_device, const struct picoboot_range *ranges, unsigned int count);
+int picoboot_range_op_batch(libusb_device_handle *usb_device, const struct picoboot_range_op *ops, unsigned int count);
 #endif
 
 // we require 256 (as this is the page size supported by the device)
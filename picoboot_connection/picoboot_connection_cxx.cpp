@@ -127,12 +127,32 @@ void connection::write(uint32_t addr, uint8_t *buffer, uint32_t len) {
 void connection::read(uint32_t addr, uint8_t *buffer, uint32_t len) {
     // Workaround due to picoboot interface not supporting reads over 4MiB
     uint32_t max_chunk_size = 0x00400000;
-    for (uint32_t i=0; i < len; i += max_chunk_size) {
-        uint32_t read_size = std::min(len - i, max_chunk_size);
-        wrap_call([&] { return picoboot_read(device, addr + i, buffer + i, read_size); });
+    if (len <= max_chunk_size) {
+        wrap_call([&] { return picoboot_read(device, addr, buffer, len); });
+    } else {
+        std::vector<picoboot_range> ranges;
+        for (uint32_t i=0; i < len; i += max_chunk_size) {
+            ranges.push_back({addr + i, std::min(len - i, max_chunk_size), buffer + i});
+        }
+        read_batch(ranges);
     }
 }
 
+void connection::write_batch(const std::vector<picoboot_range> &ranges) {
+    if (ranges.empty()) return;
+    wrap_call([&] { return picoboot_write_batch(device, ranges.data(), ranges.size()); });
+}
+
+void connection::read_batch(const std::vector<picoboot_range> &ranges) {
+    if (ranges.empty()) return;
+    wrap_call([&] { return picoboot_read_batch(device, ranges.data(), ranges.size()); });
+}
+
+void connection::range_batch(const std::vector<picoboot_range_op> &ops) {
+    if (ops.empty()) return;
+    wrap_call([&] { return picoboot_range_op_batch(device, ops.data(), ops.size()); });
+}
+
 void connection::otp_write(struct picoboot_otp_cmd *otp_cmd, uint8_t *buffer, uint32_t len) {
     wrap_call([&] { return picoboot_otp_write(device, otp_cmd, buffer, len); });
 }
@@ -144,3 +164,19 @@ void connection::otp_read(struct picoboot_otp_cmd *otp_cmd, uint8_t *buffer, uin
 void connection::flash_id(uint64_t &data) {
     wrap_call([&] { return picoboot_flash_id(device, &data); });
 }
+
+std::vector<uint32_t> connection::flash_crc32(uint32_t addr, uint32_t sector_len, uint32_t count) {
+    std::vector<uint32_t> crcs(count);
+    for (uint32_t i = 0; i < count; i += PICOBOOT_FLASH_CRC32_MAX_SECTORS) {
+        uint32_t this_count = std::min(count - i, PICOBOOT_FLASH_CRC32_MAX_SECTORS);
+        wrap_call([&] { return picoboot_flash_crc32(device, addr + i * sector_len, sector_len, this_count, crcs.data() + i); });
+    }
+    return crcs;
+}
+
+void connection::flash_program_lz4(uint32_t addr, const uint8_t *data, uint32_t len, uint32_t flash_range_program, uint32_t flash_flush_cache) {
+    for (uint32_t offset = 0; offset < len; offset += PICOBOOT_FLASH_PROGRAM_LZ4_MAX_LEN) {
+        uint32_t this_len = std::min(len - offset, PICOBOOT_FLASH_PROGRAM_LZ4_MAX_LEN);
+        wrap_call([&] { return picoboot_flash_program_lz4(device, addr + offset, data + offset, this_len, flash_range_program, flash_flush_cache); });
+    }
+}
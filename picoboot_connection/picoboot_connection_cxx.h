@@ -40,6 +40,7 @@ namespace picoboot {
                 }
             }
         }
+        libusb_device_handle *handle() const { return device; }
         void reset();
         void exclusive_access(uint8_t exclusive);
         void enter_cmd_xip();
@@ -56,9 +57,18 @@ namespace picoboot {
             write(addr, bytes.data(), bytes.size());
         }
         void read(uint32_t addr, uint8_t *buffer, uint32_t len);
+        // pipelined PC_WRITE/PC_READ of several ranges, with multiple commands in flight on the bus
+        void write_batch(const std::vector<picoboot_range> &ranges);
+        void read_batch(const std::vector<picoboot_range> &ranges);
+        // pipelined mix of PC_FLASH_ERASE/PC_WRITE/PC_READ, executed in order
+        void range_batch(const std::vector<picoboot_range_op> &ops);
         void otp_write(struct picoboot_otp_cmd *otp_cmd, uint8_t *buffer, uint32_t len);
         void otp_read(struct picoboot_otp_cmd *otp_cmd, uint8_t *buffer, uint32_t len);
         void flash_id(uint64_t &data);
+        // RP2040 only: device computed crc32_msb digest of each sector_len sector in addr -> addr + count * sector_len
+        std::vector<uint32_t> flash_crc32(uint32_t addr, uint32_t sector_len, uint32_t count);
+        // RP2040 only: program erased flash, sending the data LZ4 compressed to be decompressed on the device
+        void flash_program_lz4(uint32_t addr, const uint8_t *data, uint32_t len, uint32_t flash_range_program, uint32_t flash_flush_cache);
 
         std::vector<uint8_t> read_bytes(uint32_t addr, uint32_t len) {
             std::vector<uint8_t> bytes(len);
@@ -0,0 +1,658 @@
+/*
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "picoboot_sim.h"
+#include "model.h"
+#include "boot/bootrom_constants.h"
+#include "boot/picobin.h"
+#include "hardware/regs/otp_data.h"
+
+#ifdef _WIN32
+#undef min
+#undef max
+#endif
+
+using picoboot::simulated_device;
+
+#define SIM_OUT_EP 0x01u
+#define SIM_IN_EP  0x82u
+
+#define SIM_OTP_ROW_COUNT 4096u
+#define SIM_OTP_PAGE_ROWS 64u
+#define SIM_OTP_PAGE_COUNT (SIM_OTP_ROW_COUNT / SIM_OTP_PAGE_ROWS)
+#define SIM_OTP_SPECIAL_PAGES 3u
+
+#define ROM_MAGIC_ADDR 0x10u
+#define ROM_FUNC_TABLE 0x100u
+#define ROM_DATA_TABLE 0x180u
+// bootrom functions are listed in the RP2040 table, but never run
+#define ROM_FUNC_BASE  0x1000u
+
+struct simulated_device::state {
+    // what is being simulated
+    model_t model;
+    uint32_t flash_size = 4 * 1024 * 1024;
+    std::string flash_file;
+    std::string otp_file;
+    double latency_us = 125;
+    double bandwidth = 1000000;
+    double erase_us = 45000;
+    double program_us = 700;
+    double time_scale = 1;
+
+    std::vector<uint8_t> rom_mem;
+    std::vector<uint8_t> sram_mem;
+    std::vector<uint8_t> xip_sram_mem;
+    std::vector<uint8_t> flash_mem;
+    std::vector<uint32_t> otp;
+
+    picoboot_transport transport;
+    libusb_device_handle *handle = nullptr;
+
+    // the PICOBOOT command state machine; the data for a command is read from, or written to, data
+    enum phase_t {
+        idle,
+        data_in,
+        data_out,
+        ack_in,
+        ack_out,
+    } phase = idle;
+    struct picoboot_cmd cmd;
+    std::vector<uint8_t> data;
+    int result = PICOBOOT_OK;
+    struct picoboot_cmd_status status = {};
+    bool halted_in = false;
+    bool halted_out = false;
+    // device time taken by the current command, which holds up its ack
+    double busy_us = 0;
+    std::chrono::steady_clock::time_point bus_free = std::chrono::steady_clock::now();
+
+    void parse(const std::string &spec);
+    void init_rom();
+    void load();
+
+    void take_time(double us);
+    void stall() {
+        halted_in = halted_out = true;
+    }
+    int bulk_transfer(unsigned char endpoint, uint8_t *buffer, int length, int *transferred);
+    int control_transfer(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index, uint8_t *buffer, uint16_t length);
+
+    void start_command(const struct picoboot_cmd &new_cmd);
+    int execute();
+    uint8_t *ram(enum memory_type type, uint32_t addr, uint32_t len);
+    int read_memory(uint32_t addr, uint8_t *buffer, uint32_t len);
+    int write_memory(uint32_t addr, const uint8_t *buffer, uint32_t len);
+    int flash_erase(uint32_t addr, uint32_t len);
+    int get_info();
+    bool otp_readable(uint32_t row);
+    bool otp_writable(uint32_t row);
+    int otp_read();
+    int otp_write();
+};
+
+static uint32_t parse_size(const std::string &key, const std::string &value) {
+    char *end;
+    double v = strtod(value.c_str(), &end);
+    if (*end == 'k' || *end == 'K') {
+        v *= 1024;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        v *= 1024 * 1024;
+        end++;
+    }
+    if (end == value.c_str() || *end || v < 0 || v > UINT32_MAX) {
+        fail(ERROR_ARGS, "Invalid simulator setting %s=%s", key.c_str(), value.c_str());
+    }
+    return (uint32_t)v;
+}
+
+static double parse_number(const std::string &key, const std::string &value) {
+    char *end;
+    double v = strtod(value.c_str(), &end);
+    if (end == value.c_str() || *end || v < 0) {
+        fail(ERROR_ARGS, "Invalid simulator setting %s=%s", key.c_str(), value.c_str());
+    }
+    return v;
+}
+
+void simulated_device::state::parse(const std::string &spec) {
+    chip_t chip = rp2350;
+    size_t pos = 0;
+    while (pos <= spec.size()) {
+        size_t comma = spec.find(',', pos);
+        if (comma == std::string::npos) comma = spec.size();
+        std::string setting = spec.substr(pos, comma - pos);
+        pos = comma + 1;
+        if (setting.empty()) continue;
+        size_t eq = setting.find('=');
+        std::string key = setting.substr(0, eq);
+        std::string value = eq == std::string::npos ? "" : setting.substr(eq + 1);
+        if (key == "chip") {
+            if (value == "rp2040") {
+                chip = rp2040;
+            } else if (value == "rp2350") {
+                chip = rp2350;
+            } else {
+                fail(ERROR_ARGS, "Unknown simulated chip %s", value.c_str());
+            }
+        } else if (key == "flash") {
+            flash_size = parse_size(key, value);
+            if (!flash_size || flash_size & (FLASH_SECTOR_ERASE_SIZE - 1) || flash_size > 16 * 1024 * 1024) {
+                fail(ERROR_ARGS, "Simulated flash size must be a multiple of 4K, and no more than 16M");
+            }
+        } else if (key == "flash_file") {
+            flash_file = value;
+        } else if (key == "otp_file") {
+            otp_file = value;
+        } else if (key == "latency_us") {
+            latency_us = parse_number(key, value);
+        } else if (key == "bandwidth") {
+            bandwidth = parse_number(key, value);
+            if (!bandwidth) fail(ERROR_ARGS, "Simulated bandwidth must not be zero");
+        } else if (key == "erase_us") {
+            erase_us = parse_number(key, value);
+        } else if (key == "program_us") {
+            program_us = parse_number(key, value);
+        } else if (key == "time_scale") {
+            time_scale = parse_number(key, value);
+        } else {
+            fail(ERROR_ARGS, "Unknown simulator setting %s", key.c_str());
+        }
+    }
+    if (chip == rp2040) {
+        model = std::make_shared<model_rp2040>();
+        model->set_chip_revision(rp2040_b2);
+    } else {
+        model = std::make_shared<model_rp2350>();
+        model->set_chip_revision(rp2350_a4);
+    }
+}
+
+void simulated_device::state::init_rom() {
+    rom_mem.assign(model->rom_end(), 0);
+    auto put16 = [&](uint32_t addr, uint16_t value) {
+        rom_mem[addr] = (uint8_t)value;
+        rom_mem[addr + 1] = (uint8_t)(value >> 8);
+    };
+    // 'M', 'u', chip, version, then the table pointers
+    rom_mem[ROM_MAGIC_ADDR] = 'M';
+    rom_mem[ROM_MAGIC_ADDR + 1] = 'u';
+    if (model->chip() == rp2040) {
+        rom_mem[ROM_MAGIC_ADDR + 2] = 1;
+        rom_mem[ROM_MAGIC_ADDR + 3] = 3; // B2
+        put16(ROM_MAGIC_ADDR + 4, ROM_FUNC_TABLE);
+        put16(ROM_MAGIC_ADDR + 6, ROM_DATA_TABLE);
+        const char *funcs[] = {"P3", "R3", "L3", "T3", "MS", "S4", "MC", "C4", "U3", "UB", "IF", "EX", "RE", "FC", "CX", "RP"};
+        uint32_t addr = ROM_FUNC_TABLE;
+        uint16_t func = ROM_FUNC_BASE;
+        for (const char *f : funcs) {
+            put16(addr, (uint16_t)(f[0] | f[1] << 8));
+            put16(addr + 2, func | 1);
+            addr += 4;
+            func += 0x10;
+        }
+        put16(addr, 0);
+        put16(ROM_DATA_TABLE, 0);
+    } else {
+        // a version 2 table with no entries
+        rom_mem[ROM_MAGIC_ADDR + 2] = 2;
+        rom_mem[ROM_MAGIC_ADDR + 3] = 4; // A4
+        put16(ROM_MAGIC_ADDR + 4, ROM_FUNC_TABLE);
+        put16(ROM_FUNC_TABLE, 0);
+    }
+}
+
+void simulated_device::state::load() {
+    flash_mem.assign(flash_size, 0xff);
+    if (!flash_file.empty()) {
+        FILE *in = fopen(flash_file.c_str(), "rb");
+        if (in) {
+            size_t got = fread(flash_mem.data(), 1, flash_mem.size(), in);
+            (void)got; // a short file leaves the rest erased
+            fclose(in);
+        }
+    }
+    otp.assign(SIM_OTP_ROW_COUNT, 0);
+    if (!otp_file.empty()) {
+        FILE *in = fopen(otp_file.c_str(), "rb");
+        if (in) {
+            size_t got = fread(otp.data(), sizeof(uint32_t), otp.size(), in);
+            (void)got;
+            fclose(in);
+        }
+    }
+}
+
+// Transfers happen one after another on the bus, so each is scheduled after the previous one; if the host is slower
+// than the bus there is no waiting at all
+void simulated_device::state::take_time(double us) {
+    if (time_scale <= 0) return;
+    auto now = std::chrono::steady_clock::now();
+    if (bus_free < now) bus_free = now;
+    bus_free += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::micro>(us * time_scale));
+    std::this_thread::sleep_until(bus_free);
+}
+
+void simulated_device::state::start_command(const struct picoboot_cmd &new_cmd) {
+    cmd = new_cmd;
+    busy_us = 0;
+    status.dToken = cmd.dToken;
+    status.bCmdId = cmd.bCmdId;
+    status.dStatusCode = PICOBOOT_OK;
+    status.bInProgress = 1;
+    bool is_in = cmd.bCmdId & 0x80u;
+    if (cmd.dMagic != PICOBOOT_MAGIC) {
+        result = PICOBOOT_UNKNOWN_ERROR;
+    } else if (!model->supports_picoboot_cmd((picoboot_cmd_id)cmd.bCmdId)) {
+        result = PICOBOOT_UNKNOWN_CMD;
+    } else if (cmd.bCmdSize > sizeof(cmd.args)) {
+        result = PICOBOOT_INVALID_CMD_LENGTH;
+    } else if (is_in || !cmd.dTransferLength) {
+        // commands which return data, or have none, are carried out straight away
+        data.assign(cmd.dTransferLength, 0);
+        result = execute();
+    } else {
+        data.clear();
+        result = PICOBOOT_OK;
+    }
+    if (cmd.dTransferLength) {
+        phase = is_in ? data_in : data_out;
+    } else {
+        phase = is_in ? ack_out : ack_in;
+    }
+}
+
+int simulated_device::state::bulk_transfer(unsigned char endpoint, uint8_t *buffer, int length, int *transferred) {
+    bool is_in = endpoint & 0x80u;
+    *transferred = 0;
+    if (is_in ? halted_in : halted_out) return LIBUSB_ERROR_PIPE;
+    take_time(latency_us + length * 1000000.0 / bandwidth);
+    auto fail_phase = [&]() {
+        status.dStatusCode = result;
+        status.bInProgress = 0;
+        phase = idle;
+        stall();
+        return LIBUSB_ERROR_PIPE;
+    };
+    switch (phase) {
+        case idle:
+            if (is_in || length != sizeof(struct picoboot_cmd)) break;
+            struct picoboot_cmd new_cmd;
+            memcpy(&new_cmd, buffer, sizeof(new_cmd));
+            start_command(new_cmd);
+            *transferred = length;
+            return 0;
+        case data_in:
+            if (!is_in) break;
+            if (result) return fail_phase();
+            memcpy(buffer, data.data(), std::min((size_t)length, data.size()));
+            *transferred = (int)std::min((size_t)length, data.size());
+            phase = ack_out;
+            return 0;
+        case data_out:
+            if (is_in) break;
+            data.insert(data.end(), buffer, buffer + length);
+            *transferred = length;
+            if (data.size() >= cmd.dTransferLength) {
+                data.resize(cmd.dTransferLength);
+                result = execute();
+                phase = ack_in;
+            }
+            return 0;
+        case ack_in:
+        case ack_out:
+            if (is_in != (phase == ack_in)) break;
+            // the ack is only sent once the device has finished the command
+            take_time(busy_us);
+            if (result) return fail_phase();
+            status.bInProgress = 0;
+            phase = idle;
+            return 0;
+    }
+    // a transfer the device isn't expecting
+    result = PICOBOOT_INVALID_STATE;
+    return fail_phase();
+}
+
+int simulated_device::state::control_transfer(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+                                              uint8_t *buffer, uint16_t length) {
+    take_time(latency_us);
+    if ((request_type & 0x1fu) == LIBUSB_RECIPIENT_ENDPOINT && request == LIBUSB_REQUEST_GET_STATUS && length >= 2) {
+        buffer[0] = (index & 0x80u ? halted_in : halted_out) ? 1 : 0;
+        buffer[1] = 0;
+        return 2;
+    }
+    if ((request_type & 0x60u) == LIBUSB_REQUEST_TYPE_VENDOR) {
+        if (request == PICOBOOT_IF_RESET) {
+            phase = idle;
+            halted_in = halted_out = false;
+            return 0;
+        }
+        if (request == PICOBOOT_IF_CMD_STATUS && length >= sizeof(status)) {
+            memcpy(buffer, &status, sizeof(status));
+            return sizeof(status);
+        }
+    }
+    return LIBUSB_ERROR_PIPE;
+}
+
+int simulated_device::state::execute() {
+    switch (cmd.bCmdId) {
+        case PC_EXCLUSIVE_ACCESS:
+        case PC_EXIT_XIP:
+        case PC_ENTER_CMD_XIP:
+        case PC_VECTORIZE_FLASH:
+        case PC_REBOOT:
+        case PC_REBOOT2:
+            // the device stays put, so the simulation can carry on after a reboot
+            return PICOBOOT_OK;
+        case PC_FLASH_ERASE:
+            return flash_erase(cmd.range_cmd.dAddr, cmd.range_cmd.dSize);
+        case PC_READ:
+            if (cmd.range_cmd.dSize != cmd.dTransferLength) return PICOBOOT_INVALID_TRANSFER_LENGTH;
+            return read_memory(cmd.range_cmd.dAddr, data.data(), cmd.dTransferLength);
+        case PC_WRITE:
+            if (cmd.range_cmd.dSize != cmd.dTransferLength) return PICOBOOT_INVALID_TRANSFER_LENGTH;
+            return write_memory(cmd.range_cmd.dAddr, data.data(), cmd.dTransferLength);
+        case PC_GET_INFO:
+            return get_info();
+        case PC_OTP_READ:
+            return otp_read();
+        case PC_OTP_WRITE:
+            return otp_write();
+        default:
+            // including PC_EXEC, as there is nothing to run the code
+            return PICOBOOT_UNKNOWN_CMD;
+    }
+}
+
+// the RAM backing a range of SRAM or XIP SRAM, or nullptr; the model's memory ranges include their end address
+uint8_t *simulated_device::state::ram(enum memory_type type, uint32_t addr, uint32_t len) {
+    std::vector<uint8_t> *mem;
+    uint32_t base;
+    if (type == sram) {
+        mem = &sram_mem;
+        base = SRAM_START;
+    } else if (type == xip_sram) {
+        mem = &xip_sram_mem;
+        base = model->xip_sram_start();
+    } else {
+        return nullptr;
+    }
+    if (addr - base + len > mem->size()) return nullptr;
+    return mem->data() + (addr - base);
+}
+
+int simulated_device::state::read_memory(uint32_t addr, uint8_t *buffer, uint32_t len) {
+    if (!len) return PICOBOOT_OK;
+    enum memory_type type = model->get_memory_type(addr);
+    if (type != model->get_memory_type(addr + len - 1)) return PICOBOOT_INVALID_ADDRESS;
+    switch (type) {
+        case rom:
+            if (addr + len > model->unreadable_rom_start() || addr + len > rom_mem.size()) return PICOBOOT_INVALID_ADDRESS;
+            memcpy(buffer, rom_mem.data() + addr, len);
+            return PICOBOOT_OK;
+        case flash:
+            // the flash is mirrored throughout its address window
+            for (uint32_t i = 0; i < len; i++) {
+                buffer[i] = flash_mem[(addr - FLASH_START + i) % flash_size];
+            }
+            return PICOBOOT_OK;
+        default: {
+            uint8_t *mem = ram(type, addr, len);
+            if (!mem) return PICOBOOT_INVALID_ADDRESS;
+            memcpy(buffer, mem, len);
+            return PICOBOOT_OK;
+        }
+    }
+}
+
+int simulated_device::state::write_memory(uint32_t addr, const uint8_t *buffer, uint32_t len) {
+    if (!len) return PICOBOOT_OK;
+    enum memory_type type = model->get_memory_type(addr);
+    if (type != model->get_memory_type(addr + len - 1)) return PICOBOOT_INVALID_ADDRESS;
+    switch (type) {
+        case flash:
+            if ((addr | len) & (PAGE_SIZE - 1)) return PICOBOOT_BAD_ALIGNMENT;
+            // programming can only clear bits
+            for (uint32_t i = 0; i < len; i++) {
+                flash_mem[(addr - FLASH_START + i) % flash_size] &= buffer[i];
+            }
+            busy_us += program_us * (len / PAGE_SIZE);
+            return PICOBOOT_OK;
+        default: {
+            uint8_t *mem = ram(type, addr, len);
+            if (!mem) return PICOBOOT_INVALID_ADDRESS;
+            memcpy(mem, buffer, len);
+            return PICOBOOT_OK;
+        }
+    }
+}
+
+int simulated_device::state::flash_erase(uint32_t addr, uint32_t len) {
+    if ((addr | len) & (FLASH_SECTOR_ERASE_SIZE - 1)) return PICOBOOT_BAD_ALIGNMENT;
+    if (!len) return PICOBOOT_OK;
+    if (model->get_memory_type(addr) != flash || model->get_memory_type(addr + len - 1) != flash) {
+        return PICOBOOT_INVALID_ADDRESS;
+    }
+    for (uint32_t i = 0; i < len; i++) {
+        flash_mem[(addr - FLASH_START + i) % flash_size] = 0xff;
+    }
+    busy_us += erase_us * (len / FLASH_SECTOR_ERASE_SIZE);
+    return PICOBOOT_OK;
+}
+
+int simulated_device::state::get_info() {
+    std::vector<uint32_t> words;
+    uint32_t flags = cmd.get_info_cmd.dParams[0];
+    switch (cmd.get_info_cmd.bType) {
+        case PICOBOOT_GET_INFO_SYS: {
+            uint32_t included = flags & (SYS_INFO_CHIP_INFO | SYS_INFO_CRITICAL | SYS_INFO_CPU_INFO |
+                                         SYS_INFO_FLASH_DEV_INFO | SYS_INFO_BOOT_RANDOM | SYS_INFO_BOOT_INFO);
+            words.push_back(included);
+            if (included & SYS_INFO_CHIP_INFO) {
+                // QFN60, and a made up chip id
+                words.insert(words.end(), {1, 0x5157a7e0, 0x00000001});
+            }
+            if (included & SYS_INFO_CRITICAL) words.push_back(0);
+            if (included & SYS_INFO_CPU_INFO) words.push_back(0); // ARM
+            if (included & SYS_INFO_FLASH_DEV_INFO) words.push_back(0x0c00);
+            if (included & SYS_INFO_BOOT_RANDOM) words.insert(words.end(), {0x12345678, 0x9abcdef0, 0x0fedcba9, 0x87654321});
+            if (included & SYS_INFO_BOOT_INFO) {
+                uint8_t none = (uint8_t)BOOT_PARTITION_NONE;
+                words.insert(words.end(), {none | (uint32_t)none << 16 | 0x80u << 24, 0, 0, 0});
+            }
+            break;
+        }
+        case PICOBOOT_GET_INFO_PARTTION_TABLE:
+            // there is never a partition table
+            words.push_back(flags);
+            if (flags & PT_INFO_PT_INFO) words.insert(words.end(), {0, 0, 0});
+            break;
+        case PICOBOOT_GET_INFO_UF2_TARGET_PARTITION:
+            // everything goes to absolute space
+            words.insert(words.end(), {
+                (uint32_t)PARTITION_TABLE_NO_PARTITION_INDEX,
+                (0u << PICOBIN_PARTITION_LOCATION_FIRST_SECTOR_LSB) |
+                ((flash_size / FLASH_SECTOR_ERASE_SIZE - 1) << PICOBIN_PARTITION_LOCATION_LAST_SECTOR_LSB) |
+                PICOBIN_PARTITION_PERMISSIONS_BITS,
+                0
+            });
+            break;
+        case PICOBOOT_GET_INFO_UF2_STATUS:
+            words.insert(words.end(), {0, 0, 0, 0});
+            break;
+        default:
+            return PICOBOOT_INVALID_ARG;
+    }
+    words.insert(words.begin(), (uint32_t)words.size());
+    if (words.size() * 4 > data.size()) return PICOBOOT_BUFFER_TOO_SMALL;
+    memcpy(data.data(), words.data(), words.size() * 4);
+    return PICOBOOT_OK;
+}
+
+// the page locks are stored three times over, in bits 7:0, 15:8 and 23:16 of their rows
+static uint8_t lock_vote(uint32_t raw) {
+    uint8_t a = raw, b = raw >> 8, c = raw >> 16;
+    return (a & b) | (a & c) | (b & c);
+}
+
+bool simulated_device::state::otp_readable(uint32_t row) {
+    uint32_t page = row / SIM_OTP_PAGE_ROWS;
+    if (page >= SIM_OTP_PAGE_COUNT - SIM_OTP_SPECIAL_PAGES) return true;
+    uint8_t lock0 = lock_vote(otp[OTP_DATA_PAGE0_LOCK0_ROW + page * 2]);
+    uint8_t lock1 = lock_vote(otp[OTP_DATA_PAGE0_LOCK0_ROW + page * 2 + 1]);
+    uint32_t lock_bl = (lock1 & OTP_DATA_PAGE0_LOCK1_LOCK_BL_BITS) >> OTP_DATA_PAGE0_LOCK1_LOCK_BL_LSB;
+    uint32_t lock_s = (lock1 & OTP_DATA_PAGE0_LOCK1_LOCK_S_BITS) >> OTP_DATA_PAGE0_LOCK1_LOCK_S_LSB;
+    if (lock_bl >= 2 || lock_s >= 2) return false;
+    return !((lock0 & OTP_DATA_PAGE0_LOCK0_KEY_R_BITS) && (lock0 & OTP_DATA_PAGE0_LOCK0_NO_KEY_STATE_BITS));
+}
+
+bool simulated_device::state::otp_writable(uint32_t row) {
+    uint32_t page = row / SIM_OTP_PAGE_ROWS;
+    if (page >= SIM_OTP_PAGE_COUNT - SIM_OTP_SPECIAL_PAGES) return true;
+    uint8_t lock0 = lock_vote(otp[OTP_DATA_PAGE0_LOCK0_ROW + page * 2]);
+    uint8_t lock1 = lock_vote(otp[OTP_DATA_PAGE0_LOCK0_ROW + page * 2 + 1]);
+    return !(lock1 & OTP_DATA_PAGE0_LOCK1_LOCK_BL_BITS) && !(lock1 & OTP_DATA_PAGE0_LOCK1_LOCK_S_BITS) &&
+           !(lock0 & OTP_DATA_PAGE0_LOCK0_KEY_W_BITS);
+}
+
+static uint32_t even_parity(uint32_t input) {
+    uint32_t parity = 0;
+    for (; input; input &= input - 1) parity ^= 1;
+    return parity;
+}
+
+// 16 data bits to 22 bits with the Hamming code parity (as otp_calculate_ecc in main.cpp)
+static uint32_t otp_ecc(uint16_t x) {
+    uint32_t p0 = even_parity(x & 0b1010110101011011);
+    uint32_t p1 = even_parity(x & 0b0011011001101101);
+    uint32_t p2 = even_parity(x & 0b1100011110001110);
+    uint32_t p3 = even_parity(x & 0b0000011111110000);
+    uint32_t p4 = even_parity(x & 0b1111100000000000);
+    uint32_t p5 = even_parity(x) ^ p0 ^ p1 ^ p2 ^ p3 ^ p4;
+    uint32_t p = p0 | (p1 << 1) | (p2 << 2) | (p3 << 3) | (p4 << 4) | (p5 << 5);
+    return x | (p << 16);
+}
+
+int simulated_device::state::otp_read() {
+    const struct picoboot_otp_cmd &otp_cmd = cmd.otp_cmd;
+    uint32_t row_size = otp_cmd.bEcc ? 2 : 4;
+    if (otp_cmd.wRow + otp_cmd.wRowCount > SIM_OTP_ROW_COUNT) return PICOBOOT_INVALID_ADDRESS;
+    if (cmd.dTransferLength != otp_cmd.wRowCount * row_size) return PICOBOOT_INVALID_TRANSFER_LENGTH;
+    for (uint32_t i = 0; i < otp_cmd.wRowCount; i++) {
+        uint32_t row = otp_cmd.wRow + i;
+        if (!otp_readable(row)) return PICOBOOT_NOT_PERMITTED;
+        uint32_t raw = otp[row];
+        if (!otp_cmd.bEcc) {
+            memcpy(data.data() + i * 4, &raw, 4);
+            continue;
+        }
+        // bit repair by polarity: both top bits set means the row was written inverted
+        if ((raw >> 22) == 3) raw ^= 0xffffff;
+        raw &= 0x3fffff;
+        if (raw && otp_ecc(raw & 0xffff) != raw) {
+            // correct a single bit error, but not more
+            bool corrected = false;
+            for (int bit = 0; bit < 22 && !corrected; bit++) {
+                uint32_t fixed = raw ^ (1u << bit);
+                if (otp_ecc(fixed & 0xffff) == fixed) {
+                    raw = fixed;
+                    corrected = true;
+                }
+            }
+            if (!corrected) return PICOBOOT_INVALID_DATA;
+        }
+        uint16_t value = (uint16_t)raw;
+        memcpy(data.data() + i * 2, &value, 2);
+    }
+    return PICOBOOT_OK;
+}
+
+int simulated_device::state::otp_write() {
+    const struct picoboot_otp_cmd &otp_cmd = cmd.otp_cmd;
+    uint32_t row_size = otp_cmd.bEcc ? 2 : 4;
+    if (otp_cmd.wRow + otp_cmd.wRowCount > SIM_OTP_ROW_COUNT) return PICOBOOT_INVALID_ADDRESS;
+    if (cmd.dTransferLength != otp_cmd.wRowCount * row_size) return PICOBOOT_INVALID_TRANSFER_LENGTH;
+    for (uint32_t i = 0; i < otp_cmd.wRowCount; i++) {
+        if (!otp_writable(otp_cmd.wRow + i)) return PICOBOOT_NOT_PERMITTED;
+    }
+    for (uint32_t i = 0; i < otp_cmd.wRowCount; i++) {
+        uint32_t row = otp_cmd.wRow + i;
+        uint32_t value;
+        if (otp_cmd.bEcc) {
+            uint16_t v;
+            memcpy(&v, data.data() + i * 2, 2);
+            value = otp_ecc(v);
+        } else {
+            memcpy(&value, data.data() + i * 4, 4);
+            value &= 0xffffff;
+        }
+        // bits can be set, but never cleared
+        if (otp[row] & ~value) return PICOBOOT_UNSUPPORTED_MODIFICATION;
+        otp[row] = value;
+    }
+    return PICOBOOT_OK;
+}
+
+simulated_device::simulated_device(const std::string &spec) : s(new state) {
+    s->parse(spec);
+    s->init_rom();
+    s->sram_mem.assign(s->model->sram_end() - SRAM_START, 0);
+    s->xip_sram_mem.assign(s->model->xip_sram_end() - s->model->xip_sram_start(), 0);
+    s->load();
+    s->transport.bulk_transfer = [](void *ctx, unsigned char endpoint, uint8_t *data, int length, int *transferred, unsigned int timeout) {
+        return ((state *)ctx)->bulk_transfer(endpoint, data, length, transferred);
+    };
+    s->transport.control_transfer = [](void *ctx, uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+                                       uint8_t *data, uint16_t length, unsigned int timeout) {
+        return ((state *)ctx)->control_transfer(request_type, request, value, index, data, length);
+    };
+    s->transport.clear_halt = [](void *ctx, unsigned char endpoint) {
+        auto st = (state *)ctx;
+        (endpoint & 0x80u ? st->halted_in : st->halted_out) = false;
+        return 0;
+    };
+    s->transport.ctx = s.get();
+    s->handle = picoboot_open_transport(&s->transport, SIM_OUT_EP, SIM_IN_EP);
+}
+
+simulated_device::~simulated_device() {
+    picoboot_close_transport(s->handle);
+}
+
+libusb_device_handle *simulated_device::handle() const {
+    return s->handle;
+}
+
+chip_t simulated_device::chip() const {
+    return s->model->chip();
+}
+
+void simulated_device::save() {
+    if (!s->flash_file.empty()) {
+        FILE *out = fopen(s->flash_file.c_str(), "wb");
+        if (!out || fwrite(s->flash_mem.data(), 1, s->flash_mem.size(), out) != s->flash_mem.size()) {
+            if (out) fclose(out);
+            fail(ERROR_WRITE_FAILED, "Could not write simulated flash to %s", s->flash_file.c_str());
+        }
+        fclose(out);
+    }
+    if (!s->otp_file.empty()) {
+        FILE *out = fopen(s->otp_file.c_str(), "wb");
+        if (!out || fwrite(s->otp.data(), sizeof(uint32_t), s->otp.size(), out) != s->otp.size()) {
+            if (out) fclose(out);
+            fail(ERROR_WRITE_FAILED, "Could not write simulated OTP to %s", s->otp_file.c_str());
+        }
+        fclose(out);
+    }
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2024 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _PICOBOOT_SIM_H
+#define _PICOBOOT_SIM_H
+
+#include <memory>
+#include <string>
+#include "picoboot_connection.h"
+
+namespace picoboot {
+    // An RP2040 or RP2350 in BOOTSEL mode, simulated in process behind a picoboot_transport, so that commands can be
+    // run (and timed) without any hardware. The spec is a comma separated list of settings:
+    //
+    //   chip=rp2040|rp2350   the chip to simulate (default rp2350)
+    //   flash=<size>         flash size in bytes, with an optional k or M suffix (default 4M)
+    //   flash_file=<path>    file holding the flash contents, read at start (if present) and written back by save()
+    //   otp_file=<path>      likewise for the OTP (RP2350 only), 4 bytes per raw row
+    //   latency_us=<us>      time taken by each USB transfer (default 125)
+    //   bandwidth=<bytes/s>  USB data rate (default 1000000)
+    //   erase_us=<us>        time to erase a 4K flash sector (default 45000)
+    //   program_us=<us>      time to program a 256 byte flash page (default 700)
+    //   time_scale=<factor>  multiplier for all of the times; 0 runs without any delays (default 1)
+    //
+    // PC_EXEC is rejected with PICOBOOT_UNKNOWN_CMD, as code can't be run on the simulated device
+    struct simulated_device {
+        explicit simulated_device(const std::string &spec);
+        ~simulated_device();
+        libusb_device_handle *handle() const;
+        chip_t chip() const;
+        // write the flash and OTP contents back to their files, if any
+        void save();
+
+    private:
+        struct state;
+        std::unique_ptr<state> s;
+    };
+}
+
+#endif
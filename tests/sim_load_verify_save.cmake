@@ -0,0 +1,45 @@
+# Loads a BIN file onto a simulated RP2040, then checks it with verify, and by saving it back both in full and
+# sparse. The data ends two pages into a sector, so the sparse UF2 leaves out the erased rest of that sector.
+#
+# usage: cmake -D PICOTOOL=<picotool> -D WORK_DIR=<dir> -P sim_load_verify_save.cmake
+
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+
+# the simulated flash is kept in a file between commands; time_scale=0 runs without the simulated delays
+set(ENV{PICOTOOL_SIMULATOR} "chip=rp2040,flash=64k,flash_file=${WORK_DIR}/flash.bin,time_scale=0")
+
+# two sectors and two pages of data
+string(RANDOM LENGTH 8704 RANDOM_SEED 2040 DATA)
+file(WRITE ${WORK_DIR}/data.bin "${DATA}")
+
+# expect is PASS, or FAIL for a command which should return an error
+function(run_picotool expect)
+    list(JOIN ARGN " " command)
+    execute_process(COMMAND ${PICOTOOL} ${ARGN}
+            WORKING_DIRECTORY ${WORK_DIR}
+            RESULT_VARIABLE rc
+            OUTPUT_VARIABLE output
+            ERROR_VARIABLE output)
+    message("picotool ${command}\n${output}")
+    if (expect STREQUAL "PASS" AND NOT rc EQUAL 0)
+        message(FATAL_ERROR "picotool ${command} failed (${rc})")
+    elseif (expect STREQUAL "FAIL" AND rc EQUAL 0)
+        message(FATAL_ERROR "picotool ${command} should have failed")
+    endif()
+endfunction()
+
+run_picotool(PASS load -v data.bin)
+run_picotool(PASS verify data.bin)
+
+run_picotool(PASS save -r 0x10000000 0x10002200 saved.bin)
+execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${WORK_DIR}/data.bin ${WORK_DIR}/saved.bin RESULT_VARIABLE rc)
+if (NOT rc EQUAL 0)
+    message(FATAL_ERROR "saved.bin does not match data.bin")
+endif()
+
+# the third sector is only partly programmed, so its erased pages are holes in the sparse UF2
+run_picotool(PASS save -r 0x10000000 0x10003000 --sparse -v sparse.uf2)
+run_picotool(PASS verify sparse.uf2 --sparse)
+# without --sparse the holes are compared as zeros, which the erased flash doesn't hold
+run_picotool(FAIL verify sparse.uf2)